@@ -22,5 +22,5 @@ void setup(void)
 
 void loop() {
   // put your main code here, to run repeatedly:
-  stepper.dropinCli();
+  stepper.dropinCliService();		//Returns at once, so other code can run here too
 }
\ No newline at end of file
@@ -0,0 +1,108 @@
+/** @file bench_stall.cpp
+ * @brief      Host timing of detectStall() for every stall detection algorithm
+ *
+ *             A trace of the encoder and profile position is recorded on the
+ *             simulated board, for a move at 3000 steps/s into a hard stop. It is
+ *             replayed into detectStall() with each algorithm, timing the calls and
+ *             reporting the sample where the stall is first reported. The host
+ *             numbers compare the algorithms with each other, not with the cycle
+ *             budget of the ATmega328PB.
+ */
+
+#include "hostSim.h"
+#include <chrono>
+#include <vector>
+
+#define ROUNDS 200
+
+uStepperSLite stepper(5000, 3000);
+
+typedef struct
+{
+	int32_t encoder;		/**< uStepperEncoder::angleMoved */
+	int32_t reference;		/**< uStepperSLite::stepsSinceReset */
+} traceSample_t;
+
+typedef struct
+{
+	uint8_t algorithm;
+	const char *name;
+} algorithm_t;
+
+static const algorithm_t algorithms[] = {
+	{STALLDETECTIIR, "IIR"},
+	{STALLDETECTFOLLOWINGERROR, "following error"},
+	{STALLDETECTVELOCITYRATIO, "velocity ratio"},
+	{STALLDETECTOFF, "off"},
+};
+
+int main(void)
+{
+	std::vector<traceSample_t> trace;
+	traceSample_t sample;
+	size_t wallSample = 0, detected;
+	double nanoseconds;
+
+	hostSimInit();
+	stepper.setup(NORMAL, HOSTSIMSTEPSPERREVOLUTION);
+	hostSimRun(stepper, 0.1);
+
+	//Record: 1 s free run, then 2 s against the stop
+	stepper.runContinous(CW);
+	for(double t = 0.0; t < 3.0; t += ENCODERINTSAMPLETIME)
+	{
+		if(t >= 1.0 && !wallSample)
+		{
+			hostSimWall = hostSimRotorPosition();
+			wallSample = trace.size();
+		}
+		hostSimRun(stepper, ENCODERINTSAMPLETIME);
+		sample.encoder = stepper.encoder.angleMoved;
+		sample.reference = stepper.stepsSinceReset;
+		trace.push_back(sample);
+	}
+	stepper.stop(HARD);
+	hostSimRun(stepper, 0.5);
+
+	//Replay, without the encoder interrupt, which would call detectStall() itself
+	TIMSK1 = 0;
+
+	printf("%lu samples, stop hit at sample %lu\n", (unsigned long)trace.size(), (unsigned long)wallSample);
+	printf("algorithm          ns/call  detected after (samples)\n");
+
+	for(uint8_t i = 0; i < sizeof(algorithms) / sizeof(algorithms[0]); i++)
+	{
+		stepper.setStallDetection(algorithms[i].algorithm);
+		stepper.isStalled(0.992);
+		stepper.state = CRUISE;
+		detected = 0;
+
+		std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+		for(int round = 0; round < ROUNDS; round++)
+		{
+			stepper.setStallDetection(algorithms[i].algorithm);
+			for(size_t j = 0; j < trace.size(); j++)
+			{
+				stepper.encoder.angleMoved = trace[j].encoder;
+				stepper.stepsSinceReset = trace[j].reference;
+				if(stepper.detectStall() && !detected)
+				{
+					detected = j;
+				}
+			}
+		}
+		nanoseconds = std::chrono::duration<double, std::nano>(std::chrono::high_resolution_clock::now() - start).count() / ((double)ROUNDS * trace.size());
+
+		if(detected)
+		{
+			printf("%-16s %8.1f  %8ld\n", algorithms[i].name, nanoseconds, (long)(detected - wallSample));
+		}
+		else
+		{
+			printf("%-16s %8.1f  %8s\n", algorithms[i].name, nanoseconds, "-");
+		}
+	}
+	stepper.state = STOP;
+
+	return 0;
+}
@@ -0,0 +1,66 @@
+/** @file bench_stepdelay.cpp
+ * @brief      Host timing of stepDelayFromSpeed() against the float division it replaces
+ *
+ *             Both are timed over the same speeds, spread logarithmically from 5 to
+ *             2^18 steps/s. The host has a hardware divider, unlike the ATmega328PB,
+ *             so the numbers compare the integer path with itself between changes,
+ *             not with the AVR float library.
+ */
+
+#include "hostSim.h"
+#include <uStepperSLite.cpp>		//stepDelayFromSpeed() is local to the library source
+#include <chrono>
+#include <vector>
+
+#define SPEEDS 4096
+#define ROUNDS 2000
+
+/** The float expression stepDelayFromSpeed() replaces, in Q24.8 */
+static uint32_t __attribute__((noinline)) stepDelayFromDivision(float speed)
+{
+	speed = fabs(speed);
+	if(speed <= 5.0)
+	{
+		return (uint32_t)20000 << 8;
+	}
+
+	return (uint32_t)((STEPGENERATORFREQUENCY * 256.0f) / speed + 0.5f);
+}
+
+template <class Function> static double timePerCall(Function function, const std::vector<float> &speeds, uint32_t *checksum)
+{
+	std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+	uint32_t sum = 0;
+
+	for(int round = 0; round < ROUNDS; round++)
+	{
+		for(size_t i = 0; i < speeds.size(); i++)
+		{
+			sum += function(speeds[i]);
+		}
+	}
+	*checksum = sum;
+
+	return std::chrono::duration<double, std::nano>(std::chrono::high_resolution_clock::now() - start).count() / ((double)ROUNDS * speeds.size());
+}
+
+int main(void)
+{
+	std::vector<float> speeds;
+	uint32_t checksumTable, checksumDivision;
+	double table, division;
+
+	for(int i = 0; i < SPEEDS; i++)
+	{
+		speeds.push_back((i & 1 ? -1.0 : 1.0) * 5.0 * pow(262144.0 / 5.0, (double)i / (SPEEDS - 1)));
+	}
+
+	table = timePerCall(stepDelayFromSpeed, speeds, &checksumTable);
+	division = timePerCall(stepDelayFromDivision, speeds, &checksumDivision);
+
+	printf("stepDelayFromSpeed  %6.2f ns/call\n", table);
+	printf("float division      %6.2f ns/call\n", division);
+	printf("checksums %lu %lu\n", (unsigned long)checksumTable, (unsigned long)checksumDivision);
+
+	return 0;
+}
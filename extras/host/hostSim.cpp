@@ -0,0 +1,283 @@
+/** @file hostSim.cpp
+ * @brief      Simulated uStepper S-lite board for host tests of the library
+ */
+
+#include "hostSim.h"
+
+#define private public
+#define protected public
+#include <TMC2208.h>
+#undef private
+#undef protected
+
+/** @name TWI1 registers, as addressed by i2cMaster */
+///@{
+#define TWSR1ADDR 0xD9
+#define TWDR1ADDR 0xDB
+#define TWCR1ADDR 0xDC
+///@}
+
+/** @name AS5600 registers */
+///@{
+#define AS5600STATUS 0x0B
+#define AS5600RAWANGLE 0x0C
+#define AS5600ANGLE 0x0E
+#define AS5600AGC 0x1A
+#define AS5600MAGNITUDE 0x1B
+///@}
+
+/** Angle read by the encoder at position zero, so the home position is not at the wrap */
+#define ENCODERZERO 1000
+
+double hostSimRotorOffset = 0.0;
+double hostSimWall = INFINITY;
+double hostSimEncoderNoise = 0.0;
+uint32_t hostSimTwiBits = 0;
+uint32_t hostSimEncoderInterrupts = 0;
+uint32_t hostSimStepInterrupts = 0;
+int hostTestFailures = 0;
+
+/** Simulated time in CPU cycles */
+static uint64_t cycles = 0;
+/** Cycles since the last increment of timer three */
+static uint32_t timer3Residue = 0;
+
+static uint8_t twiRegister[256];
+
+/** Bus phase of the simulated AS5600 */
+static enum {TWIIDLE, TWIADDRESS, TWIREGISTER, TWIWRITE, TWIREAD} twiPhase = TWIIDLE;
+static bool twiStarted = 0;
+static uint8_t encoderPointer = 0;
+
+double hostSimRotorPosition(void)
+{
+	return (double)halSimDriverSteps + hostSimRotorOffset;
+}
+
+static double gaussian(void)
+{
+	double u1 = (rand() + 1.0) / (RAND_MAX + 2.0);
+	double u2 = (rand() + 1.0) / (RAND_MAX + 2.0);
+
+	return sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2);
+}
+
+static uint16_t encoderAngle(void)
+{
+	double counts = hostSimRotorPosition() * 4096.0 / HOSTSIMSTEPSPERREVOLUTION;
+	int32_t angle;
+
+	if(hostSimEncoderNoise > 0.0)
+	{
+		counts += hostSimEncoderNoise * gaussian();
+	}
+
+	angle = ((int32_t)floor(counts) + ENCODERZERO) % 4096;
+
+	return (uint16_t)(angle < 0 ? angle + 4096 : angle);
+}
+
+static uint8_t encoderRegister(uint8_t address)
+{
+	static uint16_t angle;
+
+	switch(address)
+	{
+		case AS5600STATUS: return 0x20;		//Magnet detected
+		case AS5600RAWANGLE: case AS5600ANGLE:
+			angle = encoderAngle();		//Both bytes of a read come from the same sample, also with noise
+			return angle >> 8;
+		case AS5600RAWANGLE + 1: case AS5600ANGLE + 1: return angle & 0xFF;
+		case AS5600AGC: return 128;
+		case AS5600MAGNITUDE: return 0x07;
+		case AS5600MAGNITUDE + 1: return 0xD0;
+	}
+
+	return 0;
+}
+
+/** Next register after a read. The AS5600 address pointer wraps within the two byte registers */
+static uint8_t encoderNextRegister(uint8_t address)
+{
+	switch(address)
+	{
+		case AS5600RAWANGLE + 1: case AS5600ANGLE + 1: case AS5600MAGNITUDE + 1: return address - 1;
+	}
+
+	return address + 1;
+}
+
+static uint8_t twiRead(uint8_t address)
+{
+	return twiRegister[address];
+}
+
+static void twiWrite(uint8_t address, uint8_t value)
+{
+	twiRegister[address] = value;
+
+	if(address != TWCR1ADDR || !(value & (1 << TWINT1)))
+	{
+		return;
+	}
+
+	if(value & (1 << TWSTO1))
+	{
+		hostSimTwiBits += 1;
+		twiRegister[TWCR1ADDR] &= ~(1 << TWSTO1);
+		twiPhase = TWIIDLE;
+		twiStarted = 0;
+		return;
+	}
+
+	if(value & (1 << TWSTA1))
+	{
+		hostSimTwiBits += 1;
+		twiRegister[TWSR1ADDR] = twiStarted ? 0x10 : 0x08;		//(Repeated) start transmitted
+		twiStarted = 1;
+		twiPhase = TWIADDRESS;
+	}
+	else
+	{
+		hostSimTwiBits += 9;
+
+		switch(twiPhase)
+		{
+			case TWIADDRESS:
+				if(twiRegister[TWDR1ADDR] & 1)
+				{
+					twiRegister[TWSR1ADDR] = 0x40;		//SLA+R acknowledged
+					twiPhase = TWIREAD;
+				}
+				else
+				{
+					twiRegister[TWSR1ADDR] = 0x18;		//SLA+W acknowledged
+					twiPhase = TWIREGISTER;
+				}
+				break;
+			case TWIREGISTER:
+				encoderPointer = twiRegister[TWDR1ADDR];
+				twiRegister[TWSR1ADDR] = 0x28;		//Data acknowledged
+				twiPhase = TWIWRITE;
+				break;
+			case TWIWRITE:
+				twiRegister[TWSR1ADDR] = 0x28;
+				break;
+			case TWIREAD:
+				twiRegister[TWDR1ADDR] = encoderRegister(encoderPointer);
+				encoderPointer = encoderNextRegister(encoderPointer);
+				twiRegister[TWSR1ADDR] = (value & (1 << TWEA1)) ? 0x50 : 0x58;		//Data received, ACK or NACK returned
+				break;
+			default:
+				break;
+		}
+	}
+
+	twiRegister[TWCR1ADDR] |= (1 << TWINT1);
+
+	if(value & (1 << TWIE1))
+	{
+		TWI1_vect();		//The transfer completes immediately
+	}
+}
+
+void hostSimInit(void)
+{
+	halSimRegRead = twiRead;
+	halSimRegWrite = twiWrite;
+}
+
+static uint32_t prescaler(uint8_t tccrb)
+{
+	static const uint16_t division[8] = {0, 1, 8, 64, 256, 1024, 0, 0};
+
+	return division[tccrb & 0x07];
+}
+
+/** Counts of timer three until its compare match. Fast PWM with ICR3 as top (tick engine), or free running (compare engine) */
+static uint32_t timer3Counts(void)
+{
+	uint32_t top = (TCCR3B & (1 << WGM33)) ? (uint32_t)ICR3 + 1 : 65536;
+	uint32_t counts = ((uint32_t)OCR3A + top - TCNT3) % top;
+
+	return counts ? counts : top;
+}
+
+static void timer3Advance(uint64_t elapsed)
+{
+	uint32_t top = (TCCR3B & (1 << WGM33)) ? (uint32_t)ICR3 + 1 : 65536;
+	uint32_t division = prescaler(TCCR3B);
+
+	if(!division)
+	{
+		return;
+	}
+
+	elapsed += timer3Residue;
+	TCNT3 = (uint16_t)(((uint64_t)TCNT3 + elapsed / division) % top);
+	timer3Residue = elapsed % division;
+}
+
+void hostSimRun(uStepperSLite &stepper, double seconds)
+{
+	uint64_t end = cycles + (uint64_t)(seconds * F_CPU + 0.5);
+	uint64_t next, period, nextEncoder, nextDiagnostics, nextStep;
+
+	while(cycles < end)
+	{
+		period = (uint64_t)ICR1 + 1;
+		nextEncoder = (cycles / period + 1) * period;
+		nextDiagnostics = (cycles / period) * period + OCR1B;
+		if(nextDiagnostics <= cycles)
+		{
+			nextDiagnostics += period;
+		}
+
+		next = end;
+		if(prescaler(TCCR1B))
+		{
+			next = nextEncoder < next ? nextEncoder : next;
+			next = nextDiagnostics < next ? nextDiagnostics : next;
+		}
+
+		nextStep = ~(uint64_t)0;
+		if(prescaler(TCCR3B))
+		{
+			nextStep = cycles + (uint64_t)timer3Counts() * prescaler(TCCR3B) - timer3Residue;
+			next = nextStep < next ? nextStep : next;
+		}
+
+#if STEPENGINE == STEPENGINEVACTUAL
+		if(stepper.driver.shadowValid & (1 << TMC2208_SHADOW_VACTUAL))
+		{
+			hostSimRotorOffset += stepper.driver.shadowRegister[TMC2208_SHADOW_VACTUAL] / 1.0486 * (double)(next - cycles) / F_CPU;
+		}
+#else
+		(void)stepper;
+#endif
+		timer3Advance(next - cycles);
+		cycles = next;
+		halSimMicros = (uint32_t)(cycles / (F_CPU / 1000000UL));
+
+		if(next == nextStep && (TIMSK3 & (1 << OCIE3A)))
+		{
+			hostSimStepInterrupts++;
+			TIMER3_COMPA_vect();
+			STEPPINLOW();
+		}
+		if(prescaler(TCCR1B) && next == nextDiagnostics && (TIMSK1 & (1 << OCIE1B)))
+		{
+			TIMER1_COMPB_vect();
+		}
+		if(prescaler(TCCR1B) && next == nextEncoder && (TIMSK1 & (1 << OCIE1A)))
+		{
+			hostSimEncoderInterrupts++;
+			TIMER1_COMPA_vect();
+		}
+
+		if(hostSimRotorPosition() > hostSimWall)
+		{
+			hostSimRotorOffset = hostSimWall - (double)halSimDriverSteps;
+		}
+	}
+}
@@ -0,0 +1,86 @@
+/** @file hostSim.h
+ * @brief      Simulated uStepper S-lite board for host tests of the library
+ *
+ *             Runs the library, built with USTEPPER_HOST, against a model of the
+ *             board: timer one and three call their interrupt routines at the
+ *             rates set in their registers, the TWI bus answers as an AS5600
+ *             encoder, and the rotor follows the step pulses (or VACTUAL) of the
+ *             driver. Tests advance the simulated time with hostSimRun().
+ *
+ *             Private members of the library are made public to the tests, so
+ *             they can inspect the controller state.
+ */
+
+#ifndef _HOST_SIM_H_
+#define _HOST_SIM_H_
+
+#include <Arduino.h>
+#include <EEPROM.h>
+#include <math.h>
+#include <stdio.h>
+
+#define private public
+#define protected public
+#include <uStepperSLite.h>
+#undef private
+#undef protected
+
+/** Full steps per revolution of the simulated motor, in microsteps (16 microsteps per step) */
+#define HOSTSIMSTEPSPERREVOLUTION 3200.0
+
+/** Rotor position minus driver position, in microsteps. Set by a test to model load lag or slip */
+extern double hostSimRotorOffset;
+
+/** The rotor can not pass this position (microsteps), to model a hard stop. INFINITY when not used */
+extern double hostSimWall;
+
+/** RMS noise added to the simulated encoder, in counts */
+extern double hostSimEncoderNoise;
+
+/** Bit times used on the TWI bus (a byte and its acknowledge is 9, a start or stop 1) */
+extern uint32_t hostSimTwiBits;
+
+/** Number of calls of TIMER1_COMPA_vect */
+extern uint32_t hostSimEncoderInterrupts;
+
+/** Number of calls of TIMER3_COMPA_vect */
+extern uint32_t hostSimStepInterrupts;
+
+/**
+ * @brief      Connect the simulated encoder to the TWI registers. Call before uStepperSLite::setup()
+ */
+void hostSimInit(void);
+
+/**
+ * @brief      Advance the simulated time, calling the interrupt routines when due
+ *
+ * @param      stepper  - The library instance (used for the driver VACTUAL register)
+ * @param      seconds  - Time to advance
+ */
+void hostSimRun(uStepperSLite &stepper, double seconds);
+
+/**
+ * @brief      Position of the rotor, in microsteps
+ */
+double hostSimRotorPosition(void);
+
+/** Number of failed checks */
+extern int hostTestFailures;
+
+/** Count and report a failed check. Formats the message as printf() */
+#define HOSTCHECK(condition, ...) \
+	do \
+	{ \
+		if(!(condition)) \
+		{ \
+			printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+			printf(__VA_ARGS__); \
+			printf("\n"); \
+			hostTestFailures++; \
+		} \
+	} while(0)
+
+/** Print the result of a test program, and return its exit code from main() */
+#define HOSTTESTRESULT() (printf("%s: %s\n", __FILE__, hostTestFailures ? "FAILED" : "passed"), hostTestFailures ? 1 : 0)
+
+#endif
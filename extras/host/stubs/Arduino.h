@@ -0,0 +1,106 @@
+/** @file Arduino.h
+ * @brief      Minimal Arduino core for the host build of the uStepper S-lite library
+ *
+ *             Provides the part of the Arduino API used by the library (String,
+ *             Serial, timing and pin functions) on top of the host backend of
+ *             uStepperHal.h. Serial is connected to hostSerialIn and
+ *             hostSerialOut, and time follows the simulated clock (halSimMicros).
+ */
+
+#ifndef _HOST_ARDUINO_H_
+#define _HOST_ARDUINO_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <deque>
+#include <string>
+#include "uStepperHal.h"
+
+#define INPUT 0
+#define OUTPUT 1
+#define HIGH 1
+#define LOW 0
+#define DEC 10
+#define HEX 16
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+uint32_t millis(void);
+uint32_t micros(void);
+void delay(uint32_t ms);
+void delayMicroseconds(uint32_t us);
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+
+class __FlashStringHelper;
+#define F(s) (reinterpret_cast<const __FlashStringHelper *>(s))
+
+/**
+ * @brief      The subset of the Arduino String class used by the library
+ */
+class String
+{
+public:
+	String(void) {}
+	String(const char *s) : str(s) {}
+	String(const std::string &s) : str(s) {}
+
+	char charAt(unsigned int index) const { return index < str.size() ? str[index] : 0; }
+	String substring(unsigned int from, unsigned int to) const { return from > str.size() ? String() : String(str.substr(from, to - from)); }
+	bool operator==(const String &other) const { return str == other.str; }
+	void concat(char c) { str += c; }
+	String &operator+=(char c) { str += c; return *this; }
+	float toFloat(void) const { return atof(str.c_str()); }
+	void remove(unsigned int index) { if(index < str.size()) str.erase(index); }
+	int lastIndexOf(char c) const { size_t pos = str.rfind(c); return pos == std::string::npos ? -1 : (int)pos; }
+	const char *c_str(void) const { return str.c_str(); }
+	unsigned int length(void) const { return str.size(); }
+
+private:
+	std::string str;
+};
+
+/** Bytes to be received on Serial */
+extern std::deque<uint8_t> hostSerialIn;
+
+/** Everything written to Serial */
+extern std::string hostSerialOut;
+
+/**
+ * @brief      Serial port, reading from hostSerialIn and writing to hostSerialOut
+ */
+class HardwareSerial
+{
+public:
+	void begin(uint32_t baud) { (void)baud; }
+	int available(void) { return hostSerialIn.size(); }
+	int read(void);
+	size_t write(uint8_t c) { hostSerialOut += (char)c; return 1; }
+	size_t write(const uint8_t *buffer, size_t size) { hostSerialOut.append((const char *)buffer, size); return size; }
+
+	void print(const char *s) { hostSerialOut += s; }
+	void print(const __FlashStringHelper *s) { hostSerialOut += (const char *)s; }
+	void print(const String &s) { hostSerialOut += s.c_str(); }
+	void print(char c) { hostSerialOut += c; }
+	void print(double value, int digits = 2) { format("%.*f", digits, value); }
+	void print(int value, int base = DEC) { format(base == HEX ? "%x" : "%d", value); }
+	void print(unsigned int value, int base = DEC) { format(base == HEX ? "%x" : "%u", value); }
+	void print(long value, int base = DEC) { format(base == HEX ? "%lx" : "%ld", value); }
+	void print(unsigned long value, int base = DEC) { format(base == HEX ? "%lx" : "%lu", value); }
+	void print(uint8_t value, int base = DEC) { print((unsigned int)value, base); }
+
+	template <class T> void println(T value) { print(value); print('\n'); }
+	template <class T> void println(T value, int format) { print(value, format); print('\n'); }
+	void println(void) { print('\n'); }
+
+private:
+	template <class T> void format(const char *spec, T value) { char buffer[40]; snprintf(buffer, sizeof(buffer), spec, value); hostSerialOut += buffer; }
+	template <class T> void format(const char *spec, int digits, T value) { char buffer[64]; snprintf(buffer, sizeof(buffer), spec, digits, value); hostSerialOut += buffer; }
+};
+
+extern HardwareSerial Serial;
+
+#endif
@@ -0,0 +1,29 @@
+/** @file EEPROM.h
+ * @brief      EEPROM of the host build, 1 kB of RAM (as the ATmega328PB)
+ */
+
+#ifndef _HOST_EEPROM_H_
+#define _HOST_EEPROM_H_
+
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * @brief      The subset of the Arduino EEPROM class used by the library
+ */
+class EEPROMClass
+{
+public:
+	uint8_t read(int address) { return memory[address]; }
+	void write(int address, uint8_t value) { memory[address] = value; }
+	void update(int address, uint8_t value) { memory[address] = value; }
+	template <class T> T &get(int address, T &value) { memcpy(&value, memory + address, sizeof(T)); return value; }
+	template <class T> const T &put(int address, const T &value) { memcpy(memory + address, &value, sizeof(T)); return value; }
+
+	/** Contents, erased (0xFF) at startup */
+	uint8_t memory[1024];
+};
+
+extern EEPROMClass EEPROM;
+
+#endif
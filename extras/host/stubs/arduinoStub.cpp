@@ -0,0 +1,64 @@
+/** @file arduinoStub.cpp
+ * @brief      Minimal Arduino core for the host build of the uStepper S-lite library
+ */
+
+#include <Arduino.h>
+#include <EEPROM.h>
+
+HardwareSerial Serial;
+EEPROMClass EEPROM;
+std::deque<uint8_t> hostSerialIn;
+std::string hostSerialOut;
+
+/** Erase the EEPROM before main(), as a new ATmega328PB */
+static struct EEPROMErase
+{
+	EEPROMErase(void) { memset(EEPROM.memory, 0xFF, sizeof(EEPROM.memory)); }
+} eepromErase;
+
+int HardwareSerial::read(void)
+{
+	int c;
+
+	if(hostSerialIn.empty())
+	{
+		return -1;
+	}
+
+	c = hostSerialIn.front();
+	hostSerialIn.pop_front();
+
+	return c;
+}
+
+uint32_t millis(void)
+{
+	return halSimMicros / 1000;
+}
+
+uint32_t micros(void)
+{
+	return halSimMicros;
+}
+
+void delay(uint32_t ms)
+{
+	halSimDelay(ms * 1000UL);
+}
+
+void delayMicroseconds(uint32_t us)
+{
+	halSimDelay(us);
+}
+
+void pinMode(uint8_t pin, uint8_t mode)
+{
+	(void)pin;
+	(void)mode;
+}
+
+void digitalWrite(uint8_t pin, uint8_t value)
+{
+	(void)pin;
+	(void)value;
+}
@@ -0,0 +1,159 @@
+/** @file test_cli.cpp
+ * @brief      Dropin command line interface: parseCommand() through dropinCliService()
+ *
+ *             Every documented command is sent as text on the simulated serial
+ *             port, in the syntax accepted before the parser was table driven
+ *             ("P=10.002;", "runCurrent=50.0;" ...), with the reply and the stored
+ *             settings checked. Malformed commands (no digits, "P=;", signs,
+ *             exponents, two decimal points, unknown names, trailing text and
+ *             input longer than DROPINCLIBUFFERLENGTH) must be rejected without
+ *             changing the settings. Numbers are checked against strtod().
+ */
+
+#include "hostSim.h"
+
+uStepperSLite stepper;
+
+/** Send "text" to the CLI, returning the reply */
+static std::string send(const char *text)
+{
+	hostSerialOut.clear();
+	while(*text)
+	{
+		hostSerialIn.push_back((uint8_t)*text++);
+	}
+	stepper.dropinCliService();
+
+	return hostSerialOut;
+}
+
+static bool accepted(const std::string &reply)
+{
+	return reply.find("COMMAND NOT ACCEPTED") == std::string::npos;
+}
+
+/** The settings in use must equal the settings in the EEPROM */
+static bool stored(void)
+{
+	dropinCliSettings_t settings;
+
+	EEPROM.get(0, settings);
+
+	return memcmp(&settings, &stepper.dropinSettings, sizeof(settings)) == 0 && stepper.loadDropinSettings();
+}
+
+int main(void)
+{
+	static const char *rejected[] = {
+		"P=;", "I=;", "D=;", "P=-1;", "P=+1;", "P=1e3;", "P=1.2.3;", "P= 1;", "P=1 ;", "P=1,5;",
+		"P=0x10;", "p=1;", "Q=1;", "PI=1;", "P;", "X;", ";", "invertx;", "errors;", "current=1;",
+		"help me;", "runCurrent=101;", "holdCurrent=100.5;", "runCurrent=-5;", "holdCurrent=abc;",
+		"parameters=1;", "P==1;",
+	};
+	static const char *numbers[] = {
+		"0", "1", "10.002", ".5", "5.", "0.0001", "3.14159", "123456.789", "00012.50", "100000000", "99999999.9",
+		"123456789012", "0.000000001", "1234.56789012345",
+	};
+	dropinCliSettings_t before;
+	std::string reply, text;
+	double expected;
+	float value;
+
+	hostSimInit();
+	stepper.setup(DROPIN, HOSTSIMSTEPSPERREVOLUTION, 10.0, 0.5, 1.0, true, 0, 50, 30);
+	hostSimRun(stepper, 0.1);
+
+	//Documented commands
+	reply = send("P=10.002;");
+	HOSTCHECK(reply == "COMMAND ACCEPTED. P = 10.0020\n", "P=10.002; replied \"%s\"", reply.c_str());
+	HOSTCHECK(stepper.dropinSettings.P.f == 10.002f && stored(), "P=10.002; set P = %f", stepper.dropinSettings.P.f);
+
+	reply = send("I=0.5;");
+	HOSTCHECK(reply == "COMMAND ACCEPTED. I = 0.5000\n", "I=0.5; replied \"%s\"", reply.c_str());
+	HOSTCHECK(stepper.dropinSettings.I.f == 0.5f && stored(), "I=0.5; set I = %f", stepper.dropinSettings.I.f);
+
+	reply = send("D=2;");
+	HOSTCHECK(reply == "COMMAND ACCEPTED. D = 2.0000\n", "D=2; replied \"%s\"", reply.c_str());
+	HOSTCHECK(stepper.dropinSettings.D.f == 2.0f && stored(), "D=2; set D = %f", stepper.dropinSettings.D.f);
+
+	reply = send("runCurrent=50.0;");
+	HOSTCHECK(reply == "COMMAND ACCEPTED. runCurrent = 50 %\n", "runCurrent=50.0; replied \"%s\"", reply.c_str());
+	HOSTCHECK(stepper.dropinSettings.runCurrent == 50 && stored(), "runCurrent=50.0; set %u", stepper.dropinSettings.runCurrent);
+
+	reply = send("holdCurrent=25;");
+	HOSTCHECK(reply == "COMMAND ACCEPTED. holdCurrent = 25 %\n", "holdCurrent=25; replied \"%s\"", reply.c_str());
+	HOSTCHECK(stepper.dropinSettings.holdCurrent == 25 && stored(), "holdCurrent=25; set %u", stepper.dropinSettings.holdCurrent);
+
+	reply = send("runCurrent=100;holdCurrent=0;");
+	HOSTCHECK(accepted(reply) && stepper.dropinSettings.runCurrent == 100 && stepper.dropinSettings.holdCurrent == 0 && stored(), "two commands in one read: \"%s\"", reply.c_str());
+
+	reply = send("invert;");
+	HOSTCHECK(reply == "Direction inverted!\n" && stepper.dropinSettings.invert == 1 && stored(), "invert; replied \"%s\"", reply.c_str());
+	reply = send("invert;");
+	HOSTCHECK(reply == "Direction normal!\n" && stepper.dropinSettings.invert == 0 && stored(), "second invert; replied \"%s\"", reply.c_str());
+
+	reply = send("parameters;");
+	HOSTCHECK(reply == "P: 10.0020, I: 0.5000, D: 2.0000\n", "parameters; replied \"%s\"", reply.c_str());
+
+	reply = send("error;");
+	HOSTCHECK(reply.compare(0, 15, "Current Error: ") == 0 && reply.find(" Steps\n") != std::string::npos, "error; replied \"%s\"", reply.c_str());
+
+	reply = send("current;");
+	HOSTCHECK(reply.compare(0, 13, "Run Current: ") == 0 && reply.find("Hold Current: ") != std::string::npos, "current; replied \"%s\"", reply.c_str());
+
+	reply = send("profile;");
+	HOSTCHECK(accepted(reply) && !reply.empty(), "profile; replied \"%s\"", reply.c_str());
+
+	reply = send("help;");
+	HOSTCHECK(accepted(reply) && reply.find("P=") != std::string::npos, "help; replied \"%s\"", reply.c_str());
+
+	//A command split over several reads
+	send("P=1");
+	reply = send("2.5;");
+	HOSTCHECK(reply == "COMMAND ACCEPTED. P = 12.5000\n", "split command replied \"%s\"", reply.c_str());
+
+	//As before the parser was table driven, an empty current is 0 (P=; is caught by the cmd[2] check)
+	reply = send("runCurrent=;");
+	HOSTCHECK(reply == "COMMAND ACCEPTED. runCurrent = 0 %\n" && stepper.dropinSettings.runCurrent == 0, "runCurrent=; replied \"%s\"", reply.c_str());
+
+	//The String overload of parseCommand()
+	hostSerialOut.clear();
+	String command("I=0.25;");
+	stepper.parseCommand(&command);
+	HOSTCHECK(hostSerialOut == "COMMAND ACCEPTED. I = 0.2500\n" && stepper.dropinSettings.I.f == 0.25f, "String I=0.25; replied \"%s\"", hostSerialOut.c_str());
+
+	//Malformed commands leave the settings alone
+	before = stepper.dropinSettings;
+	for(uint8_t i = 0; i < sizeof(rejected) / sizeof(rejected[0]); i++)
+	{
+		reply = send(rejected[i]);
+		HOSTCHECK(reply == "COMMAND NOT ACCEPTED\n", "\"%s\" replied \"%s\"", rejected[i], reply.c_str());
+		HOSTCHECK(memcmp(&before, &stepper.dropinSettings, sizeof(before)) == 0 && stored(), "\"%s\" changed the settings", rejected[i]);
+	}
+
+	text = "P=" + std::string(DROPINCLIBUFFERLENGTH, '1') + ";";
+	reply = send(text.c_str());
+	HOSTCHECK(reply == "COMMAND NOT ACCEPTED\n" && stepper.dropinSettings.P.f == before.P.f, "%u character command replied \"%s\"", (unsigned int)text.size(), reply.c_str());
+	reply = send("D=3;");
+	HOSTCHECK(reply == "COMMAND ACCEPTED. D = 3.0000\n", "command after an overflow replied \"%s\"", reply.c_str());
+
+	//Numbers: nearest float, or within one float step when more than 8 significant digits are given
+	for(uint8_t i = 0; i < sizeof(numbers) / sizeof(numbers[0]); i++)
+	{
+		text = "P=" + std::string(numbers[i]) + ";";
+		reply = send(text.c_str());
+		value = stepper.dropinSettings.P.f;
+		expected = strtod(numbers[i], NULL);
+		HOSTCHECK(accepted(reply), "\"%s\" replied \"%s\"", text.c_str(), reply.c_str());
+		HOSTCHECK(fabs(value - expected) <= fabs(expected) * 1.2e-7, "\"%s\" parsed as %.9g", text.c_str(), value);
+	}
+
+	//Partial commands are dropped after 500 ms without input
+	send("P=9");
+	hostSimRun(stepper, 0.6);
+	stepper.dropinCliService();
+	reply = send(";");
+	HOSTCHECK(reply == "COMMAND NOT ACCEPTED\n", "command completed after a pause replied \"%s\"", reply.c_str());
+
+	return HOSTTESTRESULT();
+}
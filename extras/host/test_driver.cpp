@@ -0,0 +1,56 @@
+/** @file test_driver.cpp
+ * @brief      TMC2208 shadow registers: VACTUAL set while the UART is claimed
+ *
+ *             The control loop can interrupt a datagram sent from the main context
+ *             (encoderSampleReady() runs with interrupts enabled). This is emulated
+ *             by claiming the UART (uartBusy) around setVelocity(): nothing may be
+ *             sent, VACTUAL must stay dirty, and it must be sent, with the newest
+ *             value, after the next datagram from the main context. The datagrams
+ *             sent are counted with ifcntExpected.
+ */
+
+#include "hostSim.h"
+
+uStepperSLite stepper;
+
+#define VACTUALBIT (1 << TMC2208_SHADOW_VACTUAL)
+
+int main(void)
+{
+	uint8_t sent;
+
+	hostSimInit();
+	stepper.setup(NORMAL, HOSTSIMSTEPSPERREVOLUTION);
+	hostSimRun(stepper, 0.1);
+
+	//Unchanged values are not sent
+	stepper.driver.setVelocity(10.0);
+	sent = stepper.driver.ifcntExpected;
+	stepper.driver.setVelocity(10.0);
+	HOSTCHECK(stepper.driver.ifcntExpected == sent, "unchanged VACTUAL sent");
+
+	//Set by the control loop while the main context holds the UART
+	stepper.driver.uartBusy = 1;
+	stepper.driver.setVelocity(20.0);
+	stepper.driver.setVelocity(30.0);
+	HOSTCHECK(stepper.driver.ifcntExpected == sent, "%u datagrams sent with the UART claimed", (uint8_t)(stepper.driver.ifcntExpected - sent));
+	HOSTCHECK(stepper.driver.shadowDirty & VACTUALBIT, "VACTUAL not left dirty");
+	stepper.driver.uartBusy = 0;
+
+	//The next datagram from the main context is followed by VACTUAL
+	stepper.driver.setRunCurrent(40);
+	HOSTCHECK((uint8_t)(stepper.driver.ifcntExpected - sent) == 2, "%u datagrams sent after the UART was released, expected 2", (uint8_t)(stepper.driver.ifcntExpected - sent));
+	HOSTCHECK(!(stepper.driver.shadowDirty & VACTUALBIT), "VACTUAL still dirty");
+	HOSTCHECK(stepper.driver.shadowRegister[TMC2208_SHADOW_VACTUAL] == (int32_t)(30.0 * 55.925333333 + 0.5), "VACTUAL %ld, not the newest value", (long)stepper.driver.shadowRegister[TMC2208_SHADOW_VACTUAL]);
+	HOSTCHECK(!stepper.driver.uartBusy, "UART still claimed");
+
+	//Or by the next sample, which sets VACTUAL again
+	sent = stepper.driver.ifcntExpected;
+	stepper.driver.uartBusy = 1;
+	stepper.driver.setVelocity(0.0);
+	stepper.driver.uartBusy = 0;
+	stepper.driver.setVelocity(0.0);
+	HOSTCHECK((uint8_t)(stepper.driver.ifcntExpected - sent) == 1 && !(stepper.driver.shadowDirty & VACTUALBIT), "VACTUAL not sent by the next sample");
+
+	return HOSTTESTRESULT();
+}
@@ -0,0 +1,98 @@
+/** @file test_fixedpoint.cpp
+ * @brief      Equivalence of the fixed point (CONTROLFIXEDPOINT) and floating point speed filter
+ *
+ *             The library is built with CONTROLFIXEDPOINT set. On every encoder
+ *             sample the fixed point estimate is compared with the floating point
+ *             PLL of the default build, fed with the same positions: moves in both
+ *             directions and a stop near home, where the two must agree, and a long
+ *             continuous run, where only the fixed point filter keeps following the
+ *             double precision reference.
+ */
+
+#include "hostSim.h"
+
+#if !CONTROLFIXEDPOINT
+	#error "Build with -DCONTROLFIXEDPOINT=1 (see FLAGS_test_fixedpoint in the Makefile)"
+#endif
+
+uStepperSLite stepper(3000, 3000);
+
+/** The floating point speed filter of the default build, in counts per second. Also run in double precision, as exact reference */
+template <class T> class FloatFilter
+{
+public:
+	T posEst, velIntegrator, velEst;
+
+	void restart(int32_t position)
+	{
+		posEst = (T)position;
+		velIntegrator = velEst = 0.0;
+	}
+
+	T update(int32_t position)
+	{
+		T posError;
+
+		posEst += velEst * (T)ENCODERINTSAMPLETIME;
+		posError = (T)position - posEst;
+		velIntegrator += posError * (T)stepper.speedObserverGain[1];
+		velEst = (posError * (T)stepper.speedObserverGain[0]) + velIntegrator;
+
+		return velIntegrator;
+	}
+};
+
+static FloatFilter<float> floatFilter;
+static FloatFilter<double> exactFilter;
+
+/**
+ * @brief      Run "samples" encoder samples, comparing the filters on every sample
+ *
+ * @param      floatTolerance  - Allowed difference between fixed and floating point, negative to only report it
+ */
+static void compare(uint32_t samples, double floatTolerance, const char *phase)
+{
+	double fixedSpeed, floatError = 0.0, exactError = 0.0;
+	int32_t position;
+
+	for(uint32_t i = 0; i < samples; i++)
+	{
+		hostSimRun(stepper, ENCODERINTSAMPLETIME);
+
+		position = stepper.encoder.getCountsMoved();
+		fixedSpeed = (double)stepper.encoder.getSpeedCountsPerTick() * ENCODERINTFREQ / 65536.0;
+		floatError = fmax(floatError, fabs(fixedSpeed - floatFilter.update(position)));
+		exactError = fmax(exactError, fabs(fixedSpeed - exactFilter.update(position)));
+	}
+
+	printf("%-22s at %8ld counts: max difference %.4f counts/s to float, %.4f counts/s to double\n", phase, (long)position, floatError, exactError);
+	HOSTCHECK(floatTolerance < 0.0 || floatError < floatTolerance, "%s: fixed point differs %.4f counts/s from floating point", phase, floatError);
+	HOSTCHECK(exactError < 0.1, "%s: fixed point differs %.4f counts/s from double precision", phase, exactError);
+}
+
+int main(void)
+{
+	hostSimInit();
+	stepper.setup(NORMAL, HOSTSIMSTEPSPERREVOLUTION);
+	hostSimRun(stepper, 0.1);
+
+	//Align the reference with the sample the fixed point filter restarts on
+	stepper.speedObserverRestart = 1;
+	hostSimRun(stepper, ENCODERINTSAMPLETIME);
+	floatFilter.restart(stepper.encoder.getCountsMoved());
+	exactFilter.restart(stepper.encoder.getCountsMoved());
+
+	stepper.moveSteps(20000, CW, HARD);
+	compare(5 * ENCODERINTFREQ, 0.1, "move CW");
+	stepper.moveSteps(12000, CCW, HARD);
+	compare(4 * ENCODERINTFREQ, 0.1, "move CCW");
+	compare(ENCODERINTFREQ, 0.1, "standstill");
+
+	//Far from home the float filter loses resolution (1/32 count at 458000 counts), the fixed point filter does not
+	stepper.runContinous(CW);
+	compare(120 * ENCODERINTFREQ, -1.0, "2 minutes continuous");
+	stepper.stop(HARD);
+	compare(ENCODERINTFREQ, -1.0, "stop far from home");
+
+	return HOSTTESTRESULT();
+}
@@ -0,0 +1,96 @@
+/** @file test_motion.cpp
+ * @brief      Moves in NORMAL and PID mode on the simulated board
+ */
+
+#include "hostSim.h"
+
+uStepperSLite stepper(2000, 1000);
+
+/** Run until the motor stops, at most "timeout" seconds */
+static void runUntilStopped(double timeout)
+{
+	for(double t = 0.0; t < timeout; t += 0.01)
+	{
+		hostSimRun(stepper, 0.01);
+		if(!stepper.getMotorState() && t > 0.05)
+		{
+			break;
+		}
+	}
+	hostSimRun(stepper, 0.1);
+}
+
+int main(void)
+{
+	int32_t start;
+
+	hostSimInit();
+	stepper.setup(NORMAL, HOSTSIMSTEPSPERREVOLUTION);
+	hostSimRun(stepper, 0.1);
+
+	HOSTCHECK(hostSimEncoderInterrupts >= 45 && hostSimEncoderInterrupts <= 55, "%u encoder samples in 100 ms", hostSimEncoderInterrupts);
+	HOSTCHECK(fabs(stepper.encoder.getAngleMoved()) < 0.1, "angle %.2f at home", stepper.encoder.getAngleMoved());
+
+	start = halSimDriverSteps;
+	stepper.moveSteps(3200, CW, HARD);
+	runUntilStopped(5.0);
+	HOSTCHECK(halSimDriverSteps - start == 3200, "NORMAL mode: %ld steps sent, 3200 requested", (long)(halSimDriverSteps - start));
+	HOSTCHECK(stepper.getStepsSinceReset() == 3200, "NORMAL mode: stepsSinceReset %ld", (long)stepper.getStepsSinceReset());
+	HOSTCHECK(fabs(stepper.encoder.getAngleMoved() - 360.0) < 0.2, "NORMAL mode: moved %.2f degrees", stepper.encoder.getAngleMoved());
+
+	start = halSimDriverSteps;
+	stepper.moveSteps(1600, CCW, HARD);
+	runUntilStopped(5.0);
+	HOSTCHECK(halSimDriverSteps - start == -1600, "NORMAL mode: %ld steps sent, -1600 requested", (long)(halSimDriverSteps - start));
+	HOSTCHECK(fabs(stepper.encoder.getAngleMoved() - 180.0) < 0.2, "NORMAL mode: moved back to %.2f degrees", stepper.encoder.getAngleMoved());
+
+	//A move queued in the direction of the running move extends it, without stopping in between
+	start = halSimDriverSteps;
+	stepper.moveSteps(1600, CW, HARD);
+	hostSimRun(stepper, 0.5);
+	HOSTCHECK(stepper.queueMoveSteps(1600, CW, HARD) && stepper.getQueueLength() == 0, "NORMAL mode: queued move did not extend the running move");
+	runUntilStopped(5.0);
+	HOSTCHECK(halSimDriverSteps - start == 3200, "NORMAL mode: %ld steps sent for an extended move, 3200 requested", (long)(halSimDriverSteps - start));
+	HOSTCHECK(stepper.getStepsSinceReset() == 4800, "NORMAL mode: stepsSinceReset %ld after an extended move", (long)stepper.getStepsSinceReset());
+
+	//A new speed limit replans the rest of the running move
+	start = halSimDriverSteps;
+	stepper.moveSteps(1600, CW, HARD);
+	hostSimRun(stepper, 0.5);
+	stepper.setMaxVelocity(500.0);
+	runUntilStopped(5.0);
+	stepper.setMaxVelocity(1000.0);
+	HOSTCHECK(halSimDriverSteps - start == 1600, "NORMAL mode: %ld steps sent with a new speed limit, 1600 requested", (long)(halSimDriverSteps - start));
+
+	//A new absolute target replaces the one of the running move
+	stepper.moveTo(8000, HARD);
+	hostSimRun(stepper, 0.5);
+	stepper.moveTo(6400, HARD);
+	runUntilStopped(5.0);
+	HOSTCHECK(stepper.getStepsSinceReset() == 6400, "NORMAL mode: moveTo(6400) during a move ended at %ld", (long)stepper.getStepsSinceReset());
+
+	//Behind the running move: the motor has to turn around
+	stepper.moveTo(9600, HARD);
+	hostSimRun(stepper, 1.0);
+	stepper.moveTo(6400, HARD);
+	runUntilStopped(5.0);
+	HOSTCHECK(stepper.getStepsSinceReset() == 6400, "NORMAL mode: moveTo(6400) reversing a move ended at %ld", (long)stepper.getStepsSinceReset());
+
+	//The rotor lags 40 microsteps behind the driver, the PID loop must make up for it
+	stepper.setup(PID, HOSTSIMSTEPSPERREVOLUTION, 50.0, 0.0, 0.0);
+	hostSimRun(stepper, 0.1);
+	hostSimRotorOffset -= 40.0;
+	stepper.moveSteps(3200, CW, HARD);
+	runUntilStopped(5.0);
+	hostSimRun(stepper, 1.0);
+	HOSTCHECK(fabs(stepper.encoder.getAngleMoved() - 360.0) < 0.5, "PID mode: moved %.2f degrees with 40 microsteps of lag", stepper.encoder.getAngleMoved());
+
+	stepper.moveTo(6400, HARD);
+	hostSimRun(stepper, 0.5);
+	stepper.moveTo(4800, HARD);
+	runUntilStopped(5.0);
+	hostSimRun(stepper, 1.0);
+	HOSTCHECK(fabs(stepper.encoder.getAngleMoved() - 540.0) < 0.5, "PID mode: moveTo(4800) during a move ended at %.2f degrees", stepper.encoder.getAngleMoved());
+
+	return HOSTTESTRESULT();
+}
@@ -0,0 +1,309 @@
+/** @file test_protocol.cpp
+ * @brief      Dropin binary protocol: fuzzed frames through dropinCliService()
+ *
+ *             Random request frames are sent on the simulated serial port, mixed
+ *             with text for the command line interface:
+ *             - valid frames with every opcode (known and unknown), correct and
+ *               wrong payload lengths, and valid and out of range settings. Each
+ *               must give exactly one response, with a valid CRC and the status
+ *               expected from a model of the stored settings. The settings read
+ *               back with DROPINOPGETPARAMETERS must equal the model (round trip),
+ *             - the same frames with one bit flipped after the length byte. The
+ *               CRC catches every single bit error, so none may be answered,
+ *             - random bytes, biased to the sync byte. Every response sent must
+ *               still be a well formed frame.
+ *             The settings in use and in the EEPROM must stay in range throughout.
+ */
+
+#include "hostSim.h"
+#include <vector>
+
+#define FRAMES 3000
+#define RANDOMBYTES 20000
+
+uStepperSLite stepper;
+
+typedef struct
+{
+	uint8_t opcode;
+	uint8_t status;
+	uint8_t length;				/**< Bytes after the status byte */
+	uint8_t data[DROPINFRAMEMAXPAYLOAD];
+} response_t;
+
+static uint32_t seed = 12345;
+
+/** xorshift32: the same sequence on every host */
+static uint32_t random32(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+
+	return seed;
+}
+
+/** CRC of the frames, written from the TMC2208 datasheet rather than taken from the library */
+static uint8_t crc8(const uint8_t *data, uint8_t length)
+{
+	uint8_t crc = 0, byte;
+
+	for(uint8_t i = 0; i < length; i++)
+	{
+		byte = data[i];
+		for(uint8_t j = 0; j < 8; j++)
+		{
+			crc = ((crc >> 7) ^ (byte & 1)) ? (uint8_t)((crc << 1) ^ 0x07) : (uint8_t)(crc << 1);
+			byte >>= 1;
+		}
+	}
+
+	return crc;
+}
+
+/** Payload length of a request, or -1 for an unknown opcode */
+static int expectedLength(uint8_t opcode)
+{
+	switch(opcode)
+	{
+		case DROPINOPGETVERSION:
+		case DROPINOPGETPARAMETERS:
+		case DROPINOPGETERROR:
+			return 0;
+		case DROPINOPSETPARAMETERS:
+			return 15;
+		case DROPINOPSETP:
+		case DROPINOPSETI:
+		case DROPINOPSETD:
+			return 4;
+		case DROPINOPSETINVERT:
+		case DROPINOPSETRUNCURRENT:
+		case DROPINOPSETHOLDCURRENT:
+			return 1;
+	}
+
+	return -1;
+}
+
+static bool settingsValid(const dropinCliSettings_t *settings)
+{
+	return settings->P.f >= 0.0 && settings->I.f >= 0.0 && settings->D.f >= 0.0 &&
+		settings->invert <= 1 && settings->runCurrent <= 100 && settings->holdCurrent <= 100;
+}
+
+/** Decode every frame in the serial output, skipping text. Returns 0 on a malformed frame */
+static bool decodeResponses(std::vector<response_t> &responses)
+{
+	const std::string &out = hostSerialOut;
+	const uint8_t *frame;
+	response_t response;
+	size_t i = 0;
+
+	responses.clear();
+	while((i = out.find((char)DROPINFRAMESYNC, i)) != std::string::npos)
+	{
+		frame = (const uint8_t *)out.data() + i + 1;
+		if(i + 3 > out.size() || frame[1] < 1 || frame[1] > DROPINFRAMEMAXPAYLOAD || i + frame[1] + 4 > out.size())
+		{
+			return 0;
+		}
+		if(crc8(frame, frame[1] + 2) != frame[frame[1] + 2] || !(frame[0] & DROPINOPRESPONSE))
+		{
+			return 0;
+		}
+		response.opcode = frame[0] & ~DROPINOPRESPONSE;
+		response.status = frame[2];
+		response.length = frame[1] - 1;
+		memcpy(response.data, &frame[3], response.length);
+		responses.push_back(response);
+		i += frame[1] + 4;
+	}
+
+	return 1;
+}
+
+/** Random request payload: mostly in range values, sometimes any bytes */
+static void randomPayload(uint8_t opcode, uint8_t *payload, uint8_t length)
+{
+	floatBytes_t value;
+
+	for(uint8_t i = 0; i < length; i++)
+	{
+		payload[i] = (uint8_t)random32();
+	}
+	if(random32() % 4 == 0 || length != expectedLength(opcode))
+	{
+		return;
+	}
+
+	for(uint8_t i = 0; i + 4 <= length && i < 12; i += 4)
+	{
+		value.f = (float)(random32() % 100000) / 1000.0;
+		memcpy(&payload[i], value.bytes, 4);
+	}
+	if(length == 1)
+	{
+		payload[0] = (uint8_t)(random32() % (opcode == DROPINOPSETINVERT ? 2 : 101));
+	}
+	else if(length == 15)
+	{
+		payload[12] = (uint8_t)(random32() % 2);
+		payload[13] = (uint8_t)(random32() % 101);
+		payload[14] = (uint8_t)(random32() % 101);
+	}
+}
+
+int main(void)
+{
+	static const uint8_t opcodes[] = {0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B, 0x55, 0x7F};
+	static const char *fillers[] = {"", "", "", "xyz", "\r\n", "help;", "P=;"};
+	dropinCliSettings_t model, settings, stored;
+	std::vector<response_t> responses;
+	uint8_t frame[DROPINFRAMEMAXPAYLOAD + 4], opcode, length, status;
+	uint32_t answered = 0, corrupted = 0, roundTrips = 0;
+	int expected;
+	bool corrupt, decoded;
+
+	hostSimInit();
+	stepper.setup(DROPIN, HOSTSIMSTEPSPERREVOLUTION, 10.0, 0.5, 1.0, true, 0, 50, 30);
+	hostSimRun(stepper, 0.1);
+	model = stepper.dropinSettings;
+
+	for(uint32_t n = 0; n < FRAMES; n++)
+	{
+		opcode = opcodes[random32() % sizeof(opcodes)];
+		expected = expectedLength(opcode);
+		length = (expected >= 0 && random32() % 5) ? (uint8_t)expected : (uint8_t)(random32() % (DROPINFRAMEMAXPAYLOAD + 1));
+
+		frame[0] = DROPINFRAMESYNC;
+		frame[1] = opcode;
+		frame[2] = length;
+		randomPayload(opcode, &frame[3], length);
+		frame[length + 3] = crc8(&frame[1], length + 2);
+
+		//Flip one bit of the opcode, payload or CRC. The length stays, so the receiver stays in step
+		corrupt = random32() % 10 == 0;
+		if(corrupt)
+		{
+			uint8_t bit = random32() % ((length + 2) * 8);
+			uint8_t index = bit < 8 ? 1 : bit / 8 + 2;
+
+			frame[index] ^= 1 << (bit % 8);
+			corrupted++;
+		}
+
+		hostSerialOut.clear();
+		hostSerialIn.insert(hostSerialIn.end(), frame, frame + length + 4);
+		for(const char *c = fillers[random32() % (sizeof(fillers) / sizeof(fillers[0]))]; *c; c++)
+		{
+			hostSerialIn.push_back((uint8_t)*c);
+		}
+		stepper.dropinCliService();
+
+		decoded = decodeResponses(responses);
+		HOSTCHECK(decoded, "frame %lu: malformed response", (unsigned long)n);
+		if(corrupt)
+		{
+			HOSTCHECK(responses.empty(), "frame %lu: corrupted frame answered", (unsigned long)n);
+			continue;
+		}
+		HOSTCHECK(responses.size() == 1, "frame %lu, opcode 0x%02X: %lu responses", (unsigned long)n, opcode, (unsigned long)responses.size());
+		if(responses.size() != 1)
+		{
+			continue;
+		}
+		answered++;
+
+		//Expected status and settings
+		status = DROPINSTATUSOK;
+		settings = model;
+		if(expected < 0)
+		{
+			status = DROPINSTATUSUNKNOWN;
+		}
+		else if(length != expected)
+		{
+			status = DROPINSTATUSLENGTH;
+		}
+		else if(opcode == DROPINOPSETPARAMETERS)
+		{
+			memcpy(&settings, &frame[3], 15);
+		}
+		else if(opcode >= DROPINOPSETP && opcode <= DROPINOPSETD)
+		{
+			memcpy((opcode == DROPINOPSETP ? settings.P : opcode == DROPINOPSETI ? settings.I : settings.D).bytes, &frame[3], 4);
+		}
+		else if(opcode == DROPINOPSETINVERT)
+		{
+			settings.invert = frame[3];
+		}
+		else if(opcode == DROPINOPSETRUNCURRENT)
+		{
+			settings.runCurrent = frame[3];
+		}
+		else if(opcode == DROPINOPSETHOLDCURRENT)
+		{
+			settings.holdCurrent = frame[3];
+		}
+		if(status == DROPINSTATUSOK)
+		{
+			if(settingsValid(&settings))
+			{
+				model = settings;
+			}
+			else
+			{
+				status = DROPINSTATUSVALUE;
+			}
+		}
+
+		HOSTCHECK(responses[0].opcode == opcode, "frame %lu: response to opcode 0x%02X, expected 0x%02X", (unsigned long)n, responses[0].opcode, opcode);
+		HOSTCHECK(responses[0].status == status, "frame %lu, opcode 0x%02X: status %u, expected %u", (unsigned long)n, opcode, responses[0].status, status);
+
+		if(status == DROPINSTATUSOK && opcode == DROPINOPGETVERSION)
+		{
+			HOSTCHECK(responses[0].length == 1 && responses[0].data[0] == DROPINPROTOCOLVERSION, "frame %lu: version", (unsigned long)n);
+		}
+		else if(status == DROPINSTATUSOK && opcode == DROPINOPGETPARAMETERS)
+		{
+			HOSTCHECK(responses[0].length == 15 && memcmp(responses[0].data, &model, 15) == 0, "frame %lu: parameters read back differ from the model", (unsigned long)n);
+			roundTrips++;
+		}
+		else if(status == DROPINSTATUSOK && opcode == DROPINOPGETERROR)
+		{
+			HOSTCHECK(responses[0].length == 4, "frame %lu: pid error of %u bytes", (unsigned long)n, responses[0].length);
+		}
+		else
+		{
+			HOSTCHECK(responses[0].length == 0, "frame %lu, opcode 0x%02X: %u data bytes", (unsigned long)n, opcode, responses[0].length);
+		}
+
+		EEPROM.get(0, stored);
+		HOSTCHECK(memcmp(&stepper.dropinSettings, &model, 15) == 0, "frame %lu: settings in use differ from the model", (unsigned long)n);
+		HOSTCHECK(memcmp(&stored, &model, 15) == 0 && stepper.loadDropinSettings(), "frame %lu: settings in the EEPROM differ from the model", (unsigned long)n);
+	}
+
+	printf("%lu frames: %lu answered, %lu corrupted and ignored, %lu parameter read backs\n", (unsigned long)FRAMES, (unsigned long)answered, (unsigned long)corrupted, (unsigned long)roundTrips);
+
+	//Random bytes: whatever is received, the output must stay well formed
+	hostSerialOut.clear();
+	for(uint32_t n = 0; n < RANDOMBYTES; n++)
+	{
+		hostSerialIn.push_back(random32() % 8 == 0 ? DROPINFRAMESYNC : (uint8_t)random32());
+		if(n % 64 == 63)
+		{
+			stepper.dropinCliService();
+		}
+	}
+	stepper.dropinCliService();
+
+	//The command line interface answers in plain text, so every sync byte sent starts a frame
+	decoded = decodeResponses(responses);
+	printf("%lu random bytes: %lu responses\n", (unsigned long)RANDOMBYTES, (unsigned long)responses.size());
+	HOSTCHECK(decoded, "malformed response to random input");
+	settings = stepper.dropinSettings;
+	HOSTCHECK(settingsValid(&settings), "settings out of range after random input");
+	HOSTCHECK(stepper.loadDropinSettings(), "settings in the EEPROM invalid after random input");
+
+	return HOSTTESTRESULT();
+}
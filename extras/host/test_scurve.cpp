@@ -0,0 +1,138 @@
+/** @file test_scurve.cpp
+ * @brief      Profile simulator: following error of the S-curve against the trapezoidal profile
+ *
+ *             The rotor is modelled as a lightly damped mass on the magnetic
+ *             spring of the stepper (resonance RESONANCE Hz, damping DAMPING of the
+ *             motion relative to the driver), driven by the microstep position of
+ *             the driver. The same move is run with the trapezoidal profile and with
+ *             S-curves of increasing ramp time, and the peak following error (driver
+ *             position minus rotor position) is printed while accelerating, while
+ *             cruising (the vibration left by the acceleration), over the whole move
+ *             and after it has stopped.
+ *
+ *             Every move must end on the target. The vibration must drop with every
+ *             longer ramp, and the longest ramp must halve it.
+ */
+
+#include "hostSim.h"
+
+/** Resonance of the rotor and load, in Hz */
+#define RESONANCE 20.0
+/** Damping ratio of the resonance */
+#define DAMPING 0.05
+/** Time step of the rotor model, in seconds */
+#define MODELSTEP 20.0e-6
+
+#define ACCELERATION 50000.0
+#define VELOCITY 4000.0
+#define DISTANCE 12800
+
+uStepperSLite stepper(ACCELERATION, VELOCITY);
+
+typedef struct
+{
+	double startError;		/**< Largest following error until the deceleration starts, microsteps */
+	double cruiseError;		/**< Largest following error while cruising: vibration left by the acceleration, microsteps */
+	double peakError;		/**< Largest following error while moving, microsteps */
+	double residual;		/**< Largest following error after the profile stopped, microsteps */
+	double duration;		/**< Time from the start of the move until the profile stopped, seconds */
+	int32_t steps;			/**< Steps sent to the driver */
+} moveResult_t;
+
+/** Rotor position and velocity, in microsteps and microsteps/s */
+static double rotor, rotorVelocity;
+
+static double modelStep(void)
+{
+	const double omega = 2.0 * M_PI * RESONANCE;
+	double previous = (double)halSimDriverSteps, command, commandVelocity;
+
+	hostSimRun(stepper, MODELSTEP);
+	command = (double)halSimDriverSteps;
+	commandVelocity = (command - previous) / MODELSTEP;
+	rotorVelocity += (omega * omega * (command - rotor) + 2.0 * DAMPING * omega * (commandVelocity - rotorVelocity)) * MODELSTEP;
+	rotor += rotorVelocity * MODELSTEP;
+	hostSimRotorOffset = rotor - (double)halSimDriverSteps;
+
+	return command - rotor;
+}
+
+/**
+ * @brief      Run the move with an S-curve ramp of "length" encoder samples, or the trapezoidal profile if 0
+ */
+static moveResult_t runMove(uint8_t length)
+{
+	moveResult_t result = {0.0, 0.0, 0.0, 0.0, 0.0, 0};
+	int32_t start = halSimDriverSteps;
+	double t = 0.0, cruiseStart = -1.0, error;
+
+	stepper.setMaxJerk(length ? ACCELERATION / (length * ENCODERINTSAMPLETIME) : 0.0);
+	stepper.moveSteps(DISTANCE, CW, HARD);
+
+	while(t < 0.02 || stepper.getMotorState())
+	{
+		error = fabs(modelStep());
+		result.peakError = error > result.peakError ? error : result.peakError;
+		if(stepper.state != DECEL && stepper.state != STOP)
+		{
+			result.startError = result.peakError;
+		}
+
+		if(stepper.state == CRUISE && cruiseStart < 0.0)
+		{
+			cruiseStart = t;
+		}
+		//The S-curve reaches the cruise speed one ramp after the profile
+		if(stepper.state == CRUISE && t >= cruiseStart + length * ENCODERINTSAMPLETIME)
+		{
+			result.cruiseError = error > result.cruiseError ? error : result.cruiseError;
+		}
+		t += MODELSTEP;
+	}
+	result.duration = t;
+
+	for(t = 0.0; t < 0.5; t += MODELSTEP)
+	{
+		error = fabs(modelStep());
+		result.residual = error > result.residual ? error : result.residual;
+	}
+	result.steps = halSimDriverSteps - start;
+
+	return result;
+}
+
+int main(void)
+{
+	moveResult_t trapezoid, scurve;
+	const uint8_t lengths[] = {4, 8, 16, 32};
+	double previous;
+
+	hostSimInit();
+	stepper.setup(NORMAL, HOSTSIMSTEPSPERREVOLUTION);
+	hostSimRun(stepper, 0.1);
+	rotor = (double)halSimDriverSteps;
+
+	printf("%d microsteps at %.0f steps/s^2, %.0f steps/s, %.0f Hz resonance\n", DISTANCE, ACCELERATION, VELOCITY, RESONANCE);
+	printf("                   peak following error (microsteps)\n");
+	printf("profile   ramp ms  accelerating  cruising  whole move  after stop  duration s\n");
+
+	trapezoid = runMove(0);
+	printf("trapezoid %7.1f  %12.2f  %8.2f  %10.2f  %10.2f  %10.3f\n", 0.0, trapezoid.startError, trapezoid.cruiseError, trapezoid.peakError, trapezoid.residual, trapezoid.duration);
+	HOSTCHECK(trapezoid.steps == DISTANCE, "trapezoid: %ld steps", (long)trapezoid.steps);
+
+	previous = trapezoid.cruiseError;
+	for(uint8_t i = 0; i < sizeof(lengths); i++)
+	{
+		scurve = runMove(lengths[i]);
+		printf("S-curve   %7.1f  %12.2f  %8.2f  %10.2f  %10.2f  %10.3f\n", lengths[i] * ENCODERINTSAMPLETIME * 1000.0, scurve.startError, scurve.cruiseError, scurve.peakError, scurve.residual, scurve.duration);
+		HOSTCHECK(stepper.jerkFilterLength == lengths[i], "jerk filter length %u, expected %u", stepper.jerkFilterLength, lengths[i]);
+		HOSTCHECK(scurve.steps == DISTANCE, "S-curve %u: %ld steps", lengths[i], (long)scurve.steps);
+		HOSTCHECK(scurve.cruiseError < previous, "S-curve %u: vibration %.2f not below %.2f", lengths[i], scurve.cruiseError, previous);
+		previous = scurve.cruiseError;
+	}
+
+	HOSTCHECK(scurve.cruiseError < 0.5 * trapezoid.cruiseError, "longest S-curve: vibration %.2f, trapezoid %.2f", scurve.cruiseError, trapezoid.cruiseError);
+	HOSTCHECK(scurve.peakError < trapezoid.peakError, "longest S-curve: peak error %.2f, trapezoid %.2f", scurve.peakError, trapezoid.peakError);
+
+	return HOSTTESTRESULT();
+}
@@ -0,0 +1,166 @@
+/** @file test_stall.cpp
+ * @brief      Stall detection: false positives and detection latency of every algorithm
+ *
+ *             The same set of traces is run with each detectStall() algorithm, at the
+ *             default stall sensitivity:
+ *             - free moves from 300 to 8000 steps/s, with and without encoder noise,
+ *             - continuous runs with the rotor lagging 24 microsteps (1.5 full steps)
+ *               behind the driver, as under a constant load,
+ *             - continuous runs into a hard stop.
+ *             Every encoder sample reported as stalled in the first two is a false
+ *             positive. In the last, the latency is the time from the rotor hitting
+ *             the stop until the stall is reported.
+ */
+
+#include "hostSim.h"
+
+/** Stall sensitivity used by every trace */
+#define SENSITIVITY 0.992
+/** Longest accepted time from hitting the stop until the stall is reported, in seconds */
+#define MAXLATENCY 1.0
+
+uStepperSLite stepper(5000, 1000);
+
+typedef struct
+{
+	uint8_t algorithm;
+	const char *name;
+} algorithm_t;
+
+static const algorithm_t algorithms[] = {
+	{STALLDETECTIIR, "IIR"},
+	{STALLDETECTFOLLOWINGERROR, "following error"},
+	{STALLDETECTVELOCITYRATIO, "velocity ratio"},
+};
+
+static const float speeds[] = {300.0, 1000.0, 3000.0, 8000.0};
+
+/** Run "seconds" of encoder samples, returning the number of samples reported as stalled */
+static uint32_t runSamples(double seconds)
+{
+	uint32_t stalled = 0;
+
+	for(double t = 0.0; t < seconds; t += ENCODERINTSAMPLETIME)
+	{
+		hostSimRun(stepper, ENCODERINTSAMPLETIME);
+		stalled += stepper.isStalled(SENSITIVITY);
+	}
+
+	return stalled;
+}
+
+/** Stop the motor, take the rotor back to the driver and start the detection over */
+static void restart(const algorithm_t *algorithm)
+{
+	stepper.stop(HARD);
+	hostSimRun(stepper, 0.2);
+	hostSimWall = INFINITY;
+	hostSimRotorOffset = 0.0;
+	hostSimEncoderNoise = 0.0;
+	hostSimRun(stepper, 0.1);
+	stepper.setStallDetection(algorithm->algorithm);
+	stepper.isStalled(SENSITIVITY);
+}
+
+/** Free move at "speed", returning the samples reported as stalled */
+static uint32_t freeMove(const algorithm_t *algorithm, float speed, double noise)
+{
+	uint32_t stalled;
+
+	restart(algorithm);
+	hostSimEncoderNoise = noise;
+	stepper.setMaxVelocity(speed);
+	stepper.moveSteps((int32_t)(speed * 2.0), CW, HARD);
+	stalled = runSamples(2.5 + (speed / 5000.0));
+
+	return stalled;
+}
+
+/** One second of continuous run at "speed", with the rotor "lag" microsteps behind */
+static uint32_t loadLag(const algorithm_t *algorithm, float speed, double lag)
+{
+	restart(algorithm);
+	stepper.setMaxVelocity(speed);
+	stepper.runContinous(CW);
+	runSamples(0.5);
+	hostSimRotorOffset -= lag;
+
+	return runSamples(1.0);
+}
+
+/** Continuous run at "speed" into a stop, returning the detection latency in seconds, or -1.0 */
+static double wall(const algorithm_t *algorithm, float speed)
+{
+	double t;
+
+	restart(algorithm);
+	stepper.setMaxVelocity(speed);
+	stepper.runContinous(CW);
+	runSamples(0.8);
+	if(stepper.stall)
+	{
+		return -1.0;
+	}
+
+	hostSimWall = hostSimRotorPosition() + 5.0;
+	while(hostSimRotorPosition() < hostSimWall)
+	{
+		hostSimRun(stepper, 1.0e-5);
+	}
+
+	for(t = 0.0; t < 3.0; t += ENCODERINTSAMPLETIME)
+	{
+		hostSimRun(stepper, ENCODERINTSAMPLETIME);
+		if(stepper.isStalled(SENSITIVITY))
+		{
+			return t;
+		}
+	}
+
+	return -1.0;
+}
+
+int main(void)
+{
+	const algorithm_t *algorithm;
+	uint32_t stalled;
+	double latency;
+
+	hostSimInit();
+	stepper.setup(NORMAL, HOSTSIMSTEPSPERREVOLUTION);
+	hostSimRun(stepper, 0.1);
+
+	printf("stall sensitivity %.3f, %d Hz encoder samples\n", SENSITIVITY, ENCODERINTFREQ);
+	printf("algorithm         speed  false positives (samples)        stop latency\n");
+	printf("                  st/s   free  noisy  1.5 step lag        ms\n");
+
+	for(uint8_t i = 0; i < sizeof(algorithms) / sizeof(algorithms[0]); i++)
+	{
+		algorithm = &algorithms[i];
+
+		for(uint8_t j = 0; j < sizeof(speeds) / sizeof(speeds[0]); j++)
+		{
+			printf("%-16s %6.0f", algorithm->name, speeds[j]);
+
+			stalled = freeMove(algorithm, speeds[j], 0.0);
+			printf("  %5lu", (unsigned long)stalled);
+			HOSTCHECK(stalled == 0, "%s: %lu samples stalled in a free move at %.0f steps/s", algorithm->name, (unsigned long)stalled, speeds[j]);
+
+			stalled = freeMove(algorithm, speeds[j], 2.0);
+			printf("  %5lu", (unsigned long)stalled);
+			HOSTCHECK(stalled == 0, "%s: %lu samples stalled in a free move at %.0f steps/s, with encoder noise", algorithm->name, (unsigned long)stalled, speeds[j]);
+
+			stalled = loadLag(algorithm, speeds[j], 24.0);
+			printf("  %12lu", (unsigned long)stalled);
+			HOSTCHECK(stalled == 0, "%s: %lu samples stalled with a load lag at %.0f steps/s", algorithm->name, (unsigned long)stalled, speeds[j]);
+
+			latency = wall(algorithm, speeds[j]);
+			printf("  %12.0f\n", latency * 1000.0);
+			HOSTCHECK(latency >= 0.0 && latency < MAXLATENCY, "%s: stop at %.0f steps/s detected after %.0f ms", algorithm->name, speeds[j], latency * 1000.0);
+		}
+	}
+
+	restart(&algorithms[0]);
+
+	return HOSTTESTRESULT();
+}
@@ -0,0 +1,66 @@
+/** @file test_stepdelay.cpp
+ * @brief      Exhaustive check of stepDelayFromSpeed() against the exact quotient
+ *
+ *             For every float speed from 5 to 2^24 steps/s (both signs), the step
+ *             delay must equal STEPGENERATORFREQUENCY/|speed| in Q24.8, rounded to
+ *             nearest (ties up), as calculated with exact integer arithmetic.
+ */
+
+#include "hostSim.h"
+#include <uStepperSLite.cpp>		//stepDelayFromSpeed() is local to the library source
+
+/** STEPGENERATORFREQUENCY*256/|speed|, rounded to nearest, from the bits of a float above 1.0 */
+static uint32_t exactDelay(uint32_t bits)
+{
+	uint32_t mantissa = (bits & 0x7FFFFF) | 0x800000;
+	int exponent = (int)((bits >> 23) & 0xFF) - 127;
+	unsigned __int128 numerator = (unsigned __int128)((uint64_t)STEPGENERATORFREQUENCY * 256) << (23 - exponent);
+
+	//|speed| = mantissa * 2^(exponent - 23)
+	return (uint32_t)((2 * numerator + mantissa) / (2 * (unsigned __int128)mantissa));
+}
+
+static float fromBits(uint32_t bits)
+{
+	float value;
+
+	memcpy(&value, &bits, sizeof(value));
+
+	return value;
+}
+
+int main(void)
+{
+	uint32_t bits, first, last, expected, result, mismatches = 0, checked = 0;
+
+	first = 0x40A00001;		//Next float above 5.0
+	last = 0x4B7FFFFF;		//Last float below 2^24
+
+	for(bits = first; bits <= last; bits++)
+	{
+		expected = exactDelay(bits);
+		result = stepDelayFromSpeed(fromBits(bits));
+		if(result != expected || stepDelayFromSpeed(-fromBits(bits)) != expected)
+		{
+			if(mismatches++ < 10)
+			{
+				printf("speed %.9g: %lu, expected %lu\n", fromBits(bits), (unsigned long)result, (unsigned long)expected);
+			}
+		}
+		checked++;
+	}
+
+	printf("%lu speeds checked, %lu mismatches\n", (unsigned long)checked, (unsigned long)mismatches);
+	HOSTCHECK(mismatches == 0, "%lu speeds give a wrong delay", (unsigned long)mismatches);
+
+	HOSTCHECK(stepDelayFromSpeed(0.0) == (uint32_t)20000 << 8, "speed 0");
+	HOSTCHECK(stepDelayFromSpeed(5.0) == (uint32_t)20000 << 8, "speed 5.0");
+	HOSTCHECK(stepDelayFromSpeed(-5.0) == (uint32_t)20000 << 8, "speed -5.0");
+	HOSTCHECK(stepDelayFromSpeed(NAN) == (uint32_t)20000 << 8, "speed NaN");
+	HOSTCHECK(stepDelayFromSpeed(INFINITY) == 0, "speed infinity");
+	HOSTCHECK(stepDelayFromSpeed(16777216.0) == 0, "speed 2^24");
+	HOSTCHECK(stepDelayFromSpeed(1.0e9) == 0, "speed 10^9");
+	HOSTCHECK(stepDelayFromSpeed(1000.0) == 100UL << 8, "speed 1000: %lu", (unsigned long)stepDelayFromSpeed(1000.0));
+
+	return HOSTTESTRESULT();
+}
@@ -0,0 +1,162 @@
+#!/usr/bin/env python3
+"""Compare the speed observers of uStepperSLite::setSpeedObserver() on a recorded trace.
+
+Usage:
+    traceDecoder.py dump.bin > trace.csv
+    speedObserver.py trace.csv
+    speedObserver.py trace.csv --bandwidth 3.56 10 20 --observer kalman
+
+Every observer is run on the angle_moved column of the trace (encoder counts,
+one row per recorded sample), with the same gains as the firmware. For every
+observer and bandwidth the script prints:
+
+    lag     delay of the estimate behind the true speed while the motion
+            profile accelerates or decelerates (ms)
+    noise   RMS deviation of the estimate from its mean, in the last three
+            quarters of every stretch of cruising or standing still (counts/s)
+
+The true speed during an acceleration or deceleration is the slope of a
+least squares parabola through the positions of its last half, so the lag
+is not disturbed by encoder noise. Record the trace without decimation for
+meaningful numbers.
+"""
+
+import argparse
+import csv
+import math
+import sys
+
+PULSEFILTERKP = 60.0
+PULSEFILTERKI_CONTINUOUS = 500.0          # PULSEFILTERKI / ENCODERINTSAMPLETIME
+PLLBANDWIDTH = math.sqrt(PULSEFILTERKI_CONTINUOUS) / (2.0 * math.pi)
+OBSERVERS = ("pll", "alphabeta", "kalman")
+MOVING = ("ACCEL", "DECEL", "INITDECEL")
+STEADY = ("CRUISE", "STOP")
+
+
+def gains(observer, bandwidth, period):
+    """Gains per sample, as set by uStepperSLite::setSpeedObserver()."""
+    if observer == "pll":
+        scale = bandwidth / PLLBANDWIDTH
+        return PULSEFILTERKP * scale * period, PULSEFILTERKI_CONTINUOUS * scale * scale * period * period
+    omega = 2.0 * math.pi * bandwidth * period
+    if observer == "alphabeta":
+        pole = math.exp(-omega)
+        return 1.0 - pole * pole, (1.0 - pole) ** 2
+    lam = omega * omega
+    root = math.sqrt(lam * lam + 8.0 * lam)
+    return (-(lam * lam + 8.0 * lam - (lam + 4.0) * root) / 8.0,
+            (lam * lam + 4.0 * lam - lam * root) / 4.0)
+
+
+def observe(observer, bandwidth, period, positions):
+    """Return the estimated speed, in counts/s, for every position."""
+    position_gain, velocity_gain = gains(observer, bandwidth, period)
+    estimate = float(positions[0])
+    velocity = integrator = 0.0             # counts per sample
+    speeds = []
+    for position in positions:
+        estimate += velocity
+        error = position - estimate
+        if observer == "pll":
+            integrator += error * velocity_gain
+            velocity = error * position_gain + integrator
+            speeds.append(integrator / period)
+        else:
+            estimate += error * position_gain
+            velocity += error * velocity_gain
+            speeds.append(velocity / period)
+    return speeds
+
+
+def noise(speeds, states):
+    """RMS deviation from the mean speed, in the last three quarters of every cruise or stop."""
+    deviations = []
+    for segment in segments(states, STEADY):
+        segment = segment[len(segment) // 4:]
+        if len(segment) < 2:
+            continue
+        mean = sum(speeds[i] for i in segment) / len(segment)
+        deviations.extend(speeds[i] - mean for i in segment)
+    return rms(deviations)
+
+
+def rms(values):
+    return math.sqrt(sum(v * v for v in values) / len(values)) if values else float("nan")
+
+
+def segments(states, names):
+    """Yield the sample indexes of every stretch of rows with a state in names."""
+    start = None
+    for i, state in enumerate(states + [None]):
+        if state in names:
+            if start is None:
+                start = i
+        elif start is not None:
+            yield range(start, i)
+            start = None
+
+
+def lag(speeds, positions, states, period):
+    """Mean delay (s) of the estimate behind the speed of the position, in the
+    last half of every acceleration or deceleration, where the speed is a ramp."""
+    delays = []
+    for segment in segments(states, MOVING):
+        rows = segment[len(segment) // 2:]
+        if len(rows) < 8:
+            continue
+        # the speed ramp is the derivative of the parabola through the positions
+        tc = [(i - rows[0]) * period for i in rows]
+        a2, a1, _ = parabola(tc, [positions[i] for i in rows])
+        if abs(a2) < 1e-9:
+            continue
+        delays.extend(((2.0 * a2 * tt + a1) - speeds[i]) / (2.0 * a2) for tt, i in zip(tc, rows))
+    return sum(delays) / len(delays) if delays else float("nan")
+
+
+def parabola(x, y):
+    """Least squares parabola through the points, returned as (a2, a1, a0)."""
+    sums = [sum(a ** k for a in x) for k in range(5)]
+    rhs = [sum(b * a ** k for a, b in zip(x, y)) for k in range(3)]
+    m = [[sums[i + j] for j in range(3)] + [rhs[i]] for i in range(3)]
+    for c in range(3):
+        for r in range(c + 1, 3):
+            f = m[r][c] / m[c][c]
+            m[r] = [u - f * v for u, v in zip(m[r], m[c])]
+    coef = [0.0] * 3
+    for r in (2, 1, 0):
+        coef[r] = (m[r][3] - sum(m[r][j] * coef[j] for j in range(r + 1, 3))) / m[r][r]
+    return coef[2], coef[1], coef[0]
+
+
+def read_trace(source):
+    f = sys.stdin if source == "-" else open(source)
+    with f:
+        rows = [row for row in csv.DictReader(f) if row["frame"] == "1"]
+    if len(rows) < 2:
+        raise SystemExit("no samples in %s" % source)
+    period = float(rows[1]["time_s"]) - float(rows[0]["time_s"])
+    return [int(row["angle_moved"]) for row in rows], [row["state"] for row in rows], period
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("trace", help="CSV written by traceDecoder.py, or - for stdin (first frame is used)")
+    parser.add_argument("--observer", nargs="+", choices=OBSERVERS, default=list(OBSERVERS))
+    parser.add_argument("--bandwidth", nargs="+", type=float, default=[PLLBANDWIDTH, 10.0, 20.0],
+                        help="natural frequencies to compare, in Hz")
+    args = parser.parse_args()
+
+    positions, states, period = read_trace(args.trace)
+    print("observer    bandwidth_hz  lag_ms  noise_counts_per_s")
+    for bandwidth in args.bandwidth:
+        for observer in args.observer:
+            speeds = observe(observer, bandwidth, period, positions)
+            print("%-11s %12.2f %7.1f %19.1f" % (observer, bandwidth,
+                                                   lag(speeds, positions, states, period) * 1000.0,
+                                                   noise(speeds, states)))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
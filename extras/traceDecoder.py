@@ -0,0 +1,96 @@
+#!/usr/bin/env python3
+"""Decode trace frames sent by uStepperSLite::dumpTrace() into CSV.
+
+Usage:
+    traceDecoder.py dump.bin > trace.csv
+    traceDecoder.py /dev/ttyUSB0 --baud 9600 > trace.csv   (needs pyserial)
+    traceDecoder.py - < dump.bin > trace.csv
+
+Bytes that are not part of a frame (e.g. text printed by the sketch) are
+skipped. Every valid frame found is written as CSV rows; a frame with a bad
+checksum is reported on stderr and skipped.
+"""
+
+import argparse
+import struct
+import sys
+
+SYNC = b"\xa5\x5a"
+VERSION = 1
+HEADER = struct.Struct("<BBHHHB")      # version, record size, count, trigger index, sample frequency, decimation
+RECORD = struct.Struct("<iffIB")       # angleMoved, pidTargetPosition, pidError, stepDelay, state
+NOTRIGGER = 0xFFFF
+STATES = {1: "STOP", 2: "ACCEL", 4: "CRUISE", 8: "DECEL", 16: "INITDECEL"}
+
+
+def checksum(data):
+    value = 0xAA
+    for byte in data:
+        value ^= byte
+    return value
+
+
+def frames(data):
+    """Yield (header, records) for every valid frame in data."""
+    pos = 0
+    while True:
+        pos = data.find(SYNC, pos)
+        if pos < 0 or pos + len(SYNC) + HEADER.size > len(data):
+            return
+        start = pos + len(SYNC)
+        version, size, count, trigger, frequency, decimation = HEADER.unpack_from(data, start)
+        end = start + HEADER.size + count * size
+        if version != VERSION or size != RECORD.size or end >= len(data):
+            pos += 1
+            continue
+        if checksum(data[start:end]) != data[end]:
+            sys.stderr.write("frame at byte %d: bad checksum, skipped\n" % pos)
+            pos += 1
+            continue
+        records = [RECORD.unpack_from(data, start + HEADER.size + i * size) for i in range(count)]
+        yield (trigger, frequency, decimation), records
+        pos = end + 1
+
+
+def read_input(source, baud, timeout):
+    if source == "-":
+        return sys.stdin.buffer.read()
+    if source.startswith("/dev/") or source.upper().startswith("COM"):
+        import serial
+        with serial.Serial(source, baud, timeout=timeout) as port:
+            data = bytearray()
+            while True:
+                chunk = port.read(4096)
+                if not chunk:
+                    return bytes(data)
+                data += chunk
+    with open(source, "rb") as f:
+        return f.read()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("source", help="file, serial port, or - for stdin")
+    parser.add_argument("--baud", type=int, default=9600, help="baud rate of the serial port")
+    parser.add_argument("--timeout", type=float, default=2.0, help="seconds of silence ending a serial capture")
+    args = parser.parse_args()
+
+    data = read_input(args.source, args.baud, args.timeout)
+    out = sys.stdout
+    out.write("frame,sample,time_s,angle_moved,angle_deg,pid_target_position,pid_error,step_delay,state\n")
+    found = 0
+    for found, ((trigger, frequency, decimation), records) in enumerate(frames(data), 1):
+        period = decimation / float(frequency)
+        origin = trigger if trigger != NOTRIGGER else 0
+        for i, (angle, target, error, delay, state) in enumerate(records):
+            out.write("%d,%d,%.6f,%d,%.3f,%.3f,%.3f,%.2f,%s\n" % (
+                found, i, (i - origin) * period, angle, angle * 360.0 / 4096.0,
+                target, error, delay / 256.0, STATES.get(state, state)))
+    if not found:
+        sys.stderr.write("no trace frame found\n")
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,174 @@
+#!/usr/bin/env python3
+"""Host side of the uStepper S-lite dropin binary protocol.
+
+A frame is SYNC, opcode, payload length, payload and a CRC8 of the opcode,
+length and payload (polynomial 0x07, bits taken LSB first, as the TMC2208
+UART). Responses carry the opcode OR'ed with OP_RESPONSE and a payload
+starting with a status byte. See DROPINFRAMESYNC in uStepperSLite.h.
+
+Example, using pyserial:
+
+    import serial, uStepperProtocol
+    with serial.Serial("/dev/ttyUSB0", 9600, timeout=1) as port:
+        stepper = uStepperProtocol.Client(port)
+        print(stepper.get_parameters())
+        stepper.set_parameters(P=1.0, I=0.02, D=0.5, runCurrent=60, holdCurrent=30)
+"""
+
+import struct
+
+SYNC = 0xC5
+MAX_PAYLOAD = 16
+PROTOCOL_VERSION = 1
+
+OP_GET_VERSION = 0x00
+OP_GET_PARAMETERS = 0x01
+OP_SET_PARAMETERS = 0x02
+OP_SET_P = 0x03
+OP_SET_I = 0x04
+OP_SET_D = 0x05
+OP_SET_INVERT = 0x06
+OP_SET_RUN_CURRENT = 0x07
+OP_SET_HOLD_CURRENT = 0x08
+OP_GET_ERROR = 0x09
+OP_RESPONSE = 0x80
+
+STATUS_OK = 0
+STATUS_UNKNOWN = 1
+STATUS_LENGTH = 2
+STATUS_VALUE = 3
+
+PARAMETERS = struct.Struct("<fffBBB")   # P, I, D, invert, holdCurrent, runCurrent
+
+
+class ProtocolError(Exception):
+    """Raised when the uStepper rejects a request, or does not answer."""
+
+    def __init__(self, message, status=None):
+        Exception.__init__(self, message)
+        self.status = status
+
+
+def crc8(data):
+    """CRC8 of data, identical to Tmc2208::calcCRC()."""
+    crc = 0
+    for byte in bytearray(data):
+        for _ in range(8):
+            if (crc >> 7) ^ (byte & 0x01):
+                crc = ((crc << 1) ^ 0x07) & 0xFF
+            else:
+                crc = (crc << 1) & 0xFF
+            byte >>= 1
+    return crc
+
+
+def encode(opcode, payload=b""):
+    """Return the frame carrying opcode and payload."""
+    payload = bytes(payload)
+    if len(payload) > MAX_PAYLOAD:
+        raise ValueError("payload longer than %d bytes" % MAX_PAYLOAD)
+    body = bytes(bytearray([opcode & 0xFF, len(payload)])) + payload
+    return bytes(bytearray([SYNC])) + body + bytes(bytearray([crc8(body)]))
+
+
+class Decoder(object):
+    """Finds frames in a byte stream, in the same way as the uStepper does.
+
+    Bytes outside frames (e.g. text printed by the dropin CLI) are returned
+    by feed() separately, so text and binary replies can be mixed.
+    """
+
+    def __init__(self):
+        self.reset()
+
+    def reset(self):
+        self._frame = None
+
+    def feed(self, data):
+        """Add received bytes. Returns (frames, text): a list of
+        (opcode, payload) tuples with a valid CRC, and the other bytes."""
+        frames = []
+        text = bytearray()
+        for byte in bytearray(data):
+            if self._frame is None:
+                if byte == SYNC:
+                    self._frame = bytearray()
+                else:
+                    text.append(byte)
+                continue
+            self._frame.append(byte)
+            if len(self._frame) < 2:
+                continue
+            length = self._frame[1]
+            if length > MAX_PAYLOAD:
+                self._frame = None
+                continue
+            if len(self._frame) == length + 3:
+                frame, self._frame = self._frame, None
+                if crc8(frame[:-1]) == frame[-1]:
+                    frames.append((frame[0], bytes(frame[2:-1])))
+        return frames, bytes(text)
+
+
+class Client(object):
+    """Sends requests on a serial port like object (read(n), write(data))."""
+
+    def __init__(self, port):
+        self.port = port
+        self.decoder = Decoder()
+
+    def request(self, opcode, payload=b""):
+        """Send a request, and return the data of the response (after the status byte)."""
+        self.decoder.reset()
+        self.port.write(encode(opcode, payload))
+        while True:
+            data = self.port.read(1)
+            if not data:
+                raise ProtocolError("no response to opcode 0x%02X" % opcode)
+            frames, _ = self.decoder.feed(data)
+            for rxOpcode, rxPayload in frames:
+                if rxOpcode != (opcode | OP_RESPONSE) or not rxPayload:
+                    continue
+                if rxPayload[0] != STATUS_OK:
+                    raise ProtocolError("opcode 0x%02X rejected, status %d" % (opcode, rxPayload[0]), rxPayload[0])
+                return rxPayload[1:]
+
+    def get_version(self):
+        return bytearray(self.request(OP_GET_VERSION))[0]
+
+    def get_parameters(self):
+        P, I, D, invert, holdCurrent, runCurrent = PARAMETERS.unpack(self.request(OP_GET_PARAMETERS))
+        return {"P": P, "I": I, "D": D, "invert": invert, "holdCurrent": holdCurrent, "runCurrent": runCurrent}
+
+    def set_parameters(self, **settings):
+        """Set any of P, I, D, invert, holdCurrent and runCurrent in one request.
+        Settings not given keep their current value."""
+        current = self.get_parameters()
+        unknown = set(settings) - set(current)
+        if unknown:
+            raise ValueError("unknown settings: %s" % ", ".join(sorted(unknown)))
+        current.update(settings)
+        self.request(OP_SET_PARAMETERS, PARAMETERS.pack(current["P"], current["I"], current["D"],
+                                                        current["invert"], current["holdCurrent"],
+                                                        current["runCurrent"]))
+
+    def set_p(self, value):
+        self.request(OP_SET_P, struct.pack("<f", value))
+
+    def set_i(self, value):
+        self.request(OP_SET_I, struct.pack("<f", value))
+
+    def set_d(self, value):
+        self.request(OP_SET_D, struct.pack("<f", value))
+
+    def set_invert(self, invert):
+        self.request(OP_SET_INVERT, struct.pack("<B", 1 if invert else 0))
+
+    def set_run_current(self, percent):
+        self.request(OP_SET_RUN_CURRENT, struct.pack("<B", percent))
+
+    def set_hold_current(self, percent):
+        self.request(OP_SET_HOLD_CURRENT, struct.pack("<B", percent))
+
+    def get_error(self):
+        return struct.unpack("<f", self.request(OP_GET_ERROR))[0]
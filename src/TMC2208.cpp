@@ -38,6 +38,20 @@
 
 #include "TMC2208.h"
 
+/** Register addresses of the shadowed registers, indexed by TMC2208_SHADOW_GCONF ... */
+static const uint8_t shadowAddress[TMC2208_SHADOWCOUNT] PROGMEM =
+{
+	TMC2208_GCONF,
+	TMC2208_SLAVECONF,
+	TMC2208_FACTORY_CONF,
+	TMC2208_IHOLD_IRUN,
+	TMC2208_TPOWERDOWN,
+	TMC2208_TPWMTHRS,
+	TMC2208_VACTUAL,
+	TMC2208_CHOPCONF,
+	TMC2208_PWMCONF
+};
+
 uint8_t Tmc2208::calcCRC(uint8_t datagram[], uint8_t len) {
 	uint8_t crc = 0;
 	for (uint8_t i = 0; i < len; i++) {
@@ -58,7 +72,8 @@ uint8_t Tmc2208::calcCRC(uint8_t datagram[], uint8_t len) {
 void Tmc2208::writeRegister(uint8_t address, int32_t value)
 {
 	uint8_t writeData[8];
-	//cli();
+	uint8_t sreg, encoderInterrupt;
+
 	writeData[0] = 0x05;                         // Sync byte
 	writeData[1] = 0x00;                         // Slave address
 	writeData[2] = address | TMC2208_WRITE_BIT;  // Register address with write bit set
@@ -68,71 +83,209 @@ void Tmc2208::writeRegister(uint8_t address, int32_t value)
 	writeData[6] = value & 0xFF;                 // Register Data
 	writeData[7] = calcCRC(writeData, 7);     // Cyclic redundancy check
 
+	// The encoder interrupt is masked while the datagram is sent, so no new encoder sample is
+	// started: running the control loop takes long enough to make the driver drop the datagram
+	// (more than 63 bit times between two bytes). A sample already on the I2C bus still completes
+	// in encoderSampleReady(), with interrupts enabled, and may call setVelocity(). The UART is
+	// claimed by flushRegister() (uartBusy), so that VACTUAL is only sent after this datagram.
+	// Other interrupts are only held off while a byte is on the line, see uartSendByte()
+	sreg = SREG;
+	cli();
+	encoderInterrupt = TIMSK1 & (1 << OCIE1A);
+	ENCODERINTDISABLE();
+	SREG = sreg;
+
 	for(uint32_t i = 0; i < ARRAY_SIZE(writeData); i++)
 	{
 		this->uartSendByte(writeData[i]);	
 	}
-	//sei();
+
+	cli();
+	this->ifcntExpected++;
+	if(encoderInterrupt)
+	{
+		ENCODERINTENABLE();
+	}
+	SREG = sreg;
 }
 
-void Tmc2208::readRegister(uint8_t address, int32_t *value)
+bool Tmc2208::readRegister(uint8_t address, int32_t *value)
 {
 	uint8_t readData[8], dataRequest[4];
-	
-cli();
+	uint8_t sreg, timerControlA, timerControlB;
+	bool received;
+
 	// Clear write bit
 	address &= ~TMC2208_WRITE_BIT;
 
 	dataRequest[0] = 0x05;                  // Sync byte
 	dataRequest[1] = 0x00;                  // Slave address
 	dataRequest[2] = address;               // Register address
-	dataRequest[7] = calcCRC(dataRequest, 3);     // Cyclic redundancy check
+	dataRequest[3] = calcCRC(dataRequest, 3);     // Cyclic redundancy check
+
+	// The reply follows the request after SENDDELAY (8 bit times by default), so
+	// interrupts are kept disabled from the request until the reply is received (~0.25 ms)
+	sreg = SREG;
+	cli();
+	timerControlA = TCCR4A;
+	timerControlB = TCCR4B;
+	TCCR4A = 0;
+	TCCR4B = (1 << CS40);		//Timer four running freely at F_CPU, used to time the received bits
 
 	for(uint32_t i = 0; i < ARRAY_SIZE(dataRequest); i++)
 	{
 		this->uartSendByte(dataRequest[i]);	
 	}
 
-	//this->uartReceivePacket(readData, 8);
-	_delay_ms(1);
-	return;
+	received = this->uartReceivePacket(readData, ARRAY_SIZE(readData));
+
+	TCCR4A = timerControlA;
+	TCCR4B = timerControlB;
+	SREG = sreg;
 
-	// Check if the received data is correct (CRC, Sync, Slave address, Register address)
-	// todo CHECK 2: Only keep CRC check? Should be sufficient for wrong transmissions (LH) #1
+	if(!received)
+		return 0;
+
+	// Check if the received data is correct (CRC, Sync, Master address, Register address)
 	if(readData[7] != calcCRC(readData, 7) || readData[0] != 0x05 || readData[1] != 0xFF || readData[2] != address)
-		return;
+		return 0;
 
 	*value = (uint32_t)readData[3] << 24 | (uint32_t)readData[4] << 16 | (uint32_t)readData[5] << 8 | (uint32_t)readData[6];
-	return;
+	return 1;
 }
 
 Tmc2208::Tmc2208(void)
 {
-
+	this->shadowValid = 0;
+	this->shadowDirty = 0;
+	this->uartBusy = 0;
+	this->writesHeld = 0;
+	this->ifcntExpected = 0;
+	this->ifcntValid = 0;
 }
 
 void Tmc2208::setup(void)
 {
 	int32_t registerSetting;
 
-	DDRD |= (1 << 4);			//Set Enable as output
-	DDRD |= (1 << 7);			//Set Step pin as output
-	DDRB |= (1 << 2);			//Set Dir pin as Output
+	ENABLEDDR |= (1 << ENABLEPIN);			//Set Enable as output
+	STEPDDR |= (1 << STEPPIN);			//Set Step pin as output
+	DIRDDR |= (1 << DIRPIN);			//Set Dir pin as Output
 
 	this->disableDriver();
 	this->uartInit();
+	this->verifyWrites();			//Synchronise the write counter with IFCNT
 	registerSetting = R00;
 	registerSetting |= TMC2208_PDN_DISABLE_MASK | TMC2208_INDEX_STEP_MASK ;
-	this->writeRegister(TMC2208_GCONF, registerSetting);
+	this->setRegister(TMC2208_SHADOW_GCONF, registerSetting);
 	registerSetting = 5000;
-	this->writeRegister(TMC2208_TPWMTHRS, registerSetting);
+	this->setRegister(TMC2208_SHADOW_TPWMTHRS, registerSetting);
 	this->setCurrent(60,30);
 	this->setVelocity(0);	
 }
 
-void Tmc2208::invertDirection(bool normal)
+void Tmc2208::setRegister(uint8_t index, int32_t value, bool hold)
 {
+	uint8_t sreg = SREG;
+	uint16_t mask = 1 << index;
+
 	cli();
+	if(!(this->shadowValid & mask) || this->shadowRegister[index] != value)
+	{
+		this->shadowRegister[index] = value;
+		this->shadowValid |= mask;
+		this->shadowDirty |= mask;
+	}
+	SREG = sreg;
+
+	if(!hold || !this->writesHeld)
+	{
+		this->flushRegister(index);
+	}
+}
+
+void Tmc2208::flushRegister(uint8_t index)
+{
+	uint8_t sreg = SREG;
+	uint16_t mask = 1 << index;
+	int32_t value;
+
+	// The UART is claimed before the value is taken from the shadow copy. The control loop
+	// (pidDropin() in encoderSampleReady(), run with interrupts enabled) can interrupt a datagram
+	// sent from the main context. Its setVelocity() then finds the UART busy and only leaves
+	// VACTUAL dirty, and VACTUAL is sent here once the datagram is done (or by the next sample).
+	// So datagrams never interleave, and the newest VACTUAL is always the last one sent
+	while(1)
+	{
+		cli();
+		if(this->uartBusy || !(this->shadowDirty & mask))
+		{
+			SREG = sreg;
+			return;
+		}
+		this->uartBusy = 1;
+		this->shadowDirty &= ~mask;
+		value = this->shadowRegister[index];
+		SREG = sreg;
+
+		this->writeRegister(pgm_read_byte(&shadowAddress[index]), value);
+
+		cli();
+		this->uartBusy = 0;
+		SREG = sreg;
+
+		index = TMC2208_SHADOW_VACTUAL;		//Left dirty if setVelocity() found the UART busy
+		mask = 1 << index;
+	}
+}
+
+void Tmc2208::holdWrites(void)
+{
+	this->writesHeld = 1;
+}
+
+bool Tmc2208::flushRegisters(void)
+{
+	this->writesHeld = 0;
+
+	for(uint8_t i = 0; i < TMC2208_SHADOWCOUNT; i++)
+	{
+		this->flushRegister(i);
+	}
+
+	return this->verifyWrites();
+}
+
+bool Tmc2208::verifyWrites(void)
+{
+	uint8_t sreg = SREG;
+	int32_t ifcnt;
+	uint8_t expected;
+	bool valid;
+
+	// readRegister() keeps interrupts disabled, so no write can slip in before the expected count is taken
+	cli();
+	if(!this->readRegister(TMC2208_IFCNT, &ifcnt))
+	{
+		SREG = sreg;
+		return 0;
+	}
+	expected = this->ifcntExpected;
+	valid = this->ifcntValid;
+	this->ifcntExpected = (uint8_t)ifcnt;
+	this->ifcntValid = 1;
+	if(valid && expected != (uint8_t)ifcnt)
+	{
+		this->shadowDirty |= this->shadowValid;
+		valid = 0;
+	}
+	SREG = sreg;
+
+	return valid;
+}
+
+void Tmc2208::invertDirection(bool normal)
+{
 	int32_t registerSetting;
 	registerSetting = R00;
 	if(normal == NORMALDIRECTION)
@@ -143,18 +296,17 @@ void Tmc2208::invertDirection(bool normal)
 	{
 		registerSetting |= TMC2208_PDN_DISABLE_MASK | TMC2208_INDEX_STEP_MASK | TMC2208_SHAFT_MASK;
 	}
-	this->writeRegister(TMC2208_GCONF, registerSetting);
-	sei();
+	this->setRegister(TMC2208_SHADOW_GCONF, registerSetting);
 }
 
 void Tmc2208::enableDriver(void)
 {
-	PORTD &= ~(1 << 4);				//Enable motor driver
+	DRIVERENABLE();				//Enable motor driver
 }
 
 void Tmc2208::disableDriver(void)
 {
-	PORTD |= (1 << 4);				//Disable motor driver
+	DRIVERDISABLE();				//Disable motor driver
 }
 
 void Tmc2208::uartInit(void)
@@ -169,8 +321,10 @@ void Tmc2208::uartInit(void)
 void Tmc2208::uartSendByte(uint8_t value)
 {
 	uint8_t mask = 1;
-	
+	uint8_t sreg = SREG;
 
+	// A delayed bit corrupts the byte, so interrupts are held off for one byte (10 bits, 20us)
+	cli();
 	//Start bit
 	UARTTXPORT &= ~(1 << UARTTXPIN); UARTCLKDELAY();
 	while(mask)
@@ -185,44 +339,156 @@ void Tmc2208::uartSendByte(uint8_t value)
 
 	// Stop bit
 	UARTTXPORT |= (1 << UARTTXPIN);	UARTCLKDELAY();
-	
+	SREG = sreg;
 }
 
-bool Tmc2208::uartReceivePacket(uint8_t *packet __attribute__((unused)), uint8_t size __attribute__((unused)))
+/**
+ * @brief      Wait for the RX line of the software UART to reach a level
+ *
+ *             Must be called with interrupts disabled, and timer four running at F_CPU.
+ *
+ * @param      high  - true to wait for the line to go high, false to wait for it to go low
+ * @param      time  - Timestamp the timeout is counted from. Set to the time the level was seen
+ *
+ * @return     true if the level was seen within UARTRXTIMEOUT, false otherwise
+ */
+static bool uartWaitLevel(bool high, uint16_t *time)
 {
+	uint16_t start = *time;
+	uint16_t now;
+
+	do
+	{
+		now = UARTTIMESTAMP();
+		if((UARTRXREAD() != 0) == high)
+		{
+			*time = now;
+			return 1;
+		}
+	}
+	while((uint16_t)(now - start) < UARTRXTIMEOUTCYCLES);
+
 	return 0;
 }
 
+bool Tmc2208::uartReceivePacket(uint8_t *packet, uint8_t size)
+{
+	uint16_t edge, syncStart, bitTime, offset;
+	uint8_t mask, value;
+
+	if(size < 2)
+		return 0;
+
+	// Sync byte (0x05, LSB first): start bit, 1, 0, 1 and five low bits before the stop bit
+	edge = UARTTIMESTAMP();
+	if(!uartWaitLevel(0, &edge))
+		return 0;
+	syncStart = edge;
+	if(!uartWaitLevel(1, &edge) || !uartWaitLevel(0, &edge) || !uartWaitLevel(1, &edge) || !uartWaitLevel(0, &edge))
+		return 0;
+	packet[0] = 0x05;
+
+	// The start bit of the master address byte (0xFF) comes ten bit times after the start
+	// of the sync byte, and the line then stays high for nine bit times, leaving time to
+	// calculate the bit time (in 1/16 CPU cycles) the driver is replying with
+	if(!uartWaitLevel(1, &edge) || !uartWaitLevel(0, &edge))
+		return 0;
+	bitTime = ((uint16_t)(edge - syncStart) * 8 + 2) / 5;
+	packet[1] = 0xFF;
+
+	for(uint8_t i = 2; i < size; i++)
+	{
+		// Stop bit of the previous byte, followed by the start bit
+		if(!uartWaitLevel(1, &edge) || !uartWaitLevel(0, &edge))
+			return 0;
+
+		// Sample in the middle of each data bit
+		offset = bitTime + (bitTime >> 1) - (UARTRXLATENCY << 4);
+		value = 0;
+		for(mask = 1; mask; mask <<= 1)
+		{
+			while((int16_t)(UARTTIMESTAMP() - edge - (offset >> 4)) < 0);
+			if(UARTRXREAD())
+			{
+				value |= mask;
+			}
+			offset += bitTime;
+		}
+		packet[i] = value;
+	}
+
+	return 1;
+}
+
+bool Tmc2208::getDriverStatus(uint32_t *status)
+{
+	return this->readRegister(TMC2208_DRVSTATUS, (int32_t *)status);
+}
+
+bool Tmc2208::getTStep(uint32_t *tStep)
+{
+	int32_t value;
+
+	if(!this->readRegister(TMC2208_TSTEP, &value))
+		return 0;
+
+	*tStep = value & TMC2208_TSTEP_MASK;
+	return 1;
+}
+
+bool Tmc2208::getMicrostepCounter(uint16_t *msCnt)
+{
+	int32_t value;
+
+	if(!this->readRegister(TMC2208_MSCNT, &value))
+		return 0;
+
+	*msCnt = value & TMC2208_MSCNT_MASK;
+	return 1;
+}
+
+bool Tmc2208::getPwmScale(uint32_t *pwmScale)
+{
+	return this->readRegister(TMC2208_PWMSCALE, (int32_t *)pwmScale);
+}
+
 void Tmc2208::setCurrent(uint8_t runPercent, uint8_t holdPercent)
 {
-	this->setRunCurrent(runPercent);
-	this->setHoldCurrent(holdPercent);
+	uint8_t temp;
+
+	temp = (uint8_t)((float)runPercent * 0.31f) ;
+	this->runCurrent = temp > 31 ? 31 : temp ;
+
+	temp = (uint8_t)((float)holdPercent * 0.31f) ;
+	this->holdCurrent = temp > 31 ? 31 : temp ;
+
+	this->updateCurrent();
 }
 
 void Tmc2208::setRunCurrent(uint8_t runPercent)
 {
-	int32_t registerSetting = 0;
-
 	uint8_t temp = (uint8_t)((float)runPercent * 0.31f) ;
 	this->runCurrent = temp > 31 ? 31 : temp ;
 
-	registerSetting |= (((int32_t)(this->holdCurrent & 0x1F)) << TMC2208_IHOLD_SHIFT );
-	registerSetting |= (((int32_t)(this->runCurrent & 0x1F)) << TMC2208_IRUN_SHIFT );
-
-	this->writeRegister(TMC2208_IHOLD_IRUN, registerSetting);
+	this->updateCurrent();
 }
 
 void Tmc2208::setHoldCurrent(uint8_t holdPercent)
 {
-	int32_t registerSetting = 0;
-
  	uint8_t temp = (uint8_t)((float)holdPercent * 0.31f) ;
  	this->holdCurrent = temp > 31 ? 31 : temp ;
 
- 	registerSetting |= (((int32_t)(this->holdCurrent & 0x1F)) << TMC2208_IHOLD_SHIFT );
- 	registerSetting |= (((int32_t)(this->runCurrent & 0x1F)) << TMC2208_IRUN_SHIFT );
+	this->updateCurrent();
+}
+
+void Tmc2208::updateCurrent(void)
+{
+	int32_t registerSetting = 0;
+
+	registerSetting |= (((int32_t)(this->holdCurrent & 0x1F)) << TMC2208_IHOLD_SHIFT );
+	registerSetting |= (((int32_t)(this->runCurrent & 0x1F)) << TMC2208_IRUN_SHIFT );
 
- 	this->writeRegister(TMC2208_IHOLD_IRUN, registerSetting);
+	this->setRegister(TMC2208_SHADOW_IHOLD_IRUN, registerSetting);
 }
 
 void Tmc2208::setVelocity(float RPM)
@@ -234,7 +500,7 @@ void Tmc2208::setVelocity(float RPM)
 
 	RPM = (int32_t)(dummy + 0.5);
 
-	this->writeRegister(TMC2208_VACTUAL, RPM);
+	this->setRegister(TMC2208_SHADOW_VACTUAL, RPM, 0);
 }
 
 float Tmc2208::getRunCurrent(void)
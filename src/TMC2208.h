@@ -35,9 +35,8 @@
 
 	#include <stdlib.h>
 	#include <stdint.h>
-	#include <avr/pgmspace.h>
+	#include "uStepperHal.h"
 	#include <Arduino.h>
-	#include <util/delay.h>
 	
 	/** @name default values	 
 	*	default values for non-zero registers
@@ -76,6 +75,23 @@
 	#define TMC2208_PWMSCALE      0x71
 	#define TMC2208_PWM_AUTO      0x72
 	///@}
+
+	/** @name Shadowed registers
+	*	Index of the writable registers in the shadow register cache of the Tmc2208 class
+	*	(GSTAT and OTP_PROG are left out, as writing them has side effects)
+	*/
+	///@{
+	#define TMC2208_SHADOW_GCONF        0
+	#define TMC2208_SHADOW_SLAVECONF    1
+	#define TMC2208_SHADOW_FACTORY_CONF 2
+	#define TMC2208_SHADOW_IHOLD_IRUN   3
+	#define TMC2208_SHADOW_TPOWERDOWN   4
+	#define TMC2208_SHADOW_TPWMTHRS     5
+	#define TMC2208_SHADOW_VACTUAL      6
+	#define TMC2208_SHADOW_CHOPCONF     7
+	#define TMC2208_SHADOW_PWMCONF      8
+	#define TMC2208_SHADOWCOUNT         9
+	///@}
 	
 	/**
 	* \defgroup Bit masks and shift patterns for every bit in each register
@@ -257,14 +273,41 @@
 	#define UARTRXPORT PORTC
 	#define UARTRXDDR DDRC
 	#define UARTRXPIN 2
+	#define UARTRXPINREG PINC
+	///@}
+
+	/** Time to wait for the driver to start, or continue, the reply to a read request, in microseconds */
+	#ifndef UARTRXTIMEOUT
+		#define UARTRXTIMEOUT 100
+	#endif
+	/** Average delay in CPU cycles from an RX transition, or a due sample time, until the receiver sees it */
+	#ifndef UARTRXLATENCY
+		#define UARTRXLATENCY 8
+	#endif
+	/** UARTRXTIMEOUT in CPU cycles (timer four ticks) */
+	#define UARTRXTIMEOUTCYCLES ((uint16_t)(UARTRXTIMEOUT * (F_CPU / 1000000UL)))
+
+	/** @name software UART receiver
+	*	Level of the RX pin, and the timestamp (CPU cycles, timer four) used to time the received bits
+	*/
+	///@{
+	#ifndef USTEPPER_HOST
+		#define UARTRXREAD() (UARTRXPINREG & (1 << UARTRXPIN))
+		#define UARTTIMESTAMP() TCNT4
+	#else
+		#define UARTRXREAD() halSimUartRx(halSimCycles)
+		#define UARTTIMESTAMP() halSimTimestamp()
+	#endif
 	///@}
 
 	#define NORMALDIRECTION 0
 	#define INVERSEDIRECTION 1
 
-	// 2us delay (30 nops @ 62.5ns = 1.875us + C overhead ~ 2us) 500k baud
+	// 2us bit time (23 nops + ~9 cycles of loop overhead = 32 cycles @ 62.5ns = 2us) 500k baud,
+	// the highest baud rate of the TMC2208, leaving the receiver ~16 cycles per half bit
 	/** */
-	#define UARTCLKDELAY() 	__asm__ volatile ( 	"nop \n\t" "nop \n\t" "nop \n\t" "nop \n\t" "nop \n\t" "nop \n\t" "nop \n\t" "nop \n\t" "nop \n\t" "nop \n\t" "nop \n\t" "nop \n\t" )
+	#define UARTCLKDELAY() 	__asm__ volatile ( 	"nop \n\t" "nop \n\t" "nop \n\t" "nop \n\t" "nop \n\t" "nop \n\t" "nop \n\t" "nop \n\t" "nop \n\t" "nop \n\t" "nop \n\t" "nop \n\t" \
+													"nop \n\t" "nop \n\t" "nop \n\t" "nop \n\t" "nop \n\t" "nop \n\t" "nop \n\t" "nop \n\t" "nop \n\t" "nop \n\t" "nop \n\t" )
 
 /**
  * @brief      Prototype of class for accessing all features of the TMC2208 in
@@ -314,7 +357,7 @@ public:
 	*
 	*             This function lets the user manipulate both run and hold current settings.
 	*			  Arguments accept natural number from zero (0) to hundred (100).
-	*			  Calls setCurrent and setHoldCurrent.
+	*			  Both currents are sent in one write of IHOLD_IRUN.
 	*
 	* @param      runPercent     -	Run current in percentage of max current i.e. from 0 to 100.
 	* @param      holdPercent    -	Hold current in percentage of max current i.e. from 0 to 100.
@@ -348,6 +391,9 @@ public:
 	* @brief      Set motor velocity in RPM.
 	*
 	*             This function lets the user command a run speed in RPM for open loop speed control.
+	*			  VACTUAL is only sent if it changed, and always at once, also between holdWrites() and
+	*			  flushRegisters(), as it is used by the control loop. If the control loop interrupts
+	*			  a datagram sent from the main context, VACTUAL is sent right after that datagram.
 	*
 	* @param      RPM     -	Desired speed of the motor in RPM.
 	*
@@ -365,6 +411,84 @@ public:
 	void invertDirection(bool normal = INVERSEDIRECTION);
 	float getRunCurrent(void);
 	float getHoldCurrent(void);
+
+	/**
+	* @brief      Calculate the CRC8 used on the UART, polynomial 0x07, bits taken LSB first
+	*
+	* @param      datagram   -	Bytes to calculate the CRC of
+	* @param      len        -	Number of bytes
+	*
+	* @return     CRC8
+	*/
+	uint8_t calcCRC(uint8_t datagram[], uint8_t len);
+
+	/**
+	* @brief      Read the DRV_STATUS register (temperature, short and open load flags, actual current, standstill)
+	*
+	*             Like every register read, interrupts are disabled for about 0.25 ms while the
+	*             request is sent and the reply received. See readRegister().
+	*
+	* @param      status     -	Pointer to the variable receiving the register contents
+	*
+	* @return     true if a reply with a valid CRC was received, false otherwise (status is not changed)
+	*/
+	bool getDriverStatus(uint32_t *status);
+
+	/**
+	* @brief      Read the TSTEP register, the time between two 1/256 microsteps in units of 1/fCLK
+	*
+	* @param      tStep     -	Pointer to the variable receiving TSTEP ((2^20)-1 at standstill)
+	*
+	* @return     true if a reply with a valid CRC was received, false otherwise (tStep is not changed)
+	*/
+	bool getTStep(uint32_t *tStep);
+
+	/**
+	* @brief      Read the MSCNT register, the position in the microstep table (0 - 1023)
+	*
+	* @param      msCnt     -	Pointer to the variable receiving MSCNT
+	*
+	* @return     true if a reply with a valid CRC was received, false otherwise (msCnt is not changed)
+	*/
+	bool getMicrostepCounter(uint16_t *msCnt);
+
+	/**
+	* @brief      Read the PWM_SCALE register (PWM_SCALE_SUM and PWM_SCALE_AUTO)
+	*
+	* @param      pwmScale     -	Pointer to the variable receiving the register contents
+	*
+	* @return     true if a reply with a valid CRC was received, false otherwise (pwmScale is not changed)
+	*/
+	bool getPwmScale(uint32_t *pwmScale);
+
+	/**
+	* @brief      Hold back register writes until flushRegisters() is called
+	*
+	*             Every register is kept in a shadow copy, and only sent to the driver when its
+	*             value changes. While writes are held, changed registers are only marked dirty,
+	*             so e.g. a current and a direction change are sent as one batch, with each
+	*             register sent at most once. setVelocity() is not held.
+	*/
+	void holdWrites(void);
+
+	/**
+	* @brief      Send every dirty register to the driver, end holdWrites(), and verify the writes
+	*
+	* @return     true if the writes were verified with verifyWrites(), false otherwise
+	*/
+	bool flushRegisters(void);
+
+	/**
+	* @brief      Check that every write since the last check landed, using the IFCNT register
+	*
+	*             IFCNT counts the write datagrams received by the driver. If it does not match
+	*             the number of datagrams sent, every shadowed register is marked dirty, so the next
+	*             flushRegisters() (or the next change) sends them again. The first check after
+	*             setup() only synchronises the count, unless setup() could read IFCNT.
+	*
+	* @return     true if IFCNT matched, false if it did not or could not be read
+	*/
+	bool verifyWrites(void);
 protected:
 	/** This variable holds the commanded run current
 	*/	
@@ -374,12 +498,100 @@ protected:
 	*/	
 	uint8_t holdCurrent;
 
+	/** Shadow copy of the writable registers, indexed by TMC2208_SHADOW_GCONF ... */
+	int32_t shadowRegister[TMC2208_SHADOWCOUNT];
+
+	/** Bit n set once shadowRegister[n] has been set. Registers never set are never sent */
+	uint16_t shadowValid;
+
+	/** Bit n set if shadowRegister[n] has not been sent to the driver since it changed */
+	volatile uint16_t shadowDirty;
+
+	/** Set while flushRegister() sends a datagram. A flush finding it set leaves the register dirty */
+	volatile bool uartBusy;
+
+	/** Set while writes are held by holdWrites() */
+	bool writesHeld;
+
+	/** Expected value of IFCNT, incremented on every write datagram */
+	volatile uint8_t ifcntExpected;
+
+	/** Set when ifcntExpected has been synchronised with the driver */
+	bool ifcntValid;
+
+	/**
+	* @brief      Change a shadowed register, and send it unless writes are held or it did not change
+	*
+	* @param      index     -	Shadowed register (TMC2208_SHADOW_GCONF ...)
+	* @param      value     -	New value of the register
+	* @param      hold      -	true to only mark the register dirty if writes are held
+	*/
+	void setRegister(uint8_t index, int32_t value, bool hold = true);
+
+	/**
+	* @brief      Send a shadowed register to the driver if it is dirty
+	*
+	*             The UART is claimed with uartBusy while the datagram is sent. If it is already
+	*             claimed (a flush from encoderSampleReady() interrupting one from the main context),
+	*             the register is left dirty. VACTUAL left dirty this way is sent when the
+	*             interrupted datagram is done.
+	*
+	* @param      index     -	Shadowed register (TMC2208_SHADOW_GCONF ...)
+	*/
+	void flushRegister(uint8_t index);
+
+	/**
+	* @brief      Send IHOLD_IRUN with the commanded run and hold current
+	*/
+	void updateCurrent(void);
+
+	/**
+	* @brief      Write a register of the driver
+	*
+	*             Only called by flushRegister(), with the UART claimed. The encoder interrupt is
+	*             masked while the datagram is sent, and every other interrupt only while a byte is
+	*             on the line.
+	*
+	* @param      address   -	Register address
+	* @param      value     -	Value to write
+	*/
 	void writeRegister(uint8_t address, int32_t value);
-	void readRegister(uint8_t address, int32_t *value);
-	uint8_t calcCRC(uint8_t datagram[], uint8_t len);
+
+	/**
+	* @brief      Read a register of the driver
+	*
+	*             Interrupts are disabled while the request is sent and the reply is received
+	*             (12 bytes plus SENDDELAY, about 0.25 ms), and timer four is used to time the
+	*             received bits. The reply is checked for sync byte, address and CRC.
+	*
+	* @param      address   -	Register address
+	* @param      value     -	Pointer to the variable receiving the register contents
+	*
+	* @return     true if a valid reply was received, false otherwise (value is not changed)
+	*/
+	bool readRegister(uint8_t address, int32_t *value);
 	void uartInit(void);
+
+	/**
+	* @brief      Send a byte on the software UART, with interrupts disabled for the 10 bits (20 us)
+	*
+	* @param      value     -	Byte to send
+	*/
 	void uartSendByte(uint8_t value);
-	bool uartReceivePacket(uint8_t *packet __attribute__((unused)), uint8_t size __attribute__((unused)));
+
+	/**
+	* @brief      Receive a reply from the driver on the software UART
+	*
+	*             The bit time is measured on the sync byte (0x05) of the reply, and every
+	*             following byte is resynchronised on its start bit and sampled in the middle
+	*             of each bit. Must be called with interrupts disabled and timer four running at F_CPU.
+	*
+	* @param      packet    -	Buffer receiving the reply, starting with the sync byte
+	* @param      size      -	Number of bytes to receive
+	*
+	* @return     true if all bytes were received, false on timeout
+	*/
+	bool uartReceivePacket(uint8_t *packet, uint8_t size);
 		
 };
 
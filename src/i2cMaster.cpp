@@ -35,14 +35,27 @@
 
 #include "i2cMaster.h"
 #include "Arduino.h"
-#include <util/delay.h>
+
+/** Object running the current asynchronous transaction on I2C1 */
+static i2cMaster *asyncMaster = NULL;
+
+extern "C" {
+	void TWI1_vect(void)
+	{
+		if(asyncMaster != NULL && asyncMaster->asyncActive)
+		{
+			asyncMaster->asyncHandler();
+		}
+	}
+}
+
 bool i2cMaster::cmd(uint8_t cmd)
 {
 	uint16_t i = 0;
 	// send command
-	_SFR_MEM8(this->twcr) = cmd;
+	HALREGWRITE(this->twcr, cmd);
 	// wait for command to complete
-	while (!(_SFR_MEM8(this->twcr) & (1 << TWINT1)))
+	while (!(HALREGREAD(this->twcr) & (1 << TWINT1)))
 	{
 		i++;
 		if(i == 3000)
@@ -53,31 +66,53 @@ bool i2cMaster::cmd(uint8_t cmd)
 	}
 	
 	// save status bits
-	status = _SFR_MEM8(this->twsr) & 0xF8;	
+	status = HALREGREAD(this->twsr) & 0xF8;	
 
 	return true;
 }
 
-bool i2cMaster::read(uint8_t slaveAddr, uint8_t regAddr, uint8_t numOfBytes, uint8_t *data)
+bool i2cMaster::read(uint8_t slaveAddr, uint8_t regAddr, uint8_t numOfBytes, uint8_t *data, bool sticky)
 {
 	uint8_t i;
+	uint8_t count = 0;
 
-	if(this->start(slaveAddr, WRITE) == false)
+	if(sticky && slaveAddr == this->stickySlaveAddr && regAddr == this->stickyRegAddr)
 	{
-		this->stop();
-		return false;
+		count = this->stickyCount;
 	}
 
-	if(this->writeByte(regAddr) == false)
+	if(count)
 	{
-		this->stop();
-		return false;
-	}
+		// the device still points at regAddr, read the data bytes directly
+		count--;
 
-	if(this->restart(slaveAddr, READ) == false)
+		if(this->start(slaveAddr, READ) == false)
+		{
+			this->stop();
+			return false;
+		}
+	}
+	else
 	{
-		this->stop();
-		return false;
+		count = I2CSTICKYREFRESH;
+
+		if(this->start(slaveAddr, WRITE) == false)
+		{
+			this->stop();
+			return false;
+		}
+
+		if(this->writeByte(regAddr) == false)
+		{
+			this->stop();
+			return false;
+		}
+
+		if(this->restart(slaveAddr, READ) == false)
+		{
+			this->stop();
+			return false;
+		}
 	}
 
 	for(i = 0; i < (numOfBytes - 1); i++)
@@ -96,10 +131,194 @@ bool i2cMaster::read(uint8_t slaveAddr, uint8_t regAddr, uint8_t numOfBytes, uin
 	}
 
 	this->stop();
+
+	if(sticky)
+	{
+		this->stickySlaveAddr = slaveAddr;
+		this->stickyRegAddr = regAddr;
+		this->stickyCount = count;
+	}
 	
 	return 1; 
 }
 
+bool i2cMaster::readAsync(uint8_t slaveAddr, uint8_t regAddr, uint8_t numOfBytes, uint8_t *data, i2cCallback_t callback, bool sticky)
+{
+	uint8_t sreg;
+
+	if(numOfBytes == 0 || this->twcr != 0xDC)
+	{
+		return false;
+	}
+
+	sreg = SREG;
+	cli();
+	if(this->status != I2CFREE || this->asyncActive)
+	{
+		SREG = sreg;
+		return false;
+	}
+	this->status = I2CBUSY;
+	this->asyncActive = true;
+	SREG = sreg;
+
+	this->asyncSlaveAddr = slaveAddr;
+	this->asyncRegAddr = regAddr;
+	this->asyncLength = numOfBytes;
+	this->asyncIndex = 0;
+	this->asyncData = data;
+	this->asyncCallback = callback;
+	this->asyncSkipRegister = false;
+	this->asyncStickyCount = 0;
+
+	if(sticky)
+	{
+		this->asyncStickyCount = I2CSTICKYREFRESH;
+
+		if(slaveAddr == this->stickySlaveAddr && regAddr == this->stickyRegAddr && this->stickyCount)
+		{
+			this->asyncSkipRegister = true;
+			this->asyncStickyCount = this->stickyCount - 1;
+		}
+	}
+
+	// the register pointer of the device is unknown until the transaction has finished
+	if(slaveAddr == this->stickySlaveAddr)
+	{
+		this->stickyCount = 0;
+	}
+	asyncMaster = this;
+
+	// send START condition, the rest is handled by the TWI interrupt
+	HALREGWRITE(this->twcr, I2CASYNCCMD | (1 << TWSTA1));
+
+	return true;
+}
+
+void i2cMaster::asyncHandler(void)
+{
+	bool success = false;
+
+	this->status = HALREGREAD(this->twsr) & 0xF8;
+
+	switch(this->status)
+	{
+		case START:
+			if(this->asyncSkipRegister)
+			{
+				// the device still points at the register, read the data bytes directly
+				HALREGWRITE(this->twdr, (this->asyncSlaveAddr << 1) | READ);
+			}
+			else
+			{
+				HALREGWRITE(this->twdr, (this->asyncSlaveAddr << 1) | WRITE);
+			}
+			HALREGWRITE(this->twcr, I2CASYNCCMD);
+			return;
+
+		case TXADDRACK:
+			HALREGWRITE(this->twdr, this->asyncRegAddr);
+			HALREGWRITE(this->twcr, I2CASYNCCMD);
+			return;
+
+		case TXDATAACK:
+			// register address sent, send repeated start to begin reading
+			HALREGWRITE(this->twcr, I2CASYNCCMD | (1 << TWSTA1));
+			return;
+
+		case REPSTART:
+			HALREGWRITE(this->twdr, (this->asyncSlaveAddr << 1) | READ);
+			HALREGWRITE(this->twcr, I2CASYNCCMD);
+			return;
+
+		case RXDATAACK:
+			// Store the byte, then request the next one as after the address
+			this->asyncData[this->asyncIndex++] = HALREGREAD(this->twdr);
+			// fall through
+		case RXADDRACK:
+			if(this->asyncIndex < (this->asyncLength - 1))
+			{
+				HALREGWRITE(this->twcr, I2CASYNCCMD | (1 << TWEA1));
+			}
+			else
+			{
+				HALREGWRITE(this->twcr, I2CASYNCCMD);	// NACK the last byte
+			}
+			return;
+
+		case RXDATANACK:
+			this->asyncData[this->asyncIndex] = HALREGREAD(this->twdr);
+			success = true;
+			break;
+
+		default:	// no ACK from the device, or bus error
+			break;
+	}
+
+	if(success && this->asyncStickyCount)
+	{
+		this->stickySlaveAddr = this->asyncSlaveAddr;
+		this->stickyRegAddr = this->asyncRegAddr;
+		this->stickyCount = this->asyncStickyCount;
+	}
+
+	// issue stop condition, with the TWI interrupt disabled
+	HALREGWRITE(this->twcr, (1 << TWINT1) | (1 << TWEN1) | (1 << TWSTO1));
+
+	this->status = I2CFREE;
+	this->asyncActive = false;
+
+	if(this->asyncCallback != NULL)
+	{
+		this->asyncCallback(success);
+	}
+}
+
+bool i2cMaster::asyncBusy(void)
+{
+	return this->asyncActive;
+}
+
+void i2cMaster::claim(void)
+{
+	uint16_t i = 0;
+	uint8_t sreg;
+
+	while(1)
+	{
+		sreg = SREG;
+		cli();
+
+		if(!this->asyncActive)
+		{
+			break;
+		}
+
+		// the TWI interrupt can not run, or the transaction is stuck. Abort it
+		if(!(sreg & (1 << SREG_I)) || i == 3000)
+		{
+			HALREGWRITE(this->twcr, (1 << TWINT1) | (1 << TWEN1) | (1 << TWSTO1));
+			this->asyncActive = false;
+			break;
+		}
+
+		SREG = sreg;
+		i++;
+		_delay_us(1);
+	}
+
+	this->status = I2CBUSY;
+	SREG = sreg;
+
+	// wait for the stop condition of the previous transaction to be executed
+	i = 0;
+	while ((HALREGREAD(this->twcr) & (1 << TWSTO1)) && i < 1000)
+	{
+		i++;
+		_delay_us(1);
+	}
+}
+
 bool i2cMaster::write(uint8_t slaveAddr, uint8_t regAddr, uint8_t numOfBytes, uint8_t *data)
 {
 	uint8_t i = 0;	
@@ -144,13 +363,24 @@ bool i2cMaster::readByte(bool ack, uint8_t *data)
 		}
 	}
 
-	*data = _SFR_MEM8(this->twdr);
+	*data = HALREGREAD(this->twdr);
 
 	return true;
 }
 
 bool i2cMaster::start(uint8_t addr, bool RW)
 {
+	if(this->status == I2CFREE || this->asyncActive)
+	{
+		this->claim();
+	}
+
+	// the register pointer of the device is unknown after this transaction, unless set by a sticky read
+	if(addr == this->stickySlaveAddr)
+	{
+		this->stickyCount = 0;
+	}
+
 	// send START condition
 	this->cmd((1<<TWINT1) | (1<<TWSTA1) | (1<<TWEN1) | (1 << TWEA1));
 
@@ -160,7 +390,7 @@ bool i2cMaster::start(uint8_t addr, bool RW)
 	}
 
 	// send device address and direction
-	_SFR_MEM8(this->twdr) = (addr << 1) | RW;
+	HALREGWRITE(this->twdr, (addr << 1) | RW);
 	this->cmd((1 << TWINT1) | (1 << TWEN1) | (1 << TWEA1));
 	
 	if (RW == READ) 
@@ -182,7 +412,7 @@ bool i2cMaster::restart(uint8_t addr, bool RW)
 
 bool i2cMaster::writeByte(uint8_t data)
 {
-	_SFR_MEM8(this->twdr) = data;
+	HALREGWRITE(this->twdr, data);
 
 	this->cmd((1 << TWINT1) | (1 << TWEN1) | (1 << TWEA1));
 
@@ -193,11 +423,11 @@ bool i2cMaster::stop(void)
 {
 	uint16_t i = 0;
 	//	issue stop condition
-	_SFR_MEM8(this->twcr) = (1 << TWINT1) | (1 << TWEN1) | (1 << TWSTO1);
+	HALREGWRITE(this->twcr, (1 << TWINT1) | (1 << TWEN1) | (1 << TWSTO1));
 
 
 	// wait until stop condition is executed and bus released
-	while (_SFR_MEM8(this->twcr) & (1 << TWSTO1))
+	while (HALREGREAD(this->twcr) & (1 << TWSTO1))
 	{
 		i++;
 		if(i == 1000)
@@ -221,9 +451,9 @@ uint8_t i2cMaster::getStatus(void)
 void i2cMaster::begin(void)
 {
 	// set bit rate register to 12 to obtain 400kHz scl frequency (in combination with no prescaling!)
-	_SFR_MEM8(this->twbr) = 1;
+	HALREGWRITE(this->twbr, 1);
 	// no prescaler
-	_SFR_MEM8(this->twsr) &= 0xFC;
+	HALREGWRITE(this->twsr, HALREGREAD(this->twsr) & 0xFC);
 }
 
 void i2cMaster::begin(bool channel)
@@ -243,7 +473,7 @@ void i2cMaster::begin(bool channel)
 		this->twcr = 0xBC;	
 	}
 	// set bit rate register to 12 to obtain 400kHz scl frequency (in combination with no prescaling!)
-	_SFR_MEM8(this->twbr) = 1;
+	HALREGWRITE(this->twbr, 1);
 	
 }
 
@@ -255,6 +485,11 @@ void* i2cMaster::operator new(size_t size)
 
 i2cMaster::i2cMaster(bool channel)
 {
+	this->status = I2CFREE;
+	this->asyncActive = false;
+	this->asyncCallback = NULL;
+	this->stickyCount = 0;
+
 	if(channel)
 	{
 		this->twsr = 0xD9;
@@ -273,5 +508,8 @@ i2cMaster::i2cMaster(bool channel)
 
 i2cMaster::i2cMaster(void)
 {
-	
+	this->status = I2CFREE;
+	this->asyncActive = false;
+	this->asyncCallback = NULL;
+	this->stickyCount = 0;
 }
\ No newline at end of file
@@ -36,12 +36,15 @@
 #define _I2CMASTER_H_
 
 #include <inttypes.h>
-#include <avr/io.h>
+#include "uStepperHal.h"
 #include <stdlib.h>
 
 /** I2C bus is not currently in use */
 #define I2CFREE 0						
 
+/** I2C bus is claimed by a transaction that has not yet set a bus status */
+#define I2CBUSY 1
+
 /** Value for RW bit in address field, to request a read */
 #define READ  1							
 
@@ -63,12 +66,44 @@
 /** slave address plus read bit transmitted, ACK received */
 #define RXADDRACK 0x40				
 
+/** data byte received, ACK returned */
+#define RXDATAACK 0x50
+
+/** data byte received, NACK returned */
+#define RXDATANACK 0x58
+
 /** value to indicate ACK for i2c transmission */
 #define ACK 1							
 
 /** value to indicate NACK for i2c transmission */
 #define NACK 0							
 
+/** TWCR value used to continue an asynchronous transaction, with the TWI interrupt enabled */
+#define I2CASYNCCMD ((1 << TWINT1) | (1 << TWEN1) | (1 << TWIE1))
+
+/**
+ * Maximum number of sticky reads in a row, without sending the register
+ * address. After this number of reads, the register address is sent again,
+ * so a device that has lost its register pointer (e.g. after a brown out)
+ * returns the right register again within a limited time
+ */
+#ifndef I2CSTICKYREFRESH
+#define I2CSTICKYREFRESH 250
+#endif
+
+/**
+ * @brief      Completion callback of an asynchronous transaction
+ *
+ *             Called from the TWI interrupt routine when an asynchronous
+ *             transaction started by i2cMaster::readAsync() is finished.
+ *
+ * @param      success  - true if all bytes were received, false if the
+ *                      transaction failed (no ACK, bus error) or was aborted
+ */
+typedef void (*i2cCallback_t)(bool success);
+
+extern "C" void TWI1_vect(void) HALISR;
+
 /**
  * @brief      Prototype of class for accessing the TWI (I2C) interface of the
  *             AVR (master mode only).
@@ -110,6 +145,72 @@ class i2cMaster
 		volatile uint8_t twbr;
 		volatile uint8_t twdr;
 		volatile uint8_t twcr;
+
+		/** Set while an asynchronous transaction is in progress */
+		volatile bool asyncActive;
+
+		/** 7 bit address of the device read by the asynchronous transaction */
+		uint8_t asyncSlaveAddr;
+
+		/** Register address read by the asynchronous transaction */
+		uint8_t asyncRegAddr;
+
+		/** Number of bytes to read in the asynchronous transaction */
+		uint8_t asyncLength;
+
+		/** Index of the next byte to receive in the asynchronous transaction */
+		uint8_t asyncIndex;
+
+		/** Buffer receiving the bytes of the asynchronous transaction */
+		uint8_t *asyncData;
+
+		/** Function called when the asynchronous transaction finishes */
+		i2cCallback_t asyncCallback;
+
+		/** Value of stickyCount after the asynchronous transaction succeeds. 0 if it is not a sticky read */
+		uint8_t asyncStickyCount;
+
+		/** Set if the asynchronous transaction reads without sending the register address */
+		bool asyncSkipRegister;
+
+		/** 7 bit address of the device left pointing at stickyRegAddr by the last sticky read */
+		uint8_t stickySlaveAddr;
+
+		/** Register address the device at stickySlaveAddr is pointing at */
+		uint8_t stickyRegAddr;
+
+		/**
+		 * Number of sticky reads of stickyRegAddr left, before the register
+		 * address has to be sent again. 0 if the register pointer is unknown,
+		 * i.e. before the first sticky read and after any other transaction
+		 * with the device
+		 */
+		uint8_t stickyCount;
+
+		/**
+		 * @brief      Advances the asynchronous transaction.
+		 *
+		 *             This function is called from the TWI interrupt routine,
+		 *             every time the TWI hardware has finished a bus operation.
+		 *             It issues the next operation of the transaction based on
+		 *             the status register, and ends the transaction with a stop
+		 *             condition and a call to the completion callback.
+		 */
+		void asyncHandler(void);
+
+		/**
+		 * @brief      Claims the bus for a blocking transaction.
+		 *
+		 *             Waits for an ongoing asynchronous transaction to finish,
+		 *             and marks the bus as busy, so the encoder interrupt will
+		 *             not start a new asynchronous transaction in the middle of
+		 *             the blocking one. If the asynchronous transaction can not
+		 *             finish (interrupts disabled or timeout) it is aborted and
+		 *             its callback is not called.
+		 */
+		void claim(void);
+
+		friend void TWI1_vect(void) HALISR;
 		
 	public:
 
@@ -173,11 +274,57 @@ class i2cMaster
 		 *                         bytes read. Make sure enough space are
 		 *                         allocated before calling this function !
 		 *
+		 * @param      sticky      -	Set to true if the device keeps its register
+		 *                         pointer at regAddr after the read (e.g. the
+		 *                         ANGLE register of the AS5600). The register
+		 *                         address is then only sent on the first read,
+		 *                         and again if another transaction has been made
+		 *                         with the device in between, or after
+		 *                         I2CSTICKYREFRESH reads. Other reads are a
+		 *                         plain read of the data bytes.
+		 *
 		 * @return     1			-	Currently always returns this value. In the future
 		 *             this value will be used to indicate successful
 		 *             transactions.
 		 */		
-		bool read(uint8_t slaveAddr, uint8_t regAddr, uint8_t numOfBytes, uint8_t *data);
+		bool read(uint8_t slaveAddr, uint8_t regAddr, uint8_t numOfBytes, uint8_t *data, bool sticky = false);
+
+		/**
+		 * @brief      Starts an interrupt driven read transaction
+		 *
+		 *             This function starts the same transaction as "read()",
+		 *             but returns immediately. The transaction is carried out
+		 *             by the TWI interrupt routine, and "callback" is called
+		 *             from the interrupt routine once the bytes have been
+		 *             received. Only the I2C1 channel is supported, since this
+		 *             is the only channel with an interrupt routine in this
+		 *             library. The blocking functions can still be used, and
+		 *             will wait for an ongoing asynchronous transaction to
+		 *             finish.
+		 *
+		 * @param      slaveAddr   -	7 bit address of the device to read from
+		 * @param      regAddr     -	8 bit address of the register to read from
+		 * @param      numOfBytes  -	Number of bytes to read from the device
+		 * @param      data        -	Address of the array to store the bytes
+		 *                         read. Must stay valid until the callback is
+		 *                         called !
+		 * @param      callback    -	Function to call when the transaction is
+		 *                         finished. Called from interrupt context.
+		 * @param      sticky      -	Skip the register address if the device
+		 *                         still points at regAddr, as in "read()"
+		 *
+		 * @return     1			-	Transaction started
+		 * @return     0			-	Bus busy or I2C0 channel, nothing started
+		 */
+		bool readAsync(uint8_t slaveAddr, uint8_t regAddr, uint8_t numOfBytes, uint8_t *data, i2cCallback_t callback, bool sticky = false);
+
+		/**
+		 * @brief      Check for an ongoing asynchronous transaction
+		 *
+		 * @return     1			-	An asynchronous transaction is in progress
+		 * @return     0			-	No asynchronous transaction in progress
+		 */
+		bool asyncBusy(void);
 
 		/**
 		 * @brief      sets up connection between arduino and I2C device.
@@ -0,0 +1,96 @@
+/********************************************************************************************
+*       File:       uStepperHal.cpp                                                         *
+*       Version:    1.0.0                                                                   *
+*       Date:       October 17th, 2026                                                      *
+*       Author:     agent                                                                   *
+*                                                                                           *
+*********************************************************************************************
+*                       Hardware abstraction layer                                          *
+*                                                                                           *
+*   This file contains the host simulation backend of the hardware abstraction layer.      *
+*   When compiled for the ATmega328PB this file is empty.                                   *
+*                                                                                           *
+*********************************************************************************************
+*   The code contained in this file is released under the following open source license:    *
+*                                                                                           *
+*           Creative Commons Attribution-NonCommercial-ShareAlike 4.0 International         *
+*                                                                                           *
+*   The code in this file is provided without warranty of any kind - use at own risk!       *
+*   neither uStepper ApS nor the author, can be held responsible for any damage             *
+*   caused by the use of the code contained in this file !                                  *
+*                                                                                           *
+********************************************************************************************/
+/** @file uStepperHal.cpp
+ * @brief      Host simulation backend of the hardware abstraction layer
+ *
+ * @author     Thomas Hørring Olsen (thomas@ustepper.com)
+ */
+
+#include "uStepperHal.h"
+
+#ifdef USTEPPER_HOST
+
+volatile uint8_t PORTB, PORTC, PORTD;
+volatile uint8_t PINB, PINC, PIND;
+volatile uint8_t DDRB, DDRC, DDRD;
+volatile uint8_t TCCR1A, TCCR1B, TIMSK1, TIFR1;
+volatile uint8_t TCCR3A, TCCR3B, TIMSK3, TIFR3;
+volatile uint16_t TCNT1, ICR1, OCR1A, OCR1B;
+volatile uint16_t TCNT3, ICR3, OCR3A;
+volatile uint8_t TCCR4A, TCCR4B;
+volatile uint16_t TCNT4;
+volatile uint8_t EICRA, EIMSK, EIFR;
+volatile uint8_t SREG;
+
+volatile uint32_t halSimMicros = 0;
+volatile int32_t halSimDriverSteps = 0;
+
+static uint8_t halSimMem[256];
+
+static uint8_t halSimMemRead(uint8_t addr)
+{
+	return halSimMem[addr];
+}
+
+static void halSimMemWrite(uint8_t addr, uint8_t value)
+{
+	halSimMem[addr] = value;
+}
+
+volatile uint32_t halSimCycles = 0;
+
+static uint8_t halSimUartIdle(uint32_t cycle __attribute__((unused)))
+{
+	return 1;
+}
+
+uint8_t (*halSimUartRx)(uint32_t cycle) = halSimUartIdle;
+
+uint8_t (*halSimRegRead)(uint8_t addr) = halSimMemRead;
+void (*halSimRegWrite)(uint8_t addr, uint8_t value) = halSimMemWrite;
+
+void halSimStep(void)
+{
+	STEPPORT |= (1 << STEPPIN);
+	if(DIRPORT & (1 << DIRPIN))
+	{
+		halSimDriverSteps++;
+	}
+	else
+	{
+		halSimDriverSteps--;
+	}
+}
+
+uint16_t halSimTimestamp(void)
+{
+	halSimCycles += 8;		//Roughly the cost of one polling loop iteration on the AVR
+	return (uint16_t)halSimCycles;
+}
+
+void halSimDelay(uint32_t us)
+{
+	halSimMicros += us;
+}
+
+#endif
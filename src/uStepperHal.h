@@ -0,0 +1,221 @@
+/********************************************************************************************
+*       File:       uStepperHal.h                                                           *
+*       Version:    1.0.0                                                                   *
+*       Date:       October 17th, 2026                                                      *
+*       Author:     agent                                                                   *
+*                                                                                           *
+*********************************************************************************************
+*   The code contained in this file is released under the following open source license:    *
+*                                                                                           *
+*           Creative Commons Attribution-NonCommercial-ShareAlike 4.0 International         *
+*                                                                                           *
+*   The code in this file is provided without warranty of any kind - use at own risk!       *
+*   neither uStepper ApS nor the author, can be held responsible for any damage             *
+*   caused by the use of the code contained in this file !                                  *
+*                                                                                           *
+********************************************************************************************/
+/** @file uStepperHal.h
+ * @brief      Hardware abstraction layer for the uStepper S-lite library
+ *
+ *             This file maps the GPIO pins, timers, TWI registers and delays used
+ *             by the library onto either the ATmega328PB (default) or a host
+ *             simulation backend.
+ *
+ *             The host backend is selected by defining USTEPPER_HOST when
+ *             compiling the library for a PC (e.g. -DUSTEPPER_HOST). In that case
+ *             every AVR register used by the library becomes a plain variable,
+ *             interrupts and delays are simulated, and the interrupt routines
+ *             (TIMER1_COMPA_vect, TIMER3_COMPA_vect, INT0_vect ...) can be called
+ *             directly by a test harness to step the simulated clock. Serial,
+ *             EEPROM and the rest of the Arduino API come from the Arduino core
+ *             stubs in extras/host/stubs, and extras/host/hostSim.cpp simulates
+ *             the board (see extras/host/Makefile).
+ *
+ * @author     Thomas Hørring Olsen (thomas@ustepper.com)
+ */
+
+#ifndef _USTEPPER_HAL_H_
+#define _USTEPPER_HAL_H_
+
+#include <inttypes.h>
+
+#ifndef USTEPPER_HOST
+
+	#include <avr/io.h>
+	#include <avr/interrupt.h>
+	#include <avr/pgmspace.h>
+	#include <util/delay.h>
+
+	/** Attributes for C interrupt routines */
+	#define HALISR __attribute__ ((signal,used))
+	/** Attributes for interrupt routines written in assembler */
+	#define HALNAKEDISR __attribute__ ((signal,used,naked))
+
+	/** Read an 8 bit memory mapped register by address */
+	#define HALREGREAD(addr) _SFR_MEM8(addr)
+	/** Write an 8 bit memory mapped register by address */
+	#define HALREGWRITE(addr, value) (_SFR_MEM8(addr) = (value))
+
+#else
+
+	#include <stdint.h>
+	#include <string.h>
+
+	#ifndef F_CPU
+		#define F_CPU 16000000UL
+	#endif
+
+	/** @name Simulated AVR registers
+	 *	Storage for every AVR register used by the library, when compiled for the host
+	 */
+	///@{
+	extern volatile uint8_t PORTB, PORTC, PORTD;
+	extern volatile uint8_t PINB, PINC, PIND;
+	extern volatile uint8_t DDRB, DDRC, DDRD;
+	extern volatile uint8_t TCCR1A, TCCR1B, TIMSK1, TIFR1;
+	extern volatile uint8_t TCCR3A, TCCR3B, TIMSK3, TIFR3;
+	extern volatile uint16_t TCNT1, ICR1, OCR1A, OCR1B;
+	extern volatile uint16_t TCNT3, ICR3, OCR3A;
+	extern volatile uint8_t TCCR4A, TCCR4B;
+	extern volatile uint16_t TCNT4;
+	extern volatile uint8_t EICRA, EIMSK, EIFR;
+	extern volatile uint8_t SREG;
+	///@}
+
+	/** Simulated time in microseconds, advanced by delays */
+	extern volatile uint32_t halSimMicros;
+
+	/**
+	 * @brief      Hook for memory mapped register reads (TWI), can be replaced by a test harness
+	 */
+	extern uint8_t (*halSimRegRead)(uint8_t addr);
+
+	/**
+	 * @brief      Hook for memory mapped register writes (TWI), can be replaced by a test harness
+	 */
+	extern void (*halSimRegWrite)(uint8_t addr, uint8_t value);
+
+	/** Simulated CPU cycle counter, advanced by halSimTimestamp() */
+	extern volatile uint32_t halSimCycles;
+
+	/**
+	 * @brief      Hook returning the level of the driver UART RX line at a given cycle, can be replaced by a test harness
+	 */
+	extern uint8_t (*halSimUartRx)(uint32_t cycle);
+
+	/**
+	 * @brief      Timestamp in CPU cycles (timer four), advancing the simulated cycle counter on every call
+	 */
+	uint16_t halSimTimestamp(void);
+
+	/** Position of the simulated driver in steps, updated on every step pulse */
+	extern volatile int32_t halSimDriverSteps;
+
+	/**
+	 * @brief      Register a step pulse on the simulated driver
+	 */
+	void halSimStep(void);
+
+	/**
+	 * @brief      Advance the simulated clock
+	 *
+	 * @param      us    - Number of microseconds to advance
+	 */
+	void halSimDelay(uint32_t us);
+
+	/** @name Register bits used by the library */
+	///@{
+	#define CS10 0
+	#define CS11 1
+	#define CS12 2
+	#define WGM10 0
+	#define WGM11 1
+	#define WGM12 3
+	#define WGM13 4
+	#define OCIE1A 1
+	#define OCIE1B 2
+	#define OCF1A 1
+	#define CS30 0
+	#define CS31 1
+	#define CS32 2
+	#define WGM30 0
+	#define WGM31 1
+	#define WGM32 3
+	#define WGM33 4
+	#define OCIE3A 1
+	#define OCF3A 1
+	#define CS40 0
+	#define INTF0 0
+	#define TWIE1 0
+	#define TWEN1 2
+	#define TWWC1 3
+	#define TWSTO1 4
+	#define TWSTA1 5
+	#define TWEA1 6
+	#define TWINT1 7
+	#define SREG_I 7
+	///@}
+
+	#define HALISR __attribute__ ((used))
+	#define HALNAKEDISR __attribute__ ((used))
+
+	#define HALREGREAD(addr) halSimRegRead(addr)
+	#define HALREGWRITE(addr, value) halSimRegWrite((addr), (value))
+
+	#define cli() (SREG &= ~(1 << SREG_I))
+	#define sei() (SREG |= (1 << SREG_I))
+	#define _delay_us(us) halSimDelay((uint32_t)(us))
+	#define _delay_ms(ms) halSimDelay((uint32_t)(ms) * 1000UL)
+
+	#ifndef PROGMEM
+		#define PROGMEM
+		#define pgm_read_byte(addr) (*(const uint8_t *)(addr))
+		#define pgm_read_word(addr) (*(const uint16_t *)(addr))
+		#define pgm_read_dword(addr) (*(const uint32_t *)(addr))
+		#define pgm_read_ptr(addr) (*(const void * const *)(addr))
+	#endif
+
+#endif
+
+/** @name Board pin mapping
+ *	Pins used by the library on the uStepper S-lite board
+ */
+///@{
+#define STEPPORT PORTD
+#define STEPDDR DDRD
+#define STEPPIN 7
+#define DIRPORT PORTB
+#define DIRDDR DDRB
+#define DIRPIN 2
+#define ENABLEPORT PORTD
+#define ENABLEDDR DDRD
+#define ENABLEPIN 4
+///@}
+
+/** @name GPIO helpers */
+///@{
+#ifndef USTEPPER_HOST
+#define STEPPINHIGH() (STEPPORT |= (1 << STEPPIN))
+#else
+#define STEPPINHIGH() halSimStep()
+#endif
+#define STEPPINLOW() (STEPPORT &= ~(1 << STEPPIN))
+#define DIRPINCW() (DIRPORT |= (1 << DIRPIN))
+#define DIRPINCCW() (DIRPORT &= ~(1 << DIRPIN))
+#define DRIVERENABLE() (ENABLEPORT &= ~(1 << ENABLEPIN))
+#define DRIVERDISABLE() (ENABLEPORT |= (1 << ENABLEPIN))
+///@}
+
+/** @name Timer helpers */
+///@{
+/** Start timer three, running the step generator. STEPTIMERCLOCKSELECT is set by the step engine configuration */
+#define STEPTIMERSTART() (TCCR3B |= STEPTIMERCLOCKSELECT)
+/** Stop timer three, halting the step generator */
+#define STEPTIMERSTOP() (TCCR3B &= ~STEPTIMERCLOCKSELECT)
+/** Unmask the encoder sampling interrupt (timer one) */
+#define ENCODERINTENABLE() (TIMSK1 |= (1 << OCIE1A))
+/** Mask the encoder sampling interrupt (timer one) */
+#define ENCODERINTDISABLE() (TIMSK1 &= ~(1 << OCIE1A))
+///@}
+
+#endif
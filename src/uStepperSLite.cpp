@@ -73,1174 +73,2926 @@
 uStepperSLite *pointer;
 volatile int32_t *p __attribute__((used));
 i2cMaster I2C(1);
-extern "C" {
 
-void INT0_vect(void)
+/**
+ * @brief      Multiply a signed fixed point value by an unsigned 16 bit gain
+ *
+ *             Computes (a * k) / 2^shift, rounded to nearest, using two 16x16 bit
+ *             hardware multiplications instead of a full 32x32 bit multiplication.
+ *             Truncating would bias the speed filters, which integrate the products.
+ *             |a| must be below 2^30 and shift must be 16 or larger.
+ */
+static inline int32_t fixedMul(int32_t a, uint16_t k, uint8_t shift)
 {
-	if(PIND & 0x04)
+	int32_t product;
+
+	product = (int32_t)(int16_t)(a >> 16) * (int32_t)k;						//High part, (a >> 16) * k
+	product += (int32_t)(((uint32_t)(a & 0xFFFF) * k + 0x8000) >> 16);		//Low part, always positive
+
+	if(shift > 16)
 	{
-		PORTD |= (1 << 4);
+		product += (int32_t)1 << (shift - 17);
 	}
-	else
+
+	return product >> (shift - 16);
+}
+
+/**
+ * @brief      Convert a gain below 1.0 to a mantissa and shift for fixedMul()
+ *
+ *             The mantissa is scaled up as far as possible, so small gains keep
+ *             16 bits of precision.
+ *
+ * @param      gain   - Gain to convert (0.0 - 1.0)
+ * @param      k      - Receives the mantissa
+ * @param      shift  - Receives the shift (16 - 31)
+ */
+static void fixedGain(float gain, uint16_t *k, uint8_t *shift)
+{
+	*shift = 16;
+	gain *= 65536.0;
+
+	while(gain < 32768.0 && *shift < 31)
 	{
-		PORTD &= ~(1 << 4);
+		gain *= 2.0;
+		(*shift)++;
 	}
-	if((PINB & (0x08)))			//CCW
+
+	*k = (gain > 65535.0) ? 65535 : (uint16_t)(gain + 0.5);
+}
+
+/** Estimated position of the fixed point speed observers, integer part */
+static int32_t observerPosition = 0;
+/** Estimated position of the fixed point speed observers, 16 bit fraction */
+static uint16_t observerPositionFraction = 0;
+
+/**
+ * @brief      Add a Q16.16 value to the estimated position of the fixed point speed observers
+ */
+static inline void observerMove(int32_t distance)
+{
+	uint32_t fraction;
+
+	fraction = (uint32_t)observerPositionFraction + (uint16_t)(distance & 0xFFFF);
+	observerPosition += (distance >> 16) + (int32_t)(fraction >> 16);
+	observerPositionFraction = (uint16_t)fraction;
+}
+
+/**
+ * @brief      Difference between a measured position and the estimated position, in Q16.16
+ *
+ *             Limited to +/-16383 counts, to keep the fixed point products in range.
+ */
+static inline int32_t observerResidual(int32_t position)
+{
+	int32_t residual = position - observerPosition;
+
+	if(residual > 16383)
 	{
-		if(!pointer->invertPidDropinDirection)
-		{
-			pointer->stepCnt--;				//DIR is set to CCW, therefore we subtract 1 step from step count (negative values = number of steps in CCW direction from initial postion)
-		}
-		else
-		{
-			pointer->stepCnt++;			//DIR is set to CW, therefore we add 1 step to step count (positive values = number of steps in CW direction from initial postion)
-		}
-		
+		residual = 16383;
 	}
-	else						//CW
+	else if(residual < -16383)
 	{
-		if(!pointer->invertPidDropinDirection)
-		{
-			pointer->stepCnt++;			//DIR is set to CW, therefore we add 1 step to step count (positive values = number of steps in CW direction from initial postion)
-		}
-		else
-		{
-			pointer->stepCnt--;				//DIR is set to CCW, therefore we subtract 1 step from step count (negative values = number of steps in CCW direction from initial postion)
-		}
+		residual = -16383;
 	}
+
+	return (residual << 16) - (int32_t)observerPositionFraction;
 }
 
-void INT1_vect(void)
+#if CONTROLFIXEDPOINT
+/**
+ * @brief      PLL speed observer, fixed point version
+ *
+ *             PI tracking loop estimating the velocity of "position". All
+ *             states are kept per encoder sample: the estimated position is
+ *             split in an integer part and a 16 bit fraction, and velocities
+ *             are Q16.16 counts per sample.
+ *
+ * @param      position  - Position to track (encoder counts or steps)
+ * @param      velocity  - Velocity to restart from, in Q16.16 counts per sample
+ * @param      restart   - Restart the observer at position and velocity
+ *
+ * @return     Estimated velocity in Q16.16 counts per sample
+ */
+static int32_t speedObserverPll(int32_t position, int32_t velocity, bool restart)
 {
-	if(PIND & 0x04)
+	static int32_t velIntegrator = 0;
+	static int32_t velEst = 0;
+	int32_t posError;
+
+	if(restart)
 	{
-		PORTD |= (1 << 4);
+		observerPosition = position;
+		observerPositionFraction = 0;
+		velIntegrator = velEst = velocity;
 	}
-	else
+
+	observerMove(velEst);
+	posError = observerResidual(position);
+
+	velIntegrator += fixedMul(posError, pointer->speedObserverGainFixed[1], pointer->speedObserverShiftFixed[1]);
+	velEst = fixedMul(posError, pointer->speedObserverGainFixed[0], pointer->speedObserverShiftFixed[0]) + velIntegrator;
+
+	return velIntegrator;
+}
+#else
+/**
+ * @brief      PLL speed observer, floating point version
+ *
+ *             PI tracking loop estimating the velocity of "position". The
+ *             states are kept in counts and counts per second.
+ *
+ * @param      position  - Position to track (encoder counts or steps)
+ * @param      velocity  - Velocity to restart from, in Q16.16 counts per sample
+ * @param      restart   - Restart the observer at position and velocity
+ *
+ * @return     Estimated velocity in Q16.16 counts per sample
+ */
+static int32_t speedObserverPll(int32_t position, int32_t velocity, bool restart)
+{
+	static float posEst = 0.0;
+	static float velIntegrator = 0.0;
+	static float velEst = 0.0;
+	float posError;
+
+	if(restart)
 	{
-		PORTD &= ~(1 << 4);
+		posEst = (float)position;
+		velIntegrator = velEst = (float)velocity * (float)(ENCODERINTFREQ/65536.0);
 	}
+
+	posEst += velEst * ENCODERINTSAMPLETIME;
+	posError = (float)position - posEst;
+	velIntegrator += posError * pointer->speedObserverGain[1];
+	velEst = (posError * pointer->speedObserverGain[0]) + velIntegrator;
+
+	return (int32_t)(velIntegrator * (float)(65536.0/ENCODERINTFREQ));
 }
+#endif
 
-void TIMER3_COMPA_vect(void)
+/**
+ * @brief      Alpha-beta tracker speed observer, used by SPEEDOBSERVERALPHABETA and SPEEDOBSERVERKALMAN
+ *
+ *             Predicts the position from the estimated velocity, and corrects
+ *             position and velocity by alpha and beta times the difference to
+ *             the measured position. Fixed point, with the same number format
+ *             as the fixed point PLL, so the estimate stays exact at any position.
+ *
+ * @param      position  - Position to track (encoder counts or steps)
+ * @param      velocity  - Velocity to restart from, in Q16.16 counts per sample
+ * @param      restart   - Restart the observer at position and velocity
+ *
+ * @return     Estimated velocity in Q16.16 counts per sample
+ */
+static int32_t speedObserverTracker(int32_t position, int32_t velocity, bool restart)
 {
-	asm volatile("push r16 \n\t");
-	asm volatile("in r16,0x3F \n\t");
-	asm volatile("push r16 \n\t");
-	asm volatile("push r30 \n\t");
-	asm volatile("push r31 \n\t");
-	asm volatile("lds r30,p \n\t");
-	asm volatile("lds r31,p+1 \n\t");
+	static int32_t velEst = 0;
+	int32_t residual;
 
-	asm volatile("jmp _stepGenerator \n\t");	//Execute the acceleration profile algorithm
+	if(restart)
+	{
+		observerPosition = position;
+		observerPositionFraction = 0;
+		velEst = velocity;
+	}
+
+	observerMove(velEst);
+	residual = observerResidual(position);
 
+	observerMove(fixedMul(residual, pointer->speedObserverGainFixed[0], pointer->speedObserverShiftFixed[0]));
+	velEst += fixedMul(residual, pointer->speedObserverGainFixed[1], pointer->speedObserverShiftFixed[1]);
+
+	return velEst;
 }
 
-void TIMER1_COMPA_vect(void)
+/**
+ * @brief      Run the speed observer selected by uStepperSLite::setSpeedObserver()
+ *
+ * @param      position  - Position to track (encoder counts or steps)
+ *
+ * @return     Estimated velocity in Q16.16 counts per sample
+ */
+static int32_t speedObserve(int32_t position)
+{
+	static int32_t velocity = 0;
+	bool restart = pointer->speedObserverRestart;
+
+	pointer->speedObserverRestart = 0;
+
+	if(pointer->speedObserver == SPEEDOBSERVERPLL)
 	{
-		uint8_t data[2];
-		uint16_t curAngle;
-		int16_t deltaAngle;
-		float posError = 0.0;
-		static float posEst = 0.0;
-		static float velIntegrator = 0.0;
-		static float velEst = 0.0;
-		uint32_t temp;
-		int32_t stepCntTemp;
-		int32_t pidTargetPositionTruncated;
-		int32_t *stepsSinceResetPointer;
-		float tempFloat;
-		sei();
+		velocity = speedObserverPll(position, velocity, restart);
+	}
+	else
+	{
+		velocity = speedObserverTracker(position, velocity, restart);
+	}
 
-		if(I2C.getStatus() != I2CFREE)
-		{
-			return;
-		}
+	return velocity;
+}
 
-		I2C.read(ENCODERADDR, ANGLE, 2, data);
+/** Buffer receiving the raw angle from the encoder, in the encoder interrupt */
+static uint8_t encoderData[2];
 
-		curAngle = (((uint16_t)data[0]) << 8 ) | (uint16_t)data[1];
-		pointer->encoder.angle = curAngle;
-		curAngle -= pointer->encoder.encoderOffset;
+/** Buffer receiving a diagnostics register from the encoder, in TIMER1_COMPB_vect */
+static uint8_t encoderDiagData[2];
 
-		if(curAngle > 4095)
-		{
-			curAngle -= 61440;
-		}
+/** Diagnostics register read by TIMER1_COMPB_vect (ENCODERDIAGSTATUS ...) */
+static uint8_t encoderDiagIndex = 0;
 
-		deltaAngle = (int16_t)pointer->encoder.oldAngle - (int16_t)curAngle;
+/** Address in the encoder chip of every diagnostics register */
+static const uint8_t encoderDiagRegister[ENCODERDIAGCOUNT] PROGMEM = {STATUS, AGC, MAGNITUDE};
 
-		if(deltaAngle < -2047)
-		{
-			deltaAngle += 4096;
-		}
+/**
+ * @brief      Count encoder interrupts running past ENCODERINTCYCLEBUDGET
+ *
+ *             Timer one restarts at every encoder interrupt, so TCNT1 holds the
+ *             number of CPU cycles spent since the interrupt was triggered.
+ */
+static inline void encoderIntCheckBudget(void)
+{
+	if(TCNT1 > ENCODERINTCYCLEBUDGET)
+	{
+		pointer->encoderIntOverBudget++;
+	}
+}
 
-		else if(deltaAngle > 2047)
-		{
-			deltaAngle -= 4096;
-		}
+/** Seed for the reciprocal of the float mantissa, 1/(1 + (i + 0.5)/128) in Q0.16 */
+static const uint16_t stepDelayReciprocalTable[128] PROGMEM =
+{
+	65281, 64777, 64281, 63792, 63310, 62836, 62369, 61909,
+	61455, 61008, 60568, 60133, 59705, 59283, 58867, 58457,
+	58053, 57654, 57260, 56872, 56489, 56111, 55738, 55370,
+	55007, 54649, 54295, 53946, 53601, 53261, 52925, 52593,
+	52265, 51942, 51622, 51306, 50995, 50686, 50382, 50081,
+	49784, 49490, 49200, 48913, 48630, 48349, 48072, 47798,
+	47528, 47260, 46995, 46733, 46474, 46218, 45965, 45714,
+	45467, 45222, 44979, 44739, 44502, 44267, 44035, 43805,
+	43577, 43352, 43129, 42908, 42690, 42474, 42260, 42048,
+	41838, 41631, 41425, 41222, 41020, 40820, 40623, 40427,
+	40233, 40041, 39851, 39662, 39476, 39291, 39108, 38926,
+	38746, 38568, 38392, 38217, 38044, 37872, 37702, 37533,
+	37366, 37200, 37036, 36873, 36712, 36552, 36393, 36236,
+	36080, 35926, 35772, 35620, 35470, 35320, 35172, 35026,
+	34880, 34735, 34592, 34450, 34309, 34169, 34031, 33893,
+	33757, 33622, 33487, 33354, 33222, 33091, 32961, 32832,
+};
 
-		pointer->encoder.angleMoved -= deltaAngle;		//The AS5600 encoder counts in the opposite direction
-														//as the AEAT8800 (the encoder on uStepper S).
-														//Therefore it is subtracted here, so the two boards
-														//behave similar
+/**
+ * @brief      Convert a speed in steps per second to a step generator delay
+ *
+ *             Calculates STEPGENERATORFREQUENCY/|speed| in Q24.8 format (step
+ *             interval in interrupt ticks, with 8 fractional bits), rounded to
+ *             nearest, without float division. Speeds of 5 steps/s or less give
+ *             20000 ticks, and speeds of 2^24 steps/s or more give 0.
+ *
+ *             The reciprocal of the mantissa of "speed" is estimated from a
+ *             table and one newton iteration, and the integer part of the
+ *             delay is corrected with an exact 32 bit remainder. The fraction
+ *             is then estimated from the remainder and corrected the same way,
+ *             so the result is exact (extras/host/test_stepdelay.cpp).
+ *
+ * @param      speed  - Speed in steps per second, sign is ignored
+ *
+ * @return     Value for stepDelay
+ */
+static uint32_t stepDelayFromSpeed(float speed)
+{
+	floatBytes_t value;
+	uint32_t bits, mantissa, reciprocal, remainder, step;
+	int32_t reciprocalError, fractionError;
+	uint16_t x, seed, fraction;
+	uint8_t exponent;
+	int32_t delay;
 
-		pointer->encoder.oldAngle = curAngle;
+	value.f = speed;
+	value.bytes[3] &= 0x7F;					//|speed|
+	bits = ((uint32_t)value.bytes[3] << 24) | ((uint32_t)value.bytes[2] << 16) | ((uint32_t)value.bytes[1] << 8) | value.bytes[0];
 
-		if(pointer->mode == DROPIN)
-		{
-			cli();
-				stepCntTemp = pointer->stepCnt;
-			sei();
+	if(bits <= 0x40A00000 || bits > 0x7F800000)	//|speed| <= 5.0, or NaN
+	{
+		return (uint32_t)20000 << 8;
+	}
 
-			//		Speed filter
-			posEst += velEst * ENCODERINTSAMPLETIME;
-			posError = (float)stepCntTemp - posEst;
-			velIntegrator += posError * PULSEFILTERKI;
-			velEst = (posError * PULSEFILTERKP) + velIntegrator;
-			pointer->currentPidSpeed = velIntegrator;
+	exponent = (uint8_t)(bits >> 23) - 127;		//|speed| = mantissa * 2^(exponent - 23)
 
-			posError = (float)stepCntTemp - ((float)pointer->encoder.angleMoved * pointer->stepConversion);
+	if(exponent > 23)						//Delay below 2/256 ticks, or infinity
+	{
+		return 0;
+	}
 
-			pointer->pidDropin(posError);
-			return;
-		}
-		else
-		{
-			//		Speed filter
-			posEst += velEst * ENCODERINTSAMPLETIME;
-			posError = (float)pointer->encoder.angleMoved - posEst;
-			velIntegrator += posError * PULSEFILTERKI;
-			velEst = (posError * PULSEFILTERKP) + velIntegrator;
-			pointer->encoder.curSpeed = velIntegrator * pointer->stepConversion;
+	mantissa = (bits & 0x7FFFFF) | 0x800000;
 
-			//stepGenerator speed integrator
-			pointer->currentPidSpeed += pointer->currentPidAcceleration;
-			if(pointer->direction == CW)
-			{
-				if(pointer->currentPidSpeed >= pointer->velocity)
-				{
-					pointer->currentPidSpeed = pointer->velocity;
-				}
-				else if(pointer->currentPidSpeed < 0.0)
-				{
-					pointer->currentPidSpeed = 0.0;
-				}
-			}
-			else
-			{
-				if(pointer->currentPidSpeed <= -pointer->velocity)
-				{
-					pointer->currentPidSpeed = -pointer->velocity;
-				}
-				else if(pointer->currentPidSpeed > 0.0)
-				{
-					pointer->currentPidSpeed = 0.0;
-				}
-			}
+	//Reciprocal of mantissa/2^23 in Q0.16, seed from table and one newton iteration
+	x = (uint16_t)(mantissa >> 8);
+	seed = pgm_read_word(&stepDelayReciprocalTable[(x >> 8) & 0x7F]);
+	reciprocalError = (int32_t)(0x80000000UL - (uint32_t)x * seed);
+	reciprocal = (uint32_t)seed + (((int32_t)(int16_t)(seed >> 1) * (int16_t)(reciprocalError >> 12)) >> 18);
 
+	//Estimated delay in whole ticks, 100000/|speed| rounded, within +/- 1. Zero from 2^18 steps/s (0.38 ticks)
+	delay = (exponent > 17) ? 0 : (int32_t)((((50000UL * reciprocal) >> (14 + exponent)) + 1) >> 1);
 
-			//stepgenerator targetposition integrator
-			pointer->pidTargetPosition += pointer->currentPidSpeed * ENCODERINTSAMPLETIME;
+	//Exact remainder of 200000*2^(23-exponent) - (2*delay - 1)*mantissa. Only the lower
+	//32 bits are needed, as the true remainder is small
+	step = mantissa << 1;
+	remainder = (200000UL << (23 - exponent)) - (uint32_t)(2 * delay - 1) * mantissa;
 
-			if(pointer->mode == PID)
-			{
-				pidTargetPositionTruncated = (int32_t)pointer->pidTargetPosition;
-				stepsSinceResetPointer = &pidTargetPositionTruncated;
-			}
-			else
-			{
-				stepsSinceResetPointer = &pointer->stepsSinceReset;
-			}
+	while((int32_t)remainder < 0)
+	{
+		delay--;
+		remainder += step;
+	}
+	while((int32_t)(remainder - step) >= 0)
+	{
+		delay++;
+		remainder -= step;
+	}
 
-			if(pointer->continous == 1)
-			{
-				pointer->targetPosition = (float)pointer->pidTargetPosition;
-			}
-			else
-			{
-				if(pointer->targetPosition < 0)
-				{
-					if(pointer->pidTargetPosition < (float)pointer->targetPosition)
-					{
-						pointer->pidTargetPosition = (float)pointer->targetPosition;
-					}
-				}
-				else
-				{
-					if(pointer->pidTargetPosition > (float)pointer->targetPosition)
-					{
-						pointer->pidTargetPosition = (float)pointer->targetPosition;
-					}
-				}
-			}
+	//100000/|speed| = delay - 0.5 + remainder/(2*mantissa), with 0 <= remainder < 2*mantissa,
+	//so the fraction in 1/256 ticks is 128*remainder/mantissa. Estimate it, then round exactly
+	remainder <<= 7;
+	fraction = (uint16_t)((((remainder >> 17) * reciprocal) + 0x200000UL) >> 22);
+	fractionError = (int32_t)(remainder - (uint32_t)fraction * mantissa);
 
-			//acceleration profile generator
-			if(pointer->state == INITDECEL)
-			{
-				if(pointer->direction == CW)
-				{
-					pointer->currentPidAcceleration = pointer->acceleration * ENCODERINTSAMPLETIME;
-					if(*stepsSinceResetPointer >= pointer->decelToAccelThreshold)
-					{
-						pointer->state = ACCEL;
-					}
-				}
-				else
-				{
-					pointer->currentPidAcceleration = -(pointer->acceleration * ENCODERINTSAMPLETIME);
-					if(*stepsSinceResetPointer >= pointer->decelToAccelThreshold)
-					{
-						pointer->state = ACCEL;
-					}
-				}
+	while(2 * fractionError >= (int32_t)mantissa)
+	{
+		fraction++;
+		fractionError -= mantissa;
+	}
+	while(2 * fractionError < -(int32_t)mantissa)
+	{
+		fraction--;
+		fractionError += mantissa;
+	}
 
-			}
-			else if(pointer->state == ACCEL)
-			{
+	return ((uint32_t)delay << 8) - 128 + fraction;
+}
+
+/** Speeds of the last encoder samples, averaged by the S-curve filter */
+static float jerkFilterBuffer[JERKFILTERMAXLENGTH];
+/** Sum of the speeds in jerkFilterBuffer */
+static float jerkFilterSum = 0.0;
+/** Position of the oldest speed in jerkFilterBuffer */
+static uint8_t jerkFilterIndex = 0;
+/** Distance in steps between the unfiltered profile and the filtered speed followed by the motor */
+static float jerkFilterLag = 0.0;
+
+/**
+ * @brief      Restart the S-curve filter at a constant speed
+ *
+ * @param      speed   - Speed to fill the filter with, in steps/s
+ * @param      length  - Number of samples averaged by the filter
+ */
+static void jerkFilterReset(float speed, uint8_t length)
+{
+	uint8_t i;
+
+	for(i = 0; i < JERKFILTERMAXLENGTH; i++)
+	{
+		jerkFilterBuffer[i] = speed;
+	}
+	jerkFilterSum = speed * (float)length;
+	jerkFilterIndex = 0;
+	jerkFilterLag = 0.0;
+}
+
+/**
+ * @brief      S-curve filter, moving average of the profile speed
+ *
+ *             Averaging the speed of the trapezoidal profile over
+ *             jerkFilterLength samples turns every step in acceleration into
+ *             a linear ramp, while the number of steps moved stays the same.
+ *             The distance the filtered speed trails the profile is kept in
+ *             jerkFilterLag, and drops back to zero when the profile stops.
+ *
+ * @param      speed  - Speed of the trapezoidal profile, in steps/s
+ *
+ * @return     Speed to run the motor at, in steps/s
+ */
+static float jerkFilter(float speed)
+{
+	uint8_t i;
+	float filtered;
+
+	jerkFilterSum += speed - jerkFilterBuffer[jerkFilterIndex];
+	jerkFilterBuffer[jerkFilterIndex] = speed;
+
+	if(++jerkFilterIndex >= pointer->jerkFilterLength)
+	{
+		jerkFilterIndex = 0;
+		jerkFilterSum = 0.0;		//Sum the buffer again once per period, so rounding errors do not build up
+		for(i = 0; i < pointer->jerkFilterLength; i++)
+		{
+			jerkFilterSum += jerkFilterBuffer[i];
+		}
+	}
+
+	filtered = jerkFilterSum * pointer->jerkFilterGain;
+
+	if(jerkFilterSum == 0.0)
+	{
+		jerkFilterLag = 0.0;
+	}
+	else
+	{
+		jerkFilterLag += (speed - filtered) * ENCODERINTSAMPLETIME;
+	}
+
+	return filtered;
+}
+
+/**
+ * @brief      Position of the acceleration profile, in steps
+ *
+ *             The position the profile thresholds are compared against: the
+ *             PID setpoint in PID mode, and the steps issued plus the lag of the
+ *             S-curve filter otherwise.
+ */
+static int32_t profilePosition(void)
+{
+	if(pointer->mode == PID)
+	{
+		return (int32_t)pointer->pidTargetPosition;
+	}
+
+	return pointer->stepsSinceReset + (int32_t)jerkFilterLag;
+}
+
+/** Position of the motion profile at the last stall detection, in steps */
+static int32_t stallOldReference;
+/** Position of the encoder at the last stall detection, in encoder counts */
+static int32_t stallOldEncoder;
+/** Set when the stall detection should start over at the next sample */
+static bool stallRestart = 1;
+/** STALLDETECTIIR: filtered change of the encoder and the profile per sample, encoder counts Q16 */
+static int32_t stallEncoderFilter;
+static int32_t stallReferenceFilter;
+/** STALLDETECTIIR: samples with too little movement, filtered by the stall sensitivity, Q15 */
+static int32_t stallAccumulator;
+/** STALLDETECTFOLLOWINGERROR: distance between the profile and the encoder, encoder counts Q16 */
+static int32_t stallFollowingError;
+/** STALLDETECTVELOCITYRATIO: samples in the window so far */
+static uint8_t stallWindowSamples;
+/** STALLDETECTVELOCITYRATIO: stalled windows in a row */
+static uint8_t stallWindowCount;
+/** STALLDETECTVELOCITYRATIO: movement of the encoder in the window, encoder counts */
+static int32_t stallWindowEncoder;
+/** STALLDETECTVELOCITYRATIO: movement of the profile in the window, encoder counts Q8 */
+static int32_t stallWindowReference;
+
+/**
+ * @brief      Clear the state of the stall detection
+ *
+ *             The positions are taken again at the next sample, so a jump of the
+ *             home position or a change of mode does not look like a stall.
+ */
+static void stallDetectionReset(void)
+{
+	stallRestart = 1;
+	stallEncoderFilter = 0;
+	stallReferenceFilter = 0;
+	stallAccumulator = 0;
+	stallFollowingError = 0;
+	stallWindowSamples = 0;
+	stallWindowCount = 0;
+	stallWindowEncoder = 0;
+	stallWindowReference = 0;
+}
+
+#if ISRPROFILING
+/** Execution time statistics of the profiled routines. Only accessed with interrupts disabled */
+static isrProfile_t isrProfile[ISRPROFILECOUNT];
+
+/**
+ * @brief      Read the profiling timestamp
+ *
+ *             Timer four runs freely at F_CPU, so the difference between two
+ *             timestamps is the number of CPU cycles spent in between (below
+ *             65536 cycles). Interrupts are disabled while reading, since the
+ *             16 bit read uses the shared TEMP register of the timer.
+ */
+static inline uint16_t isrProfileTime(void)
+{
+	uint16_t time;
+	uint8_t sreg = SREG;
+
+	cli();
+	time = TCNT4;
+	SREG = sreg;
+
+	return time;
+}
+
+/**
+ * @brief      Add a measurement to the statistics of a profiled routine. Interrupts must be disabled
+ *
+ * @param      isr      - Routine measured (ISRPROFILEENCODER ...)
+ * @param      duration - Measured time in CPU cycles
+ * @param      overrun  - true if the routine did not finish before it was due again
+ */
+static void isrProfileAdd(uint8_t isr, uint16_t duration, bool overrun)
+{
+	isrProfile_t *profile = &isrProfile[isr];
+
+	if(profile->count == 0 || duration < profile->min)
+	{
+		profile->min = duration;
+	}
+	if(duration > profile->max)
+	{
+		profile->max = duration;
+	}
+	profile->sum += duration;
+	profile->count++;
+	if(overrun)
+	{
+		profile->overruns++;
+	}
+}
+
+/**
+ * @brief      Add a measurement to the statistics of a profiled routine
+ *
+ * @param      isr      - Routine measured (ISRPROFILEENCODER ...)
+ * @param      start    - Timestamp taken when the routine was entered
+ * @param      overrun  - true if the routine did not finish before it was due again
+ */
+static void isrProfileRecord(uint8_t isr, uint16_t start, bool overrun)
+{
+	uint8_t sreg = SREG;
+
+	cli();
+	isrProfileAdd(isr, TCNT4 - start, overrun);
+	SREG = sreg;
+}
+
+/** Mark the beginning of a profiled routine */
+#define ISRPROFILEBEGIN(start) uint16_t start = isrProfileTime()
+/** Mark the end of a profiled routine */
+#define ISRPROFILEEND(isr, start, overrun) isrProfileRecord((isr), (start), (overrun))
+/** Check if a profiled routine has run for longer than "cycles" */
+#define ISRPROFILEPASSED(start, cycles) ((uint16_t)(isrProfileTime() - (start)) > (cycles))
+/** Record the latency of an interrupt, "cycles" since it was due. Interrupts must be disabled */
+#define ISRPROFILELATENCY(isr, cycles) isrProfileAdd((isr), (cycles), 0)
+#else
+#define ISRPROFILEBEGIN(start)
+#define ISRPROFILEEND(isr, start, overrun)
+#define ISRPROFILELATENCY(isr, cycles)
+#endif
+
+#if TRACEBUFFERLENGTH
+/** Records of the trace, used as a ring buffer */
+static traceRecord_t traceBuffer[TRACEBUFFERLENGTH];
+/** Position in traceBuffer of the next record */
+static uint16_t traceHead = 0;
+/** Number of records in traceBuffer */
+static uint16_t traceCount = 0;
+/** Records taken since the trigger */
+static uint16_t traceSinceTrigger = 0;
+/** Records to take after the trigger */
+static uint16_t tracePostTrigger = TRACEBUFFERLENGTH;
+/** State of the recording (TRACEIDLE ...) */
+static volatile uint8_t traceState = TRACEIDLE;
+/** Event starting the recording (TRACETRIGGERNOW ...) */
+static uint8_t traceTrigger = TRACETRIGGERNOW;
+/** Record every traceDecimation encoder sample */
+static uint8_t traceDecimation = 1;
+/** Encoder samples since the last record */
+static uint8_t traceDecimationCounter = 0;
+/** State of the motion profile at the last sample, used to find the start of a move */
+static uint8_t tracePreviousState = STOP;
+
+/**
+ * @brief      Record an encoder sample into the trace buffer
+ *
+ *             Called by the encoder interrupt, after the stall detection.
+ */
+static void traceSample(void)
+{
+	traceRecord_t *record;
+	uint8_t state = pointer->state;
+
+	if(traceState == TRACEARMED)
+	{
+		if((traceTrigger == TRACETRIGGERMOVE && state != STOP && tracePreviousState == STOP) ||
+		   (traceTrigger == TRACETRIGGERSTALL && pointer->stall))
+		{
+			traceState = TRACETRIGGERED;
+			traceSinceTrigger = 0;
+			traceDecimationCounter = traceDecimation;		//Record the trigger sample
+		}
+	}
+	tracePreviousState = state;
+
+	if(traceState != TRACEARMED && traceState != TRACETRIGGERED)
+	{
+		return;
+	}
+
+	if(++traceDecimationCounter < traceDecimation)
+	{
+		return;
+	}
+	traceDecimationCounter = 0;
+
+	record = &traceBuffer[traceHead];
+	record->angleMoved = pointer->encoder.angleMoved;
+	record->pidTargetPosition = pointer->pidTargetPosition;
+	record->pidError = pointer->currentPidError;
+	record->stepDelay = pointer->stepDelay;
+	record->state = state;
+
+	if(++traceHead >= TRACEBUFFERLENGTH)
+	{
+		traceHead = 0;
+	}
+	if(traceCount < TRACEBUFFERLENGTH)
+	{
+		traceCount++;
+	}
+
+	if(traceState == TRACETRIGGERED && ++traceSinceTrigger >= tracePostTrigger)
+	{
+		traceState = TRACEDONE;
+	}
+}
+/** Record an encoder sample into the trace buffer */
+#define TRACESAMPLE() traceSample()
+#else
+#define TRACESAMPLE()
+#endif
+
+/**
+ * Snapshots published by the encoder interrupt. The interrupt fills the buffer not
+ * holding the latest snapshot, then increments snapshotPublished, so a reader copying
+ * snapshotBuffer[snapshotPublished & 1] is only disturbed by two publications
+ */
+static motionSnapshot_t snapshotBuffer[2];
+/** Number of snapshots published (modulo 256). snapshotBuffer[snapshotPublished & 1] holds the latest */
+static volatile uint8_t snapshotPublished = 0;
+/** Keeps the compiler from moving the snapshot buffer accesses across a change or read of snapshotPublished */
+#define SNAPSHOTBARRIER() asm volatile("" ::: "memory")
+
+/**
+ * @brief      Publish the state of the motion controller for getSnapshot()
+ *
+ *             Called by the encoder interrupt, at the end of every sample.
+ */
+static void snapshotPublish(void)
+{
+	uint8_t sreg;
+	motionSnapshot_t *snapshot = &snapshotBuffer[(snapshotPublished + 1) & 1];
+
+	snapshot->sequence = snapshotBuffer[snapshotPublished & 1].sequence + 1;
+	snapshot->angleMoved = pointer->encoder.angleMoved;
+	sreg = SREG;
+	cli();
+		snapshot->stepsSinceReset = pointer->stepsSinceReset;
+	SREG = sreg;
+	snapshot->pidError = pointer->currentPidError;
+	snapshot->speed = pointer->encoder.curSpeed;
+	snapshot->state = pointer->state;
+
+	SNAPSHOTBARRIER();
+	snapshotPublished++;
+}
+
+extern "C" {
+
+#if ISRPROFILING
+/** Timestamp taken when the step generator interrupt is entered, written by TIMER3_COMPA_vect */
+volatile uint16_t isrProfileStepStart;
+
+/**
+ * @brief      Profiling hook called from the assembler step generator, just before it returns
+ */
+void isrProfileStepGenerator(void)
+{
+	isrProfileRecord(ISRPROFILESTEPGENERATOR, isrProfileStepStart, TIFR3 & (1 << OCF3A));
+}
+#endif
+
+void INT0_vect(void)
+{
+	ISRPROFILEBEGIN(profileStart);
+
+	if(PIND & 0x04)
+	{
+		DRIVERDISABLE();
+	}
+	else
+	{
+		DRIVERENABLE();
+	}
+	if((PINB & (0x08)))			//CCW
+	{
+		if(!pointer->invertPidDropinDirection)
+		{
+			pointer->stepCnt--;				//DIR is set to CCW, therefore we subtract 1 step from step count (negative values = number of steps in CCW direction from initial postion)
+		}
+		else
+		{
+			pointer->stepCnt++;			//DIR is set to CW, therefore we add 1 step to step count (positive values = number of steps in CW direction from initial postion)
+		}
+		
+	}
+	else						//CW
+	{
+		if(!pointer->invertPidDropinDirection)
+		{
+			pointer->stepCnt++;			//DIR is set to CW, therefore we add 1 step to step count (positive values = number of steps in CW direction from initial postion)
+		}
+		else
+		{
+			pointer->stepCnt--;				//DIR is set to CCW, therefore we subtract 1 step from step count (negative values = number of steps in CCW direction from initial postion)
+		}
+	}
+
+	ISRPROFILEEND(ISRPROFILEDROPIN, profileStart, EIFR & (1 << INTF0));
+}
+
+void INT1_vect(void)
+{
+	if(PIND & 0x04)
+	{
+		DRIVERDISABLE();
+	}
+	else
+	{
+		DRIVERENABLE();
+	}
+}
+
+#if STEPENGINE == STEPENGINECOMPARE
+/** Timer three counts elapsed since the last step was issued */
+static uint32_t stepEngineElapsed = 0;
+/** Timer three counts between the previous and the current compare interrupt */
+static uint16_t stepEngineChunk = 0;
+/** Fractional part of the step interval, in 1/64 timer counts */
+static uint8_t stepEngineFraction = 0;
+
+/**
+ * @brief      Length of the current step interval, in timer three counts
+ *
+ *             stepDelay is in Q24.8 step generator ticks, and one tick is
+ *             STEPENGINECOUNTSPERTICK (20) timer counts, so the interval is
+ *             stepDelay * 20/256 = stepDelay * 5/64 counts. The remaining
+ *             1/64 counts are carried to the next interval in stepEngineFraction.
+ */
+static inline uint32_t stepEngineInterval(void)
+{
+	return ((pointer->stepDelay * 5) + stepEngineFraction) >> 6;
+}
+
+void TIMER3_COMPA_vect(void)		//Step engine driven by output compare, one interrupt per step
+{
+	uint32_t interval, remaining;
+	uint16_t next;
+	uint8_t ticks;
+
+	ISRPROFILEBEGIN(profileStart);
+
+	stepEngineElapsed += stepEngineChunk;
+
+	if(!pointer->continous)
+	{
+		if(pointer->pidError)
+		{
+			//pidError is a number of step generator ticks to keep running
+			ticks = (stepEngineChunk >= ((uint16_t)pointer->pidError * STEPENGINECOUNTSPERTICK)) ? pointer->pidError : (uint8_t)(stepEngineChunk / STEPENGINECOUNTSPERTICK);
+			pointer->pidError -= ticks;
+		}
+		else if(pointer->state == STOP)
+		{
+			stepEngineElapsed -= stepEngineChunk;		//Time does not count while stopped
+			remaining = STEPENGINEMAXCHUNK;
+			goto schedule;
+		}
+	}
+
+	interval = stepEngineInterval();
+
+	if(stepEngineElapsed >= interval)
+	{
+		stepEngineFraction = (uint8_t)(((pointer->stepDelay * 5) + stepEngineFraction) & 0x3F);
+		stepEngineElapsed = 0;
+
+		if(pointer->stepGeneratorDirection & 0x01)
+		{
+			DIRPINCCW();
+			STEPPINHIGH();
+			if(pointer->mode != PID)
+			{
+				pointer->stepsSinceReset--;
+			}
+		}
+		else
+		{
+			DIRPINCW();
+			STEPPINHIGH();
+			if(pointer->mode != PID)
+			{
+				pointer->stepsSinceReset++;
+			}
+		}
+		STEPPINLOW();
+
+		interval = stepEngineInterval();
+	}
+
+	remaining = interval - stepEngineElapsed;
+
+schedule:
+	//Wake up at least once per STEPENGINEMAXCHUNK, to pick up new speeds
+	if(remaining > STEPENGINEMAXCHUNK)
+	{
+		remaining = STEPENGINEMAXCHUNK;
+	}
+	else if(remaining < STEPENGINECOUNTSPERTICK)
+	{
+		remaining = STEPENGINECOUNTSPERTICK;
+	}
+
+	next = OCR3A + (uint16_t)remaining;
+
+	if((int16_t)(next - TCNT3) < STEPENGINEMINLEAD)		//Too late, the compare match would be missed
+	{
+		next = TCNT3 + STEPENGINEMINLEAD;
+	}
+
+	stepEngineChunk = next - OCR3A;
+	OCR3A = next;
+
+	ISRPROFILEEND(ISRPROFILESTEPGENERATOR, profileStart, TIFR3 & (1 << OCF3A));
+}
+#elif !defined(USTEPPER_HOST)
+void TIMER3_COMPA_vect(void)
+{
+	asm volatile("push r16 \n\t");
+	asm volatile("in r16,0x3F \n\t");
+	asm volatile("push r16 \n\t");
+	asm volatile("push r30 \n\t");
+	asm volatile("push r31 \n\t");
+#if ISRPROFILING
+	asm volatile("lds r16,%0 \n\t" :: "n" (_SFR_MEM_ADDR(TCNT4L)));	//Reading the low byte latches the high byte
+	asm volatile("sts isrProfileStepStart,r16 \n\t");
+	asm volatile("lds r16,%0 \n\t" :: "n" (_SFR_MEM_ADDR(TCNT4H)));
+	asm volatile("sts isrProfileStepStart+1,r16 \n\t");
+#endif
+	asm volatile("lds r30,p \n\t");
+	asm volatile("lds r31,p+1 \n\t");
+
+	asm volatile("jmp _stepGenerator \n\t");	//Execute the acceleration profile algorithm
+
+}
+#else
+static void stepGenerator(void)		//C version of _stepGenerator (stepGenerator.S), used by the host simulation
+{
+	uint16_t fraction;
+
+	if(!pointer->continous)
+	{
+		if(pointer->pidError)
+		{
+			pointer->pidError--;
+		}
+		else if(pointer->state == STOP)
+		{
+			STEPPINLOW();
+			return;
+		}
+	}
+
+	if((pointer->cntSinceLastStep & 0xFFFFFF) < (pointer->stepDelay >> 8))
+	{
+		pointer->cntSinceLastStep++;
+		STEPPINLOW();
+		return;
+	}
+
+	//Accumulate the fractional part of the delay. On overflow, the next step is one tick later
+	fraction = (uint16_t)pointer->stepDelayFraction + (uint8_t)pointer->stepDelay;
+	pointer->stepDelayFraction = (uint8_t)fraction;
+	pointer->cntSinceLastStep = (fraction > 0xFF) ? 0 : 1;
+
+	if(pointer->stepGeneratorDirection & 0x01)
+	{
+		DIRPINCCW();
+		STEPPINHIGH();
+		if(pointer->mode != PID)
+		{
+			pointer->stepsSinceReset--;
+		}
+	}
+	else
+	{
+		DIRPINCW();
+		STEPPINHIGH();
+		if(pointer->mode != PID)
+		{
+			pointer->stepsSinceReset++;
+		}
+	}
+	STEPPINLOW();
+}
+
+void TIMER3_COMPA_vect(void)
+{
+	ISRPROFILEBEGIN(profileStart);
+	stepGenerator();
+	ISRPROFILEEND(ISRPROFILESTEPGENERATOR, profileStart, TIFR3 & (1 << OCF3A));
+}
+#endif
+
+void TIMER1_COMPA_vect(void)
+	{
+		ISRPROFILELATENCY(ISRPROFILEENCODERLATENCY, TCNT1);		//OCR1A is zero, so TCNT1 counts the cycles since the interrupt was due
+		ISRPROFILEBEGIN(profileStart);
+
+		// sticky reads: the AS5600 keeps pointing at ANGLE, so the register address is only sent now and then
+#if ENCODERASYNCREAD
+		if(I2C.getStatus() == I2CFREE)
+		{
+			I2C.readAsync(ENCODERADDR, ANGLE, 2, encoderData, encoderSampleReady, true);
+		}
+#else
+		sei();
+
+		if(I2C.getStatus() == I2CFREE)
+		{
+			encoderSampleReady(I2C.read(ENCODERADDR, ANGLE, 2, encoderData, true));
+		}
+#endif
+
+		ISRPROFILEEND(ISRPROFILEENCODER, profileStart, TIFR1 & (1 << OCF1A));
+	}
+}
+
+void encoderSampleReady(bool success)
+	{
+		uint16_t curAngle;
+		int16_t deltaAngle;
+		float posError = 0.0;
+#if STEPENGINE != STEPENGINEVACTUAL
+		uint32_t temp;
+#endif
+		int32_t stepCntTemp;
+		int32_t pidTargetPositionTruncated;
+		int32_t profilePosition;
+		volatile int32_t *stepsSinceResetPointer;
+		volatile int32_t *stopPositionPointer;
+		float profileSpeed;
+		float tempFloat;
+
+		if(!success)
+		{
+			return;
+		}
+
+		ISRPROFILEBEGIN(profileStart);
+		sei();
+
+		curAngle = (((uint16_t)encoderData[0]) << 8 ) | (uint16_t)encoderData[1];
+		pointer->encoder.angle = curAngle;
+		curAngle -= pointer->encoder.encoderOffset;
+
+		if(curAngle > 4095)
+		{
+			curAngle -= 61440;
+		}
+
+		deltaAngle = (int16_t)pointer->encoder.oldAngle - (int16_t)curAngle;
+
+		if(deltaAngle < -2047)
+		{
+			deltaAngle += 4096;
+		}
+
+		else if(deltaAngle > 2047)
+		{
+			deltaAngle -= 4096;
+		}
+
+		pointer->encoder.angleMoved -= deltaAngle;		//The AS5600 encoder counts in the opposite direction
+														//as the AEAT8800 (the encoder on uStepper S).
+														//Therefore it is subtracted here, so the two boards
+														//behave similar
+
+		pointer->encoder.oldAngle = curAngle;
+
+		if(pointer->mode == DROPIN)
+		{
+			cli();
+				stepCntTemp = pointer->stepCnt;
+			sei();
+
+			//		Speed filter
+			pointer->currentPidSpeed = (float)speedObserve(stepCntTemp) * (float)(ENCODERINTFREQ/65536.0);
+
+			posError = (float)stepCntTemp - ((float)pointer->encoder.angleMoved * pointer->stepConversion);
+
+			ISRPROFILEBEGIN(pidProfileStart);
+			pointer->pidDropin(posError);
+			ISRPROFILEEND(ISRPROFILEPID, pidProfileStart, ISRPROFILEPASSED(pidProfileStart, ENCODERINTCYCLEBUDGET));
+			TRACESAMPLE();
+			snapshotPublish();
+			encoderIntCheckBudget();
+			ISRPROFILEEND(ISRPROFILESAMPLE, profileStart, ISRPROFILEPASSED(profileStart, ENCODERTIMERTOP));
+			return;
+		}
+		else
+		{
+			//		Speed filter
+			pointer->encoder.speedCountsPerTick = speedObserve(pointer->encoder.angleMoved);
+			pointer->encoder.curSpeed = (float)pointer->encoder.speedCountsPerTick * (float)(ENCODERINTFREQ/65536.0) * pointer->stepConversion;
+
+			//stepGenerator speed integrator
+			pointer->currentPidSpeed += pointer->currentPidAcceleration;
+			if(pointer->direction == CW)
+			{
+				if(pointer->currentPidSpeed >= pointer->velocity)
+				{
+					pointer->currentPidSpeed = pointer->velocity;
+				}
+				else if(pointer->currentPidSpeed < 0.0)
+				{
+					pointer->currentPidSpeed = 0.0;
+				}
+			}
+			else
+			{
+				if(pointer->currentPidSpeed <= -pointer->velocity)
+				{
+					pointer->currentPidSpeed = -pointer->velocity;
+				}
+				else if(pointer->currentPidSpeed > 0.0)
+				{
+					pointer->currentPidSpeed = 0.0;
+				}
+			}
+
+
+			//S-curve filter
+			if(pointer->jerkFilterLength > 1)
+			{
+				profileSpeed = jerkFilter(pointer->currentPidSpeed);
+			}
+			else
+			{
+				profileSpeed = pointer->currentPidSpeed;
+			}
+
+			if(pointer->state == DECEL && pointer->mode != PID && pointer->continous == 0)
+			{
+				//The speed is only updated once per sample, and is not yet zero at the stop position
+				//(the S-curve filter trails the profile). Never step past the stop position before the next sample
+				tempFloat = (float)(pointer->decelToStopThreshold - pointer->stepsSinceReset) * ENCODERINTFREQ;
+				if(tempFloat < 0.0)
+				{
+					tempFloat = -tempFloat;
+				}
+
+				if(profileSpeed > tempFloat)
+				{
+					profileSpeed = tempFloat;
+				}
+				else if(profileSpeed < -tempFloat)
+				{
+					profileSpeed = -tempFloat;
+				}
+			}
+
+			//stepgenerator targetposition integrator
+			pointer->pidTargetPosition += pointer->currentPidSpeed * ENCODERINTSAMPLETIME;
+
+			if(pointer->mode == PID)
+			{
+				pidTargetPositionTruncated = (int32_t)pointer->pidTargetPosition;
+				stepsSinceResetPointer = &pidTargetPositionTruncated;
+				stopPositionPointer = &pidTargetPositionTruncated;
+			}
+			else if(pointer->jerkFilterLength > 1)
+			{
+				profilePosition = pointer->stepsSinceReset + (int32_t)jerkFilterLag;		//Position of the unfiltered profile
+				stepsSinceResetPointer = &profilePosition;
+				stopPositionPointer = &pointer->stepsSinceReset;		//Keep stepping until the filtered speed has done every step
+			}
+			else
+			{
+				stepsSinceResetPointer = &pointer->stepsSinceReset;
+				stopPositionPointer = &pointer->stepsSinceReset;
+			}
+
+			if(pointer->continous == 1)
+			{
+				pointer->targetPosition = (float)pointer->pidTargetPosition;
+			}
+			else
+			{
+				if(pointer->targetPosition < 0)
+				{
+					if(pointer->pidTargetPosition < (float)pointer->targetPosition)
+					{
+						pointer->pidTargetPosition = (float)pointer->targetPosition;
+					}
+				}
+				else
+				{
+					if(pointer->pidTargetPosition > (float)pointer->targetPosition)
+					{
+						pointer->pidTargetPosition = (float)pointer->targetPosition;
+					}
+				}
+			}
+
+			//acceleration profile generator
+			if(pointer->state == INITDECEL)
+			{
+				if(pointer->direction == CW)
+				{
+					pointer->currentPidAcceleration = pointer->acceleration * ENCODERINTSAMPLETIME;
+					if(*stepsSinceResetPointer >= pointer->decelToAccelThreshold)
+					{
+						pointer->state = ACCEL;
+					}
+				}
+				else
+				{
+					pointer->currentPidAcceleration = -(pointer->acceleration * ENCODERINTSAMPLETIME);
+					if(*stepsSinceResetPointer >= pointer->decelToAccelThreshold)
+					{
+						pointer->state = ACCEL;
+					}
+				}
+
+			}
+			else if(pointer->state == ACCEL)
+			{
 				if(pointer->direction == CCW)
 				{
-					if(*stepsSinceResetPointer <= pointer->accelToCruiseThreshold)
+					if(*stepsSinceResetPointer <= pointer->accelToCruiseThreshold)
+					{
+						pointer->state = CRUISE;
+					}
+					pointer->currentPidAcceleration = -(pointer->acceleration * ENCODERINTSAMPLETIME);
+				}
+				else
+				{
+					if(*stepsSinceResetPointer >= pointer->accelToCruiseThreshold)
 					{
 						pointer->state = CRUISE;
 					}
+					pointer->currentPidAcceleration = pointer->acceleration * ENCODERINTSAMPLETIME;
+				}
+			}
+			else if(pointer->state == CRUISE)
+			{
+				if(pointer->continous == 1)
+				{
+					pointer->state = CRUISE;
+				}
+				else
+				{
+					if(pointer->direction == CCW)
+					{
+						if(*stepsSinceResetPointer <= pointer->cruiseToDecelThreshold)
+						{
+							pointer->state = DECEL;
+						}
+					}
+					else
+					{
+						if(*stepsSinceResetPointer >= pointer->cruiseToDecelThreshold)
+						{
+							pointer->state = DECEL;
+						}
+					}
+				}
+
+				pointer->currentPidAcceleration = 0;
+
+			}
+			else if(pointer->state == DECEL)
+			{
+				if(pointer->direction == CW)
+				{
+					if(*stopPositionPointer >= pointer->decelToStopThreshold)
+					{
+						pointer->state = STOP;
+					}
 					pointer->currentPidAcceleration = -(pointer->acceleration * ENCODERINTSAMPLETIME);
 				}
 				else
 				{
-					if(*stepsSinceResetPointer >= pointer->accelToCruiseThreshold)
+					if(*stopPositionPointer <= pointer->decelToStopThreshold)
 					{
-						pointer->state = CRUISE;
+						pointer->state = STOP;
 					}
 					pointer->currentPidAcceleration = pointer->acceleration * ENCODERINTSAMPLETIME;
 				}
 			}
-			else if(pointer->state == CRUISE)
+			else if(pointer->state == STOP)
+			{
+				pointer->currentPidAcceleration = 0.0;
+				pointer->currentPidSpeed = 0.0;
+				STEPTIMERSTOP();
+				if(pointer->mode == NORMAL)
+				{
+					if(pointer->brake == BRAKEON)
+					{
+						DRIVERENABLE();
+					}
+					else
+					{
+						DRIVERDISABLE();
+					}
+				}
+
+				if(pointer->mode != PID && pointer->jerkFilterLength > 1)
+				{
+					jerkFilterReset(0.0, pointer->jerkFilterLength);		//Every step is done, drop what is left of the S-curve filter
+				}
+				if(pointer->moveQueueCount)
+				{
+					pointer->startQueuedMoves();		//Continue with the next moves in the motion queue
+				}
+			}
+
+			if(pointer->mode == PID && !pointer->pidDisabled)
+			{
+				tempFloat = (float)pointer->encoder.angleMoved * pointer->stepConversion;
+				pointer->stepsSinceReset = (int32_t)(tempFloat);
+				ISRPROFILEBEGIN(pidProfileStart);
+				pointer->pid((float)pointer->pidTargetPosition - jerkFilterLag - tempFloat);
+				ISRPROFILEEND(ISRPROFILEPID, pidProfileStart, ISRPROFILEPASSED(pidProfileStart, ENCODERINTCYCLEBUDGET));
+			}
+			if(pointer->mode == NORMAL || pointer->pidDisabled)
+			{
+#if STEPENGINE == STEPENGINEVACTUAL
+				pointer->vactualService(profileSpeed);
+#else
+				temp = stepDelayFromSpeed(profileSpeed);
+				cli();
+					pointer->stepDelay = temp;
+				sei();
+#endif
+			}
+
+			ISRPROFILEBEGIN(stallProfileStart);
+			pointer->detectStall();
+			ISRPROFILEEND(ISRPROFILESTALL, stallProfileStart, 0);
+			if(pointer->homingState != HOMINGIDLE && pointer->homingState != HOMINGDONE)
+			{
+				pointer->homingService();
+			}
+			TRACESAMPLE();
+			snapshotPublish();
+			encoderIntCheckBudget();
+			ISRPROFILEEND(ISRPROFILESAMPLE, profileStart, ISRPROFILEPASSED(profileStart, ENCODERTIMERTOP));
+		}
+	}
+
+void TIMER1_COMPB_vect(void)
+{
+	static uint8_t sampleCount = 0;
+
+	if(sampleCount < (ENCODERDIAGINTERVAL - 1))
+	{
+		sampleCount++;
+		return;
+	}
+
+	// retried in the next sample, if the bus is busy
+	if(I2C.readAsync(ENCODERADDR, pgm_read_byte(&encoderDiagRegister[encoderDiagIndex]), (encoderDiagIndex == ENCODERDIAGMAGNITUDE) ? 2 : 1, encoderDiagData, encoderDiagReady))
+	{
+		sampleCount = 0;
+	}
+}
+
+void encoderDiagReady(bool success)
+{
+	if(!success)
+	{
+		return;
+	}
+
+	pointer->encoder.storeDiagnostic(encoderDiagIndex, encoderDiagData);
+
+	if(++encoderDiagIndex == ENCODERDIAGCOUNT)
+	{
+		encoderDiagIndex = 0;
+	}
+}
+
+uStepperEncoder::uStepperEncoder(void)
+{
+	this->diagValid = 0;
+	I2C.begin();
+}
+
+float uStepperEncoder::getAngleMoved(void)
+{
+	return (float)this->angleMoved*0.087890625;
+}
+
+int32_t uStepperEncoder::getCountsMoved(void)
+{
+	int32_t counts;
+	uint8_t sreg = SREG;
+
+	cli();
+		counts = this->angleMoved;
+	SREG = sreg;
+
+	return counts;
+}
+
+int32_t uStepperEncoder::getSpeedCountsPerTick(void)
+{
+	int32_t speed;
+	uint8_t sreg = SREG;
+
+	cli();
+		speed = this->speedCountsPerTick;
+	SREG = sreg;
+
+	return speed;
+}
+
+float uStepperEncoder::getSpeed(bool unit)
+{
+	if(unit == RPM)
+	{
+		return this->curSpeed * pointer->stepsPerSecondToRPM;
+	}
+	else	//StepsPerSecond
+	{
+		return this->curSpeed;
+	}
+}
+
+void uStepperEncoder::setup()
+{
+	TCNT1 = 0;
+	ICR1 = ENCODERTIMERTOP;
+	TIFR1 = 0;
+	OCR1B = ENCODERTIMERTOP/2;		//Diagnostics are read half a period after the angle
+	TIMSK1 = (1 << OCIE1A) | (1 << OCIE1B);
+	TCCR1A = (1 << WGM11);
+	TCCR1B = (1 << WGM12) | (1 << WGM13) | (1 << CS10);
+}
+
+void uStepperEncoder::setHome(void)
+{
+	cli();
+        uint8_t data[2];
+        ENCODERINTDISABLE();
+        I2C.read(ENCODERADDR, ANGLE, 2, data);
+        ENCODERINTENABLE();
+        this->setHomeAngle((((uint16_t)data[0]) << 8 ) | (uint16_t)data[1]);
+	sei();
+}
+
+void uStepperEncoder::setHomeAngle(uint16_t rawAngle)
+{
+	uint8_t sreg = SREG;
+
+	cli();
+        this->encoderOffset = rawAngle;
+        pointer->stepsSinceReset = 0;
+        this->angle = 0;
+        this->oldAngle = 0;
+        this->angleMoved = 0;
+        pointer->pidTargetPosition = 0.0;
+        pointer->targetPosition = 0;
+        pointer->pidError = 0;
+        pointer->speedObserverRestart = 1;
+        stallDetectionReset();
+	SREG = sreg;
+}
+
+float uStepperEncoder::getAngle()
+{
+	return (float)this->angle*0.087890625;
+}
+
+void uStepperEncoder::updateDiagnostic(uint8_t index)
+{
+	uint8_t data[2];
+
+	if(this->diagValid & (1 << index))
+	{
+		return;
+	}
+
+	// not read by the encoder interrupt yet (e.g. before setup), read the register now
+	ENCODERINTDISABLE();
+	I2C.read(ENCODERADDR, pgm_read_byte(&encoderDiagRegister[index]), (index == ENCODERDIAGMAGNITUDE) ? 2 : 1, data);
+	ENCODERINTENABLE();
+
+	this->storeDiagnostic(index, data);
+}
+
+void uStepperEncoder::storeDiagnostic(uint8_t index, uint8_t *data)
+{
+	uint8_t sreg = SREG;
+
+	cli();
+		if(index == ENCODERDIAGSTATUS)
+		{
+			this->magnetStatus = data[0];
+		}
+		else if(index == ENCODERDIAGAGC)
+		{
+			this->agc = data[0];
+		}
+		else
+		{
+			this->strength = (((uint16_t)data[0]) << 8 )| (uint16_t)data[1];
+		}
+		this->diagValid |= (1 << index);
+	SREG = sreg;
+}
+
+uint16_t uStepperEncoder::getStrength()
+{
+	uint16_t data;
+	uint8_t sreg;
+
+	this->updateDiagnostic(ENCODERDIAGMAGNITUDE);
+
+	sreg = SREG;
+	cli();
+		data = this->strength;
+	SREG = sreg;
+
+	return data;
+}
+
+uint8_t uStepperEncoder::getAgc()
+{
+	this->updateDiagnostic(ENCODERDIAGAGC);
+	return this->agc;
+}
+
+uint8_t uStepperEncoder::detectMagnet()
+{
+	uint8_t data;
+	this->updateDiagnostic(ENCODERDIAGSTATUS);
+	data = this->magnetStatus;
+	data &= 0x38;					//For some reason the encoder returns random values on reserved bits. Therefore we make sure reserved bits are cleared before checking the reply !
+
+	if(data == 0x08)
+	{
+		return 1;					//magnet too strong
+	}
+
+	else if(data == 0x10)
+	{
+		return 2;					//magnet too weak
+	}
+
+	else if(data == 0x20)
+	{
+		return 0;					//magnet detected and within limits
+	}
+
+	return 3;						//Something went horribly wrong !
+}
+
+uStepperSLite::uStepperSLite(float accel, float vel)
+{
+	this->state = STOP;
+	this->encoderIntOverBudget = 0;
+	this->jerk = 0.0;
+	this->moveQueueHead = 0;
+	this->moveQueueCount = 0;
+	this->homingState = HOMINGIDLE;
+	this->homingLength = 0.0;
+	this->homingCallback = NULL;
+	this->setHomingParameters(20, 0.0, 0.0);
+	this->stallAlgorithm = STALLDETECTIIR;
+	this->stallOnlyWhileMoving = 0;
+	this->setSpeedObserver(SPEEDOBSERVER, SPEEDOBSERVERBANDWIDTH);
+
+	this->setMaxVelocity(vel);
+	this->setMaxAcceleration(accel);
+
+	pointer = this;
+
+	DIRDDR |= (1 << DIRPIN);		//set direction pin to output
+	STEPDDR |= (1 << STEPPIN);		//set step pin to output
+	ENABLEDDR |= (1 << ENABLEPIN);		//set enable pin to output
+}
+
+void uStepperSLite::setMaxAcceleration(float accel)
+{
+	int32_t start, remaining;
+
+	this->acceleration = accel;
+	this->updateJerkFilter();
+
+	if(this->state != STOP)
+	{
+		if(this->continous == 1)	//If motor was running continously
+		{
+			this->runContinous(this->direction);	//We should make it run continously again
+		}
+		else						//If motor still needs to perform some steps
+		{
+			cli();
+				start = profilePosition();
+				remaining = this->targetPosition - start;
+			sei();
+			this->moveStepsFrom(start, (this->direction == CW) ? remaining : -remaining, this->direction, this->brake);	//we should make sure the motor gets to execute the remaining steps
+		}
+	}
+}
+
+void uStepperSLite::setMaxJerk(float jerk)
+{
+	if(jerk < 0.0)
+	{
+		jerk = 0.0;
+	}
+
+	this->jerk = jerk;
+	this->updateJerkFilter();
+}
+
+void uStepperSLite::updateJerkFilter(void)
+{
+	float samples;
+	uint8_t length = 1;
+
+	if(this->jerk > 0.0)
+	{
+		samples = (this->acceleration / (this->jerk * ENCODERINTSAMPLETIME)) + 0.5;		//Ramp time a/j, in encoder samples
+
+		if(samples >= (float)JERKFILTERMAXLENGTH)
+		{
+			length = JERKFILTERMAXLENGTH;
+		}
+		else if(samples >= 1.0)
+		{
+			length = (uint8_t)samples;
+		}
+	}
+
+	cli();
+		this->jerkFilterLength = length;
+		this->jerkFilterGain = 1.0 / (float)length;
+		jerkFilterReset(this->currentPidSpeed, length);
+	sei();
+}
+
+void uStepperSLite::setMaxVelocity(float vel)
+{
+	int32_t start, remaining;
+
+	if(vel < 0.5005)
+	{
+		this->velocity = 0.5005;			//Limit velocity in order to not overflow delay variable
+
+	}
+
+	else if(vel > 100000.0)
+	{
+		this->velocity = 100000.0;			//limit velocity in order to not underflow delay variable
+	}
+
+	else
+	{
+		this->velocity = vel;
+	}
+
+	if(this->state != STOP)		//If motor was running, we should make sure it runs again
+	{
+		if(this->continous == 1)	//If motor was running continously
+		{
+			this->runContinous(this->direction);	//We should make it run continously again
+		}
+		else					//If motor still needs to perform some steps
+		{
+			cli();
+				start = profilePosition();
+				remaining = this->targetPosition - start;
+			sei();
+			this->moveStepsFrom(start, (this->direction == CW) ? remaining : -remaining, this->direction, this->brake);	//we should make sure the motor gets to execute the remaining steps
+		}
+	}
+}
+
+void uStepperSLite::runContinous(bool dir)
+{
+	float curVel, startVelocity = 0;
+	uint8_t tempState;
+	uint32_t accelSteps;
+	uint32_t initialDecelSteps;
+
+	if(this->mode == DROPIN)
+	{
+		return;		//Drop in feature is activated. just return since this function makes no sense with drop in activated!
+	}
+
+	curVel = this->currentPidSpeed;
+
+	if(this->state == STOP)											//If motor is currently running at desired speed
+	{
+		initialDecelSteps = 0;
+		tempState = ACCEL;						//We should just run at cruise speed
+		startVelocity = 0.0;//sqrt(2.0*this->acceleration);	//number of interrupts before the first step should be performed.
+		accelSteps = (uint32_t)((this->velocity * this->velocity)/(2.0*this->acceleration));	//Number of steps to bring the motor to max speed (S = (V^2 - V0^2)/(2*a)))
+
+	}
+	else if((dir == CW && curVel < 0) || (dir == CCW && curVel > 0))									//If motor turns CCW and should turn CW, or if motor turns CW and shoúld turn CCW
+	{
+		tempState = INITDECEL;									//We should decelerate the motor to full stop
+		initialDecelSteps = (uint32_t)((curVel*curVel)/(2.0*this->acceleration));		//the amount of steps needed to bring the motor to full stop. (S = (V^2 - V0^2)/(2*-a)))
+		accelSteps = (uint32_t)((this->velocity * this->velocity)/(2.0*this->acceleration));									//Number of steps to bring the motor to max speed (S = (V^2 - V0^2)/(2*a)))
+
+		startVelocity = curVel;//sqrt((curVel*curVel) + 2.0*this->acceleration);	//number of interrupts before the first step should be performed.
+	}
+	else if((dir == CW && curVel > 0) || (dir == CCW && curVel < 0))												//If the motor is currently rotating the same direction as the desired direction
+	{
+		if(abs(curVel) > this->velocity)						//If current velocity is greater than desired velocity
+		{
+			tempState = INITDECEL;						//We need to decelerate the motor to desired velocity
+			initialDecelSteps = (uint32_t)(((this->velocity*this->velocity) - (curVel*curVel))/(-2.0*this->acceleration));		//Number of steps to bring the motor down from current speed to max speed (S = (V^2 - V0^2)/(2*-a)))
+			accelSteps = 0;						//No acceleration phase is needed
+		}
+
+		else if(abs(curVel) < this->velocity)					//If the current velocity is less than the desired velocity
+		{
+			tempState = ACCEL;							//Start accelerating
+			accelSteps = (uint32_t)(((this->velocity*this->velocity) - (curVel*curVel))/(2.0*this->acceleration));	//Number of Steps needed to accelerate from current velocity to full speed
+			initialDecelSteps = 0;
+		}
+
+		else 											//If motor is currently running at desired speed
+		{
+			initialDecelSteps = 0;
+			tempState = CRUISE;						//We should just run at cruise speed
+			accelSteps = 0;						//No acceleration phase is needed
+		}
+	}
+	else
+	{
+		initialDecelSteps = 0;
+		tempState = ACCEL;						//We should just run at cruise speed
+		startVelocity = 0.0;//sqrt(2.0*this->acceleration);	//number of interrupts before the first step should be performed.
+		accelSteps = (uint32_t)((this->velocity * this->velocity)/(2.0*this->acceleration));	//Number of steps to bring the motor to max speed (S = (V^2 - V0^2)/(2*a)))
+	}
+	cli();
+		this->direction = dir;
+		this->stepGeneratorDirection = dir;
+
+		this->continous = 1;
+
+		if(dir == CW)
+		{
+			this->decelToAccelThreshold = this->targetPosition + initialDecelSteps;
+			this->accelToCruiseThreshold = this->decelToAccelThreshold + accelSteps;
+			DIRPINCW();
+		}
+		else
+		{
+			this->decelToAccelThreshold = this->targetPosition - initialDecelSteps;
+			this->accelToCruiseThreshold = this->decelToAccelThreshold - accelSteps;
+			DIRPINCCW();
+		}
+		this->currentPidSpeed = startVelocity;
+		pointer->stepDelay = stepDelayFromSpeed(pointer->currentPidSpeed);
+		this->state = tempState;
+	sei();
+
+	DRIVERENABLE();
+	STEPTIMERSTART();
+}
+
+void uStepperSLite::moveSteps(int32_t steps, bool dir, bool holdMode)
+{
+	int32_t start;
+
+	cli();
+		start = this->targetPosition;		//A move in the running direction is added to the end of the running move
+		if(this->state != STOP && this->direction != dir)
+		{
+			start = profilePosition();		//Turning around, the move starts where the motor stops
+		}
+	sei();
+
+	this->moveStepsFrom(start, steps, dir, holdMode);
+}
+
+void uStepperSLite::moveStepsFrom(int32_t start, int32_t steps, bool dir, bool holdMode)
+{
+	float curVel, startVelocity = 0, tempFloat;
+	uint8_t state;
+	uint32_t totalSteps;
+	uint32_t accelSteps;
+	uint32_t decelSteps;
+	uint32_t initialDecelSteps;
+	uint32_t cruiseSteps = 0;
+
+	if(this->mode == DROPIN)
+	{
+		return;		//Drop in feature is activated. just return since this function makes no sense with drop in activated!
+	}
+
+	if(steps < 1)
+	{
+		return;
+	}
+	totalSteps = steps;
+	cli();
+		curVel = this->currentPidSpeed;
+	sei();
+	initialDecelSteps = 0;
+
+	if(this->state == STOP || (dir == CW && curVel < 0) || (dir == CCW && curVel > 0))	//If motor is currently at full stop (state = STOP), or turns the other way
+	{
+		//The profile generator limits the speed to the new direction, which stops a motor turning the other way at once.
+		//Both start from standstill at the current position
+		state = ACCEL;
+		accelSteps = (uint32_t)((this->velocity * this->velocity)/(2.0*this->acceleration));	//Number of steps to bring the motor to max speed (S = (V^2 - V0^2)/(2*a)))
+				//No initial deceleration phase needed
+
+		if(accelSteps > (totalSteps >> 1))	//If we need to accelerate for longer than half of the total steps, we need to start decelerating before we reach max speed
+		{
+			cruiseSteps = 0; 		//No cruise phase needed
+			accelSteps = decelSteps = (totalSteps >> 1);				//Accelerate and decelerate for the same amount of steps (half the total steps)
+			accelSteps += totalSteps - accelSteps - decelSteps;	//if there are still a step left to perform, due to rounding errors, do this step as an acceleration step
+		}
+
+		else
+		{
+			decelSteps = accelSteps;	//If top speed is reached before half the total steps are performed, deceleration period should be same length as acceleration period
+			cruiseSteps = totalSteps - accelSteps - decelSteps;	//Perform remaining steps as cruise steps
+		}
+		startVelocity = 0.0;//sqrt(2.0*this->acceleration);	//number of interrupts before the first step should be performed.
+	}
+	else if((dir == CW && curVel > 0) || (dir == CCW && curVel < 0))							//If the motor is currently rotating the same direction as desired, we dont necessarily need to decelerate
+	{
+		startVelocity = curVel;		//The new profile continues from the current speed
+		if(abs(curVel) > this->velocity)	//If current velocity is greater than desired velocity
+		{
+			state = INITDECEL;	//We need to decelerate the motor to desired velocity
+			initialDecelSteps = (uint32_t)(((this->velocity*this->velocity) - (curVel*curVel))/(-2.0*this->acceleration));		//Number of steps to bring the motor down from current speed to max speed (S = (V^2 - V0^2)/(2*-a)))
+			accelSteps = 0;	//No acceleration phase is needed
+			decelSteps = (uint32_t)((this->velocity*this->velocity)/(2.0*this->acceleration));	//Number of steps needed to decelerate the motor from top speed to full stop
+
+			if(totalSteps <= (initialDecelSteps + decelSteps))
+			{
+				cruiseSteps = 0;
+			}
+			else
 			{
-				if(pointer->continous == 1)
-				{
-					pointer->state = CRUISE;
-				}
-				else
-				{
-					if(pointer->direction == CCW)
-					{
-						if(*stepsSinceResetPointer <= pointer->cruiseToDecelThreshold)
-						{
-							pointer->state = DECEL;
-						}
-					}
-					else
-					{
-						if(*stepsSinceResetPointer >= pointer->cruiseToDecelThreshold)
-						{
-							pointer->state = DECEL;
-						}
-					}
-				}
+				cruiseSteps = totalSteps - initialDecelSteps - decelSteps;					//Perform remaining steps as cruise steps
+			}
+		}
 
-				pointer->currentPidAcceleration = 0;
+		else if(abs(curVel) < this->velocity)	//If current velocity is less than desired velocity
+		{
 
+			state = ACCEL;			//Start accelerating
+			accelSteps = (int32_t)((((this->velocity*this->velocity) - curVel*curVel))/(2.0*this->acceleration));	//Number of Steps needed to accelerate from current velocity to full speed
+			decelSteps = (uint32_t)((this->velocity*this->velocity)/(2.0*this->acceleration));	//Number of steps needed to decelerate the motor from top speed to full stop
+
+			if((accelSteps + decelSteps) > totalSteps)			//If top speed can not be reached, we need to start decelerating before we reach max speed
+			{
+				tempFloat = (totalSteps*0.5) - ((curVel*curVel)/(4.0*this->acceleration));	//Accelerate to the speed V, where (V^2 - V0^2)/(2*a) + V^2/(2*a) = totalSteps
+				accelSteps = (tempFloat > 0.0) ? (uint32_t)tempFloat : 0;
+				decelSteps = totalSteps - accelSteps;			//Use the rest of the steps to decelerate
+				cruiseSteps = 0;
 			}
-			else if(pointer->state == DECEL)
+			else
 			{
-				if(pointer->direction == CW)
-				{
-					if(*stepsSinceResetPointer >= pointer->decelToStopThreshold)
-					{
-						pointer->state = STOP;
-					}
-					pointer->currentPidAcceleration = -(pointer->acceleration * ENCODERINTSAMPLETIME);
-				}
-				else
-				{
-					if(*stepsSinceResetPointer <= pointer->decelToStopThreshold)
-					{
-						pointer->state = STOP;
-					}
-					pointer->currentPidAcceleration = pointer->acceleration * ENCODERINTSAMPLETIME;
-				}
+				cruiseSteps = totalSteps - accelSteps - decelSteps;	//Perform remaining steps as cruise steps
+			}
+
+			initialDecelSteps = 0;								//No initial deceleration phase needed
+		}
+
+		else						//If current velocity is equal to desired velocity
+		{
+
+			state = CRUISE;	//We are already at desired speed, therefore we start at cruise phase
+			decelSteps = (int32_t)((this->velocity*this->velocity)/(2.0*this->acceleration));	//Number of steps needed to decelerate the motor from top speed to full stop
+			accelSteps = 0;	//No acceleration phase needed
+			initialDecelSteps = 0;		//No initial deceleration phase needed
+
+			if(decelSteps >= totalSteps)
+			{
+				cruiseSteps = 0;
+				decelSteps = totalSteps;
 			}
-			else if(pointer->state == STOP)
+			else
 			{
-				pointer->currentPidAcceleration = 0.0;
-				pointer->currentPidSpeed = 0.0;
-				TCCR3B &= ~(1 << CS30);
-				if(pointer->mode == NORMAL)
-				{
-					if(pointer->brake == BRAKEON)
-					{
-						PORTD &= ~(1 << 4);
-					}
-					else
-					{
-						PORTD |= (1 << 4);
-					}
-				}
+				cruiseSteps = totalSteps - decelSteps;	//Perform remaining steps as cruise steps
 			}
+		}
+	}
+	else
+	{
+		state = ACCEL;
+		accelSteps = (uint32_t)((this->velocity * this->velocity)/(2.0*this->acceleration));	//Number of steps to bring the motor to max speed (S = (V^2 - V0^2)/(2*a)))
+				//No initial deceleration phase needed
 
-			if(pointer->mode == PID && !pointer->pidDisabled)
+		if(accelSteps > (totalSteps >> 1))	//If we need to accelerate for longer than half of the total steps, we need to start decelerating before we reach max speed
+		{
+			cruiseSteps = 0; 		//No cruise phase needed
+			accelSteps = decelSteps = (totalSteps >> 1);				//Accelerate and decelerate for the same amount of steps (half the total steps)
+			accelSteps += totalSteps - accelSteps - decelSteps;	//if there are still a step left to perform, due to rounding errors, do this step as an acceleration step
+		}
+
+		else
+		{
+			decelSteps = accelSteps;	//If top speed is reached before half the total steps are performed, deceleration period should be same length as acceleration period
+			cruiseSteps = totalSteps - accelSteps - decelSteps;	//Perform remaining steps as cruise steps
+		}
+		startVelocity = 0.0;
+	}
+	cli();
+		this->direction = dir;
+		this->stepGeneratorDirection = dir;
+
+		this->continous = 0;
+
+		if(dir == CW)
+		{
+			this->decelToAccelThreshold = start + initialDecelSteps;
+			this->accelToCruiseThreshold = this->decelToAccelThreshold + accelSteps;
+			this->cruiseToDecelThreshold = this->accelToCruiseThreshold + cruiseSteps;
+			this->decelToStopThreshold = this->cruiseToDecelThreshold + decelSteps;
+			DIRPINCW();
+		}
+		else
+		{
+			this->decelToAccelThreshold = start - initialDecelSteps;
+			this->accelToCruiseThreshold = this->decelToAccelThreshold - accelSteps;
+			this->cruiseToDecelThreshold = this->accelToCruiseThreshold - cruiseSteps;
+			this->decelToStopThreshold = this->cruiseToDecelThreshold - decelSteps;
+			DIRPINCCW();
+		}
+		this->currentPidSpeed = startVelocity;
+		pointer->stepDelay = stepDelayFromSpeed(pointer->currentPidSpeed);
+		this->state = state;
+		this->targetPosition = this->decelToStopThreshold;
+		this->brake = holdMode;
+	sei();
+
+	DRIVERENABLE();
+	STEPTIMERSTART();
+}
+
+void uStepperSLite::hardStop(bool holdMode)
+{
+	this->stop(holdMode);
+}
+
+void uStepperSLite::stop(bool brake)
+{
+	if(this->mode == DROPIN)
+	{
+		return;		//Drop in feature is activated. just return since this function makes no sense with drop in activated!
+	}
+
+
+	STEPTIMERSTOP();
+	pointer->driver.setVelocity(0);
+	cli();
+		this->moveQueueCount = 0;
+		jerkFilterReset(0.0, this->jerkFilterLength);
+		stallDetectionReset();
+	sei();
+	this->targetPosition = this->stepsSinceReset;
+	pointer->cruiseToDecelThreshold = this->targetPosition;
+	this->brake = brake;
+	this->stall = 0;
+	this->state = STOP;			//Set current state to STOP
+	this->continous = 0;
+	if(brake == BRAKEOFF)
+	{
+		this->disableMotor();
+	}
+
+	else if (brake == BRAKEON)
+	{
+		this->enableMotor();
+	}
+
+}
+
+void uStepperSLite::softStop(bool holdMode)
+{
+	this->stop(holdMode);
+}
+
+void uStepperSLite::checkConnectorOrientation(uint8_t mode)
+{
+	uint8_t data[2], i;
+	uint16_t angle;
+	int16_t angleDiff[3];
+
+	I2C.read(ENCODERADDR, ANGLE, 2, data);
+	angle = (((uint16_t)data[0]) << 8 ) | (uint16_t)data[1];
+
+	DIRPINCCW();
+
+	for(i = 0; i < 50; i++)
+	{
+		STEPPINHIGH();
+		delayMicroseconds(1);
+		STEPPINLOW();
+		_delay_ms(10);
+	}
+
+	angleDiff[0] = (int16_t)angle;
+
+	I2C.read(ENCODERADDR, ANGLE, 2, data);
+	angle = (((uint16_t)data[0]) << 8 ) | (uint16_t)data[1];
+
+	angleDiff[0] -= (int16_t)angle;
+
+	DIRPINCW();
+
+	for(i = 0; i < 50; i++)
+	{
+		STEPPINHIGH();
+		delayMicroseconds(1);
+		STEPPINLOW();
+		_delay_ms(10);
+	}
+
+	angleDiff[1] = (int16_t)angle;
+
+	I2C.read(ENCODERADDR, ANGLE, 2, data);
+	angle = (((uint16_t)data[0]) << 8 ) | (uint16_t)data[1];
+
+	angleDiff[1] -= (int16_t)angle;
+
+	for(i = 0; i < 2; i++)
+	{
+		if(angleDiff[i] > 2048)
+		{
+			angleDiff[i] -= 4096;
+		}
+		else if(angleDiff[i] < -2048)
+		{
+			angleDiff[i] += 4096;
+		}
+	}
+
+	if((angleDiff[0] > 2 && angleDiff[1] < -2))
+	{
+		if(mode == DROPIN)
+		{
+			this->driver.invertDirection();
+		}
+	}
+	else
+	{
+		if(mode != DROPIN)
+		{
+			this->driver.invertDirection();
+		}
+	}
+}
+
+void uStepperSLite::setup(	uint8_t mode, 
+				float stepsPerRevolution, 
+				float pTerm, 
+				float iTerm, 
+				float dTerm,
+				bool setHome,
+				uint8_t invert,
+				uint8_t runCurrent,
+				uint8_t holdCurrent)
+{
+	dropinCliSettings_t tempSettings;
+
+	p = &(this->stepsSinceReset);
+	this->pidDisabled = 1;
+	this->mode = mode;
+	this->encoder.setup();
+
+	this->state = STOP;
+	this->driver.setup();
+	this->driver.enableDriver();
+	_delay_ms(200);
+
+	if((uint16_t)stepsPerRevolution == FULL)
+	{
+		stepsPerRevolution = 200.0;
+	}
+	else if((uint16_t)stepsPerRevolution == HALF)
+	{
+		stepsPerRevolution = 400.0;
+	}
+	else if((uint16_t)stepsPerRevolution == QUARTER)
+	{
+		stepsPerRevolution = 800.0;
+	}
+	else if((uint16_t)stepsPerRevolution == EIGHT)
+	{
+		stepsPerRevolution = 1600.0;
+	}
+	else if((uint16_t)stepsPerRevolution == SIXTEEN)
+	{
+		stepsPerRevolution = 3200.0;
+	}
+
+	this->stepConversion = (float)(stepsPerRevolution)/4096.0;	//Calculate conversion coefficient from raw encoder data, to actual moved steps
+	this->angleToStep = ((float)(stepsPerRevolution))/360.0;	//Calculate conversion coefficient from angle to corresponding number of steps
+	this->stepToAngle = 360.0/((float)(stepsPerRevolution));	//Calculate conversion coefficient from steps to corresponding angle
+	this->stepsPerSecondToRPM = 60.0/stepsPerRevolution;
+	this->RPMToStepsPerSecond = stepsPerRevolution/60.0;
+	this->RPMToStepDelay = STEPGENERATORFREQUENCY/this->RPMToStepsPerSecond;
+	this->updateStallDetection();
+	this->encoder.setHome();
+
+	if(this->mode)
+	{
+		if(this->mode == DROPIN)
+		{
+			//Set Enable, Step and Dir signal pins from 3dPrinter controller as inputs
+			pinMode(2,INPUT);
+			pinMode(3,INPUT);
+			pinMode(4,INPUT);
+			//Enable internal pull-up resistors on the above pins
+			digitalWrite(2,HIGH);
+			digitalWrite(3,HIGH);
+			digitalWrite(4,HIGH);
+			EICRA = 0x06;
+			EIMSK = 0x03;
+
+			Serial.begin(DROPINBAUDRATE);
+
+			tempSettings.P.f = pTerm;
+			tempSettings.I.f = iTerm;
+			tempSettings.D.f = dTerm;
+			tempSettings.invert = invert;
+			tempSettings.runCurrent = runCurrent;
+			tempSettings.holdCurrent = holdCurrent;
+			tempSettings.checksum = this->dropinSettingsCalcChecksum(&tempSettings);
+
+			if(tempSettings.checksum != EEPROM.read(sizeof(dropinCliSettings_t)))
 			{
-				tempFloat = (float)pointer->encoder.angleMoved * pointer->stepConversion;
-				pointer->stepsSinceReset = (int32_t)(tempFloat);
-				pointer->pid((float)pointer->pidTargetPosition - tempFloat);
+				this->dropinSettings = tempSettings;
+				this->saveDropinSettings();
+				EEPROM.put(sizeof(dropinCliSettings_t),this->dropinSettings.checksum);
+				this->loadDropinSettings();
 			}
-			if(pointer->mode == NORMAL || pointer->pidDisabled)
-			{
-				if(pointer->currentPidSpeed > 5.0)
-				{
-					temp = (uint32_t)((STEPGENERATORFREQUENCY/(pointer->currentPidSpeed)) + 0.5);
-					cli();
-						pointer->stepDelay = temp;
-					sei();
-				}
-				else if(pointer->currentPidSpeed < -5.0)
-				{
-					temp = (uint32_t)((STEPGENERATORFREQUENCY/(-pointer->currentPidSpeed)) + 0.5);
-					cli();
-						pointer->stepDelay = temp;
-					sei();
-				}
-				else
+			else
+			{
+				if(!this->loadDropinSettings())
 				{
-					cli();
-						pointer->stepDelay = 20000;
-					sei();
+					this->dropinSettings = tempSettings;
+					this->saveDropinSettings();
+					EEPROM.put(sizeof(dropinCliSettings_t),this->dropinSettings.checksum);
+					this->loadDropinSettings();
 				}
 			}
-
-			pointer->detectStall();
+			delay(10000);
+  			this->dropinPrintHelp();
+		}
+		else
+		{
+			//Scale supplied controller coefficents. This is done to enable the user to use easier to manage numbers for these coefficients.
+		    this->pTerm = pTerm;
+			this->iTerm = iTerm * ENCODERINTSAMPLETIME;
+		    this->dTerm = dTerm * ENCODERINTFREQ;
 		}
 	}
-}
-
-uStepperEncoder::uStepperEncoder(void)
-{
-	I2C.begin();
-}
 
-float uStepperEncoder::getAngleMoved(void)
-{
-	return (float)this->angleMoved*0.087890625;
-}
+	this->checkConnectorOrientation(mode);
+	this->encoder.setHome();
 
-float uStepperEncoder::getSpeed(bool unit)
-{
-	if(unit == RPM)
-	{
-		return this->curSpeed * pointer->stepsPerSecondToRPM;
-	}
-	else	//StepsPerSecond
-	{
-		return this->curSpeed;
-	}
+	this->pidDisabled = 0;
+#if ISRPROFILING
+	TCCR4A = 0;
+	TCCR4B = (1 << CS40);		//Timer four running freely at F_CPU, used as timestamp by the ISR profiling
+	this->resetIsrProfile();
+#endif
+#if STEPENGINE == STEPENGINECOMPARE
+	TCNT3 = 0;
+	OCR3A = STEPENGINECOUNTSPERTICK;		//Timer three free running, compare interrupt set to the next step
+	TIFR3 = 0;
+	TIMSK3 = (1 << OCIE3A);
+	TCCR3A = 0;
+	TCCR3B = 0;
+#elif STEPENGINE == STEPENGINEVACTUAL
+	TIMSK3 = 0;
+	TCCR3A = 0;
+	TCCR3B = 0;		//Timer three not used, the driver runs from VACTUAL
+	this->vactualFraction = 0.0;
+#else
+	TCNT3 = 0;
+	ICR3 = 159;
+	TIFR3 = 0;
+	TIMSK3 = (1 << OCIE3A);
+	TCCR3A = (1 << WGM31);
+	TCCR3B = (1 << WGM32) | (1 << WGM33);
+#endif
+	sei();
 }
 
-void uStepperEncoder::setup()
+void uStepperSLite::enableMotor(void)
 {
-	TCNT1 = 0;
-	ICR1 = 32000;
-	TIFR1 = 0;
-	TIMSK1 = (1 << OCIE1A);
-	TCCR1A = (1 << WGM11);
-	TCCR1B = (1 << WGM12) | (1 << WGM13) | (1 << CS10);
+	this->driver.enableDriver();				//Enable motor driver
 }
 
-void uStepperEncoder::setHome(void)
+void uStepperSLite::disableMotor(void)
 {
-	cli();
-        uint8_t data[2];
-        TIMSK1 &= ~(1 << OCIE1A);
-        I2C.read(ENCODERADDR, ANGLE, 2, data);
-        TIMSK1 |= (1 << OCIE1A);
-        this->encoderOffset = (((uint16_t)data[0]) << 8 ) | (uint16_t)data[1];
-        pointer->stepsSinceReset = 0;
-        this->angle = 0;
-        this->oldAngle = 0;
-        this->angleMoved = 0;
-        pointer->pidTargetPosition = 0.0;
-        pointer->targetPosition = 0;
-        pointer->pidError = 0;
-	sei();
+	this->driver.disableDriver();			//Disable motor driver
 }
 
-float uStepperEncoder::getAngle()
+bool uStepperSLite::getCurrentDirection(void)
 {
-	return (float)this->angle*0.087890625;
+	return this->direction;
 }
 
-uint16_t uStepperEncoder::getStrength()
+uint8_t uStepperSLite::getMotorState(void)
 {
-	uint8_t data[2];
-
-	TIMSK1 &= ~(1 << OCIE1A);
-	I2C.read(ENCODERADDR, MAGNITUDE, 2, data);
-	TIMSK1 |= (1 << OCIE1A);
+	if(this->state != STOP)
+	{
+		return this->state;		//Motor running
+	}
 
-	return (((uint16_t)data[0]) << 8 )| (uint16_t)data[1];
+	return 0;			//Motor not running
 }
 
-uint8_t uStepperEncoder::getAgc()
+int32_t uStepperSLite::getStepsSinceReset(void)
 {
-	uint8_t data;
-	TIMSK1 &= ~(1 << OCIE1A);
-	I2C.read(ENCODERADDR, AGC, 1, &data);
-	TIMSK1 |= (1 << OCIE1A);
-	return data;
+	return this->stepsSinceReset;
 }
 
-uint8_t uStepperEncoder::detectMagnet()
+void uStepperSLite::getSnapshot(motionSnapshot_t *snapshot)
 {
-	uint8_t data;
-	TIMSK1 &= ~(1 << OCIE1A);
-	I2C.read(ENCODERADDR, STATUS, 1, &data);
-	TIMSK1 |= (1 << OCIE1A);
-	data &= 0x38;					//For some reason the encoder returns random values on reserved bits. Therefore we make sure reserved bits are cleared before checking the reply !
-
-	if(data == 0x08)
-	{
-		return 1;					//magnet too strong
-	}
-
-	else if(data == 0x10)
-	{
-		return 2;					//magnet too weak
-	}
+	uint8_t published;
 
-	else if(data == 0x20)
+	do
 	{
-		return 0;					//magnet detected and within limits
+		published = snapshotPublished;
+		SNAPSHOTBARRIER();
+		*snapshot = snapshotBuffer[published & 1];
+		SNAPSHOTBARRIER();
 	}
-
-	return 3;						//Something went horribly wrong !
+	while(published != snapshotPublished);		//Published twice while copying, the buffer may have been overwritten
 }
 
-uStepperSLite::uStepperSLite(float accel, float vel)
+void uStepperSLite::setCurrent(uint8_t runCurrent, uint8_t holdCurrent)
 {
-	this->state = STOP;
-
-	this->setMaxVelocity(vel);
-	this->setMaxAcceleration(accel);
+	this->driver.setCurrent(runCurrent, holdCurrent);
+}
 
-	pointer = this;
+void uStepperSLite::setHoldCurrent(uint8_t holdCurrent)
+{
+	this->driver.setHoldCurrent(holdCurrent);
+}
 
-	DDRB |= (1 << 2);		//set direction pin to output
-	DDRD |= (1 << 7);		//set step pin to output
-	DDRD |= (1 << 4);		//set enable pin to output
+void uStepperSLite::setRunCurrent(uint8_t runCurrent)
+{
+	this->driver.setRunCurrent(runCurrent);
 }
 
-void uStepperSLite::setMaxAcceleration(float accel)
+float uStepperSLite::moveToEnd(bool dir, float stallSensitivity)
 {
-	this->acceleration = accel;
+	if(!this->beginHoming(dir, stallSensitivity, 20, 0.0, 0.0, NULL))
+	{
+		return 0.0;		//Doesn't make sense in dropin mode
+	}
 
-	if(this->state != STOP)
+	while(this->homingState != HOMINGDONE)
 	{
-		if(this->continous == 1)	//If motor was running continously
-		{
-			this->runContinous(this->direction);	//We should make it run continously again
-		}
-		else						//If motor still needs to perform some steps
+		if(this->homingState == HOMINGIDLE)
 		{
-			this->moveSteps(this->targetPosition - this->stepsSinceReset + 1, this->direction, this->brake);	//we should make sure the motor gets to execute the remaining steps
+			return 0.0;		//Aborted
 		}
 	}
+
+	return this->homingLength;
 }
 
-void uStepperSLite::setMaxVelocity(float vel)
+/**
+ * @brief      Limits a homing speed to the range accepted by setMaxVelocity(), keeping 0.0 as "not used"
+ */
+static float homingVelocityLimit(float vel)
 {
-
-	if(vel < 0.5005)
+	if(vel <= 0.0)
 	{
-		this->velocity = 0.5005;			//Limit velocity in order to not overflow delay variable
-
+		return 0.0;
 	}
-
-	else if(vel > 100000.0)
+	else if(vel < 0.5005)
 	{
-		this->velocity = 100000.0;			//limit velocity in order to not underflow delay variable
+		return 0.5005;
 	}
-
-	else
+	else if(vel > 100000.0)
 	{
-		this->velocity = vel;
+		return 100000.0;
 	}
 
-	if(this->state != STOP)		//If motor was running, we should make sure it runs again
-	{
-		if(this->continous == 1)	//If motor was running continously
-		{
-			this->runContinous(this->direction);	//We should make it run continously again
-		}
-		else					//If motor still needs to perform some steps
-		{
-			this->moveSteps(this->targetPosition - this->stepsSinceReset + 1, this->direction, this->brake);	//we should make sure the motor gets to execute the remaining steps
-		}
-	}
+	return vel;
 }
 
-void uStepperSLite::runContinous(bool dir)
+void uStepperSLite::setHomingParameters(int32_t backOffSteps, float fastVelocity, float slowVelocity)
 {
-	float curVel, startVelocity = 0;
-	uint8_t tempState;
-	uint32_t accelSteps;
-	uint32_t initialDecelSteps;
-
-	if(this->mode == DROPIN)
+	if(backOffSteps < 1)
 	{
-		return;		//Drop in feature is activated. just return since this function makes no sense with drop in activated!
+		backOffSteps = 1;
 	}
 
-	curVel = this->currentPidSpeed;
-
-	if(this->state == STOP)											//If motor is currently running at desired speed
-	{
-		initialDecelSteps = 0;
-		tempState = ACCEL;						//We should just run at cruise speed
-		startVelocity = 0.0;//sqrt(2.0*this->acceleration);	//number of interrupts before the first step should be performed.
-		accelSteps = (uint32_t)((this->velocity * this->velocity)/(2.0*this->acceleration));	//Number of steps to bring the motor to max speed (S = (V^2 - V0^2)/(2*a)))
+	this->homingBackOff = backOffSteps;
+	this->homingFastVelocity = homingVelocityLimit(fastVelocity);
+	this->homingSlowVelocity = homingVelocityLimit(slowVelocity);
+}
 
-	}
-	else if((dir == CW && curVel < 0) || (dir == CCW && curVel > 0))									//If motor turns CCW and should turn CW, or if motor turns CW and shoúld turn CCW
-	{
-		tempState = INITDECEL;									//We should decelerate the motor to full stop
-		initialDecelSteps = (uint32_t)((curVel*curVel)/(2.0*this->acceleration));		//the amount of steps needed to bring the motor to full stop. (S = (V^2 - V0^2)/(2*-a)))
-		accelSteps = (uint32_t)((this->velocity * this->velocity)/(2.0*this->acceleration));									//Number of steps to bring the motor to max speed (S = (V^2 - V0^2)/(2*a)))
+bool uStepperSLite::startHoming(bool dir, float stallSensitivity, homingCallback_t callback)
+{
+	return this->beginHoming(dir, stallSensitivity, this->homingBackOff, this->homingFastVelocity, this->homingSlowVelocity, callback);
+}
 
-		startVelocity = curVel;//sqrt((curVel*curVel) + 2.0*this->acceleration);	//number of interrupts before the first step should be performed.
-	}
-	else if((dir == CW && curVel > 0) || (dir == CCW && curVel < 0))												//If the motor is currently rotating the same direction as the desired direction
-	{
-		if(abs(curVel) > this->velocity)						//If current velocity is greater than desired velocity
-		{
-			tempState = INITDECEL;						//We need to decelerate the motor to desired velocity
-			initialDecelSteps = (uint32_t)(((this->velocity*this->velocity) - (curVel*curVel))/(-2.0*this->acceleration));		//Number of steps to bring the motor down from current speed to max speed (S = (V^2 - V0^2)/(2*-a)))
-			accelSteps = 0;						//No acceleration phase is needed
-		}
+uint8_t uStepperSLite::getHomingState(void)
+{
+	return this->homingState;
+}
 
-		else if(abs(curVel) < this->velocity)					//If the current velocity is less than the desired velocity
-		{
-			tempState = ACCEL;							//Start accelerating
-			accelSteps = (uint32_t)(((this->velocity*this->velocity) - (curVel*curVel))/(2.0*this->acceleration));	//Number of Steps needed to accelerate from current velocity to full speed
-			initialDecelSteps = 0;
-		}
+float uStepperSLite::getHomingLength(void)
+{
+	float temp;
 
-		else 											//If motor is currently running at desired speed
-		{
-			initialDecelSteps = 0;
-			tempState = CRUISE;						//We should just run at cruise speed
-			accelSteps = 0;						//No acceleration phase is needed
-		}
-	}
-	else
-	{
-		initialDecelSteps = 0;
-		tempState = ACCEL;						//We should just run at cruise speed
-		startVelocity = 0.0;//sqrt(2.0*this->acceleration);	//number of interrupts before the first step should be performed.
-		accelSteps = (uint32_t)((this->velocity * this->velocity)/(2.0*this->acceleration));	//Number of steps to bring the motor to max speed (S = (V^2 - V0^2)/(2*a)))
-	}
 	cli();
-		this->direction = dir;
-		this->stepGeneratorDirection = dir;
+		temp = this->homingLength;
+	sei();
 
-		this->continous = 1;
+	return temp;
+}
 
-		if(dir == CW)
-		{
-			this->decelToAccelThreshold = this->targetPosition + initialDecelSteps;
-			this->accelToCruiseThreshold = this->decelToAccelThreshold + accelSteps;
-			PORTB |= (1 << 2);
-		}
-		else
-		{
-			this->decelToAccelThreshold = this->targetPosition - initialDecelSteps;
-			this->accelToCruiseThreshold = this->decelToAccelThreshold - accelSteps;
-			PORTB &= ~(1 << 2);
-		}
-		this->currentPidSpeed = startVelocity;
-		if(pointer->currentPidSpeed > 5.0)
-		{
-			pointer->stepDelay = (uint32_t)((STEPGENERATORFREQUENCY/(pointer->currentPidSpeed)) + 0.5);
-		}
-		else if(pointer->currentPidSpeed < -5.0)
-		{
-			pointer->stepDelay = (uint32_t)((STEPGENERATORFREQUENCY/(-pointer->currentPidSpeed)) + 0.5);
-		}
-		else
+void uStepperSLite::abortHoming(void)
+{
+	cli();
+		if(this->homingState == HOMINGIDLE || this->homingState == HOMINGDONE)
 		{
-			pointer->stepDelay = 20000;
+			sei();
+			return;
 		}
-		this->state = tempState;
+		this->homingState = HOMINGIDLE;
+		this->velocity = this->homingSavedVelocity;
 	sei();
 
-	PORTD &= ~(1 << 4);
-	TCCR3B |= (1 << CS30);
+	this->stop(SOFT);
 }
 
-void uStepperSLite::moveSteps(int32_t steps, bool dir, bool holdMode)
+bool uStepperSLite::beginHoming(bool dir, float stallSensitivity, int32_t backOff, float fastVelocity, float slowVelocity, homingCallback_t callback)
 {
-	float curVel, startVelocity = 0;
-	uint8_t state;
-	uint32_t totalSteps;
-	uint32_t accelSteps;
-	uint32_t decelSteps;
-	uint32_t initialDecelSteps;
-	uint32_t cruiseSteps = 0;
-
 	if(this->mode == DROPIN)
 	{
-		return;		//Drop in feature is activated. just return since this function makes no sense with drop in activated!
+		return 0;		//Doesn't make sense in dropin mode
 	}
 
-	if(steps < 1)
+	if(this->homingState != HOMINGIDLE && this->homingState != HOMINGDONE)
 	{
-		return;
+		return 0;		//Already homing
 	}
-	totalSteps = steps;
+
+	this->isStalled(stallSensitivity);
+	this->stop(HARD);
+
 	cli();
-		curVel = this->currentPidSpeed;
+		this->homingDir = dir;
+		this->homingRunBackOff = backOff;
+		this->homingRunFastVelocity = fastVelocity;
+		this->homingRunSlowVelocity = slowVelocity;
+		this->homingSlowDone = 0;
+		this->homingCallback = callback;
+		this->homingSavedVelocity = this->velocity;
+		this->homingLength = this->encoder.getAngleMoved();
+		this->homingTimer = HOMINGSAMPLES(HOMINGSETTLETIME);
+		this->homingState = HOMINGSETTLE;
 	sei();
-	steps--;
-	initialDecelSteps = 0;
 
-	if(this->state == STOP)								//If motor is currently at full stop (state = STOP)
-	{
-		state = ACCEL;
-		accelSteps = (uint32_t)((this->velocity * this->velocity)/(2.0*this->acceleration));	//Number of steps to bring the motor to max speed (S = (V^2 - V0^2)/(2*a)))
-				//No initial deceleration phase needed
+	return 1;
+}
 
-		if(accelSteps > (totalSteps >> 1))	//If we need to accelerate for longer than half of the total steps, we need to start decelerating before we reach max speed
-		{
-			cruiseSteps = 0; 		//No cruise phase needed
-			accelSteps = decelSteps = (totalSteps >> 1);				//Accelerate and decelerate for the same amount of steps (half the total steps)
-			accelSteps += totalSteps - accelSteps - decelSteps;	//if there are still a step left to perform, due to rounding errors, do this step as an acceleration step
-		}
+void uStepperSLite::homingService(void)
+{
+	float lengthMoved;
 
-		else
-		{
-			decelSteps = accelSteps;	//If top speed is reached before half the total steps are performed, deceleration period should be same length as acceleration period
-			cruiseSteps = totalSteps - accelSteps - decelSteps;	//Perform remaining steps as cruise steps
-		}
-		startVelocity = 0.0;//sqrt(2.0*this->acceleration);	//number of interrupts before the first step should be performed.
-	}
-	else if((dir == CW && curVel < 0) || (dir == CCW && curVel > 0))									//If motor turns CCW and should turn CW, or if motor turns CW and shoúld turn CCW
+	if(this->homingTimer)
 	{
-		state = INITDECEL;									//We should decelerate the motor to full stop
-		initialDecelSteps = (uint32_t)((curVel*curVel)/(2.0*this->acceleration));		//the amount of steps needed to bring the motor to full stop. (S = (V^2 - V0^2)/(2*-a)))
-		accelSteps = (uint32_t)((this->velocity * this->velocity)/(2.0*this->acceleration));									//Number of steps to bring the motor to max speed (S = (V^2 - V0^2)/(2*a)))
-		totalSteps += initialDecelSteps;				//Add the steps used for initial deceleration to the totalSteps variable, since we moved this number of steps, passed the initial position, and therefore need to move this amount of steps extra, in the desired direction
-
-		if(accelSteps > (totalSteps >> 1))			//If we need to accelerate for longer than half of the total steps, we need to start decelerating before we reach max speed
-		{
-			accelSteps = decelSteps = (totalSteps >> 1);	//Accelerate and decelerate for the same amount of steps (half the total steps)
-			accelSteps += totalSteps - accelSteps - decelSteps;				//If there are still a step left to perform, due to rounding errors, do this step as an acceleration step
-			cruiseSteps = 0;
-		}
-		else
-		{
-			decelSteps = accelSteps;					//If top speed is reached before half the total steps are performed, deceleration period should be same length as acceleration period
-			cruiseSteps = totalSteps - accelSteps - decelSteps; 			//Perform remaining steps, as cruise steps
-		}
-		startVelocity = curVel; //sqrt((curVel*curVel) + 2.0*this->acceleration);	//number of interrupts before the first step should be performed.
+		this->homingTimer--;
+		return;
 	}
-	else if((dir == CW && curVel > 0) || (dir == CCW && curVel < 0))							//If the motor is currently rotating the same direction as desired, we dont necessarily need to decelerate
-	{
-		if(abs(curVel) > this->velocity)	//If current velocity is greater than desired velocity
-		{
-			state = INITDECEL;	//We need to decelerate the motor to desired velocity
-			initialDecelSteps = (uint32_t)(((this->velocity*this->velocity) - (curVel*curVel))/(-2.0*this->acceleration));		//Number of steps to bring the motor down from current speed to max speed (S = (V^2 - V0^2)/(2*-a)))
-			accelSteps = 0;	//No acceleration phase is needed
-			decelSteps = (uint32_t)((this->velocity*this->velocity)/(2.0*this->acceleration));	//Number of steps needed to decelerate the motor from top speed to full stop
-			startVelocity = curVel;//sqrt((curVel*curVel) + (2.0*this->acceleration));
 
-			if(totalSteps <= (initialDecelSteps + decelSteps))
+	switch(this->homingState)
+	{
+		case HOMINGSETTLE:
+			if(this->homingRunFastVelocity > 0.0)
 			{
-				cruiseSteps = 0;
+				this->velocity = this->homingRunFastVelocity;
 			}
-			else
+			this->runContinous(this->homingDir);
+			this->homingTimer = HOMINGSAMPLES(HOMINGBLANKINGTIME);		//Ignore stalls while accelerating
+			this->homingState = HOMINGSEEK;
+			break;
+
+		case HOMINGSEEK:
+		case HOMINGAPPROACH:
+			if(this->state == STOP)		//Motor stopped by the user, give up
 			{
-				cruiseSteps = steps - initialDecelSteps - decelSteps;					//Perform remaining steps as cruise steps
+				this->velocity = this->homingSavedVelocity;
+				this->homingState = HOMINGIDLE;
+				return;
 			}
-		}
-
-		else if(abs(curVel) < this->velocity)	//If current velocity is less than desired velocity
-		{
-
-			state = ACCEL;			//Start accelerating
-			accelSteps = (int32_t)((((this->velocity*this->velocity) - curVel*curVel))/(2.0*this->acceleration));	//Number of Steps needed to accelerate from current velocity to full speed
+			if(!this->stall)
+			{
+				return;
+			}
+			this->stop(SOFT);		//stop motor without brake
+			this->moveSteps(this->homingRunBackOff, !this->homingDir, SOFT);
+			this->homingState = HOMINGBACKOFF;
+			break;
 
-			if(accelSteps > (totalSteps >> 1))			//If we need to accelerate for longer than half of the total steps, we need to start decelerating before we reach max speed
+		case HOMINGBACKOFF:
+			if(this->state != STOP)
 			{
-				accelSteps = decelSteps = (totalSteps >> 1);	//Accelerate and decelerate for the same amount of steps (half the total steps)
-				accelSteps += totalSteps - accelSteps - decelSteps;				//If there are still a step left to perform, due to rounding errors, do this step as an acceleration step
-				cruiseSteps = 0;
+				return;
 			}
-			else
+			if(this->homingRunSlowVelocity > 0.0 && !this->homingSlowDone)
 			{
-				decelSteps = accelSteps;					//If top speed is reached before half the total steps are performed, deceleration period should be same length as acceleration period
-				cruiseSteps = totalSteps - accelSteps - decelSteps; 			//Perform remaining steps, as cruise steps
+				this->homingSlowDone = 1;
+				this->velocity = this->homingRunSlowVelocity;
+				this->runContinous(this->homingDir);
+				this->homingTimer = HOMINGSAMPLES(HOMINGBLANKINGTIME);
+				this->homingState = HOMINGAPPROACH;
+				break;
 			}
+			this->velocity = this->homingSavedVelocity;
+			this->homingTimer = HOMINGSAMPLES(HOMINGFINISHTIME);
+			this->homingState = HOMINGFINISH;
+			break;
 
-			cruiseSteps = steps - accelSteps - decelSteps;	//Perform remaining steps as cruise steps
-			initialDecelSteps = 0;								//No initial deceleration phase needed
-		}
-
-		else						//If current velocity is equal to desired velocity
-		{
-
-			state = CRUISE;	//We are already at desired speed, therefore we start at cruise phase
-			decelSteps = (int32_t)((this->velocity*this->velocity)/(2.0*this->acceleration));	//Number of steps needed to decelerate the motor from top speed to full stop
-			accelSteps = 0;	//No acceleration phase needed
-			initialDecelSteps = 0;		//No initial deceleration phase needed
-
-			if(decelSteps >= totalSteps)
+		case HOMINGFINISH:
+			if(this->homingDir == CW)
 			{
-				cruiseSteps = 0;
-				decelSteps = totalSteps;
+				lengthMoved = this->encoder.getAngleMoved() - this->homingLength;
 			}
 			else
 			{
-				cruiseSteps = steps - decelSteps;	//Perform remaining steps as cruise steps
+				lengthMoved = this->homingLength - this->encoder.getAngleMoved();
 			}
-		}
+			this->encoder.setHomeAngle(this->encoder.angle);		//set new home position, from the sample just read
+			this->homingLength = lengthMoved;
+			this->homingState = HOMINGDONE;
+			if(this->homingCallback != NULL)		//Interrupt context, see homingCallback_t
+			{
+				this->homingCallback(lengthMoved);
+			}
+			break;
+	}
+}
+
+void uStepperSLite::moveToAngle(float angle, bool holdMode)
+{
+	float diff;
+	uint32_t steps;
+
+	diff = angle - this->encoder.getAngleMoved();
+	steps = (uint32_t)((abs(diff)*angleToStep) + 0.5);
+
+	if(diff < 0.0)
+	{
+		this->moveSteps(steps, CCW, holdMode);
 	}
 	else
 	{
-		state = ACCEL;
-		accelSteps = (uint32_t)((this->velocity * this->velocity)/(2.0*this->acceleration));	//Number of steps to bring the motor to max speed (S = (V^2 - V0^2)/(2*a)))
-				//No initial deceleration phase needed
+		this->moveSteps(steps, CW, holdMode);
+	}
+}
 
-		if(accelSteps > (totalSteps >> 1))	//If we need to accelerate for longer than half of the total steps, we need to start decelerating before we reach max speed
-		{
-			cruiseSteps = 0; 		//No cruise phase needed
-			accelSteps = decelSteps = (totalSteps >> 1);				//Accelerate and decelerate for the same amount of steps (half the total steps)
-			accelSteps += totalSteps - accelSteps - decelSteps;	//if there are still a step left to perform, due to rounding errors, do this step as an acceleration step
-		}
+void uStepperSLite::moveAngle(float angle, bool holdMode)
+{
+	int32_t steps;
 
-		else
-		{
-			decelSteps = accelSteps;	//If top speed is reached before half the total steps are performed, deceleration period should be same length as acceleration period
-			cruiseSteps = totalSteps - accelSteps - decelSteps;	//Perform remaining steps as cruise steps
-		}
-		startVelocity = 0.0;
+	if(angle < 0.0)
+	{
+		steps = -(int32_t)((angle*angleToStep) - 0.5);
+		this->moveSteps(steps, CCW, holdMode);
 	}
+	else
+	{
+		steps = (int32_t)((angle*angleToStep) + 0.5);
+		this->moveSteps(steps, CW, holdMode);
+	}
+}
+
+void uStepperSLite::moveTo(int32_t steps, bool holdMode)
+{
+	int32_t start, diff;
+	uint8_t sreg = SREG;
+
 	cli();
-		this->direction = dir;
-		this->stepGeneratorDirection = dir;
+		start = (this->state == STOP) ? this->targetPosition : profilePosition();		//Plan from where the profile is, the new target replaces the one of a running move
+		diff = steps - start;
+	SREG = sreg;
 
-		this->continous = 0;
+	if(diff < 0)
+	{
+		this->moveStepsFrom(start, -diff, CCW, holdMode);
+	}
+	else
+	{
+		this->moveStepsFrom(start, diff, CW, holdMode);
+	}
+}
 
-		if(dir == CW)
-		{
-			this->decelToAccelThreshold = this->targetPosition + initialDecelSteps;
-			this->accelToCruiseThreshold = this->decelToAccelThreshold + accelSteps;
-			this->cruiseToDecelThreshold = this->accelToCruiseThreshold + cruiseSteps;
-			this->decelToStopThreshold = this->cruiseToDecelThreshold + decelSteps;
-			PORTB |= (1 << 2);
-		}
-		else
-		{
-			this->decelToAccelThreshold = this->targetPosition - initialDecelSteps;
-			this->accelToCruiseThreshold = this->decelToAccelThreshold - accelSteps;
-			this->cruiseToDecelThreshold = this->accelToCruiseThreshold - cruiseSteps;
-			this->decelToStopThreshold = this->cruiseToDecelThreshold - decelSteps;
-			PORTB &= ~(1 << 2);
-		}
-		this->currentPidSpeed = startVelocity;
-		if(pointer->currentPidSpeed > 5.0)
-		{
-			pointer->stepDelay = (uint32_t)((STEPGENERATORFREQUENCY/(pointer->currentPidSpeed)) + 0.5);
-		}
-		else if(pointer->currentPidSpeed < -5.0)
+bool uStepperSLite::queueMoveSteps(int32_t steps, bool dir, bool holdMode)
+{
+	moveQueueEntry_t *entry;
+	int32_t start = 0, remaining = 0;
+	bool extend, queued = 0;
+
+	if(this->mode == DROPIN)
+	{
+		return 0;		//Drop in feature is activated. just return since this function makes no sense with drop in activated!
+	}
+
+	if(steps < 1)
+	{
+		return 1;
+	}
+
+	cli();
+		extend = (this->moveQueueCount == 0 && this->state != STOP && this->continous == 0 && this->direction == dir);
+
+		if(extend)		//Same direction as the move being executed, and nothing queued in between. Extend the move, instead of stopping in between
 		{
-			pointer->stepDelay = (uint32_t)((STEPGENERATORFREQUENCY/(-pointer->currentPidSpeed)) + 0.5);
+			start = profilePosition();		//Plan the extended move from the current position. The running move is left untouched until the new plan replaces it
+			remaining = this->targetPosition - start;
+			if(dir == CCW)
+			{
+				remaining = -remaining;
+			}
+			if(remaining < 0)
+			{
+				remaining = 0;
+			}
 		}
-		else
+		else if(this->moveQueueCount < MOVEQUEUELENGTH)
 		{
-			pointer->stepDelay = 20000;
+			entry = &this->moveQueue[(this->moveQueueHead + this->moveQueueCount) % MOVEQUEUELENGTH];
+			entry->steps = steps;
+			entry->dir = dir;
+			entry->holdMode = holdMode;
+			this->moveQueueCount++;		//Started by the encoder interrupt, when the motor stops
+			queued = 1;
 		}
-		this->state = state;
-		this->targetPosition = this->decelToStopThreshold;
-		this->brake = holdMode;
 	sei();
 
-	PORTD &= ~(1 << 4);
-	TCCR3B |= (1 << CS30);
-}
+	if(extend)
+	{
+		this->moveStepsFrom(start, remaining + steps, dir, holdMode);
+		return 1;
+	}
 
-void uStepperSLite::hardStop(bool holdMode)
-{
-	this->stop(holdMode);
+	return queued;
 }
 
-void uStepperSLite::stop(bool brake)
+bool uStepperSLite::queueMoveAngle(float angle, bool holdMode)
 {
-	if(this->mode == DROPIN)
+	if(angle < 0.0)
 	{
-		return;		//Drop in feature is activated. just return since this function makes no sense with drop in activated!
+		return this->queueMoveSteps(-(int32_t)((angle*angleToStep) - 0.5), CCW, holdMode);
 	}
 
+	return this->queueMoveSteps((int32_t)((angle*angleToStep) + 0.5), CW, holdMode);
+}
 
-	TCCR3B &= ~(1 << CS30);
-	pointer->driver.setVelocity(0);
-	this->targetPosition = this->stepsSinceReset;
-	pointer->cruiseToDecelThreshold = this->targetPosition;
-	this->brake = brake;
-	this->stall = 0;
-	this->state = STOP;			//Set current state to STOP
-	this->continous = 0;
-	if(brake == BRAKEOFF)
-	{
-		this->disableMotor();
-	}
+bool uStepperSLite::queueMoveToAngle(float angle, bool holdMode)
+{
+	int32_t queued;
+	uint8_t i;
+	moveQueueEntry_t *entry;
 
-	else if (brake == BRAKEON)
-	{
-		this->enableMotor();
-	}
+	cli();
+		queued = (this->state != STOP) ? this->targetPosition - profilePosition() : 0;		//Steps left of the move being executed
+		for(i = 0; i < this->moveQueueCount; i++)
+		{
+			entry = &this->moveQueue[(this->moveQueueHead + i) % MOVEQUEUELENGTH];
+			queued += (entry->dir == CW) ? entry->steps : -entry->steps;
+		}
+	sei();
 
+	return this->queueMoveAngle(angle - (this->encoder.getAngleMoved() + ((float)queued * this->stepToAngle)), holdMode);
 }
 
-void uStepperSLite::softStop(bool holdMode)
+uint8_t uStepperSLite::getQueueLength(void)
 {
-	this->stop(holdMode);
+	return this->moveQueueCount;
 }
 
-void uStepperSLite::checkConnectorOrientation(uint8_t mode)
+void uStepperSLite::clearQueue(void)
 {
-	uint8_t data[2], i;
-	uint16_t angle;
-	int16_t angleDiff[3];
+	cli();
+		this->moveQueueCount = 0;
+	sei();
+}
 
-	I2C.read(ENCODERADDR, ANGLE, 2, data);
-	angle = (((uint16_t)data[0]) << 8 ) | (uint16_t)data[1];
+void uStepperSLite::startQueuedMoves(void)
+{
+	moveQueueEntry_t *entry;
+	int32_t steps = 0;
+	uint8_t dir, holdMode = BRAKEON;
 
-	PORTB &= ~(1 << 2);
+	dir = this->moveQueue[this->moveQueueHead].dir;
 
-	for(i = 0; i < 50; i++)
+	while(this->moveQueueCount)
 	{
-		PORTD |= (1 << 7);
-		delayMicroseconds(1);
-		PORTD &= ~(1 << 7);
-		_delay_ms(10);
+		entry = &this->moveQueue[this->moveQueueHead];
+		if(entry->dir != dir)
+		{
+			break;		//The motor has to stop before changing direction
+		}
+		steps += entry->steps;
+		holdMode = entry->holdMode;
+		this->moveQueueHead = (this->moveQueueHead + 1) % MOVEQUEUELENGTH;
+		this->moveQueueCount--;
 	}
 
-	angleDiff[0] = (int16_t)angle;
+	this->moveSteps(steps, dir, holdMode);
+}
 
-	I2C.read(ENCODERADDR, ANGLE, 2, data);
-	angle = (((uint16_t)data[0]) << 8 ) | (uint16_t)data[1];
+void uStepperSLite::pid(float error)
+{
+	float u, uSat;
+#if STEPENGINE != STEPENGINEVACTUAL
+	float temp;
+#endif
+	float limit = abs(this->currentPidSpeed) + 6000.0;
+	static float integral;
+	static bool integralReset = 0;
 
-	angleDiff[0] -= (int16_t)angle;
+	if(this->pidDisabled)
+	{
+		integral = 0.0;
+		integralReset = 0;
+		this->currentPidError = 0.0;
+		if(this->state == STOP)
+		{
+			if(this->brake == BRAKEON)
+			{
+				DRIVERENABLE();
+			}
+			else
+			{
+				DRIVERDISABLE();
+			}
+		}
+		
+		return;
+	}
 
-	PORTB |= (1 << 2);
+	DRIVERENABLE();
 
-	for(i = 0; i < 50; i++)
+	this->currentPidError = error;
+
+	u = error*this->pTerm;
+
+	if(u > 0.0)
+	{
+		if(u > limit)
+		{
+			u = limit;
+		}
+	}
+	else if(u < 0.0)
 	{
-		PORTD |= (1 << 7);
-		delayMicroseconds(1);
-		PORTD &= ~(1 << 7);
-		_delay_ms(10);
+		if(u < -limit)
+		{
+			u = -limit;
+		}
 	}
 
-	angleDiff[1] = (int16_t)angle;
+	integral += error*this->iTerm;
 
-	I2C.read(ENCODERADDR, ANGLE, 2, data);
-	angle = (((uint16_t)data[0]) << 8 ) | (uint16_t)data[1];
+	if(integral > 10000.0)
+	{
+		integral = 10000.0;
+	}
+	else if(integral < -10000.0)
+	{
+		integral = -10000.0;
+	}
 
-	angleDiff[1] -= (int16_t)angle;
+	u += integral;
 
-	for(i = 0; i < 2; i++)
+	if(u > 100000 || u < -100000)
 	{
-		if(angleDiff[i] > 2048)
-		{
-			angleDiff[i] -= 4096;
-		}
-		else if(angleDiff[i] < -2048)
-		{
-			angleDiff[i] += 4096;
-		}
+		uSat = 100000;
+		uSat = ((u > 0) - (u < 0)) * uSat;
+	}
+	else
+	{
+		uSat = u;
 	}
 
-	if((angleDiff[0] > 2 && angleDiff[1] < -2))
+	if(error < -2.0 || error > 2.0)
 	{
-		if(mode == DROPIN)
+		if(error < 0.0)
 		{
-			this->driver.invertDirection();
+			if(error < -255.0)
+			{
+				this->pidError = 255;
+			}
+			else
+			{
+				this->pidError = (uint8_t)-error;
+			}
+		}
+		else
+		{
+			if(error > 255.0)
+			{
+				this->pidError = 255;
+			}
+			else
+			{
+				this->pidError = (uint8_t)error;
+			}
 		}
+		STEPTIMERSTART();
 	}
 	else
 	{
-		if(mode != DROPIN)
+
+		if(this->state == STOP)
 		{
-			this->driver.invertDirection();
+			STEPTIMERSTOP();
 		}
+		this->pidError = 0;
 	}
-}
-
-void uStepperSLite::setup(	uint8_t mode = NORMAL, 
-				float stepsPerRevolution = 3200.0, 
-				float pTerm = 0.75, 
-				float iTerm = 3.0, 
-				float dTerm = 0.0,
-				bool setHome = true,
-				uint8_t invert,
-				uint8_t runCurrent,
-				uint8_t holdCurrent)
-{
-	dropinCliSettings_t tempSettings;
 
-	p = &(this->stepsSinceReset);
-	this->pidDisabled = 1;
-	this->mode = mode;
-	this->encoder.setup();
+#if STEPENGINE == STEPENGINEVACTUAL
+	if(this->pidError == 0 && this->state == STOP)
+	{
+		uSat = 0.0;
+	}
 
-	this->state = STOP;
-	this->driver.setup();
-	this->driver.enableDriver();
-	_delay_ms(200);
+	this->driver.setVelocity(uSat * this->stepsPerSecondToRPM);
+#else
+	temp = stepDelayFromSpeed(uSat);
 
-	if((uint16_t)stepsPerRevolution == FULL)
+	if(uSat > 0.0)
 	{
-		stepsPerRevolution = 200.0;
+		this->stepGeneratorDirection = CW;
 	}
-	else if((uint16_t)stepsPerRevolution == HALF)
+	else if(uSat < 0.0)
 	{
-		stepsPerRevolution = 400.0;
+		this->stepGeneratorDirection = CCW;
 	}
-	else if((uint16_t)stepsPerRevolution == QUARTER)
+	else
 	{
-		stepsPerRevolution = 800.0;
+		this->stepGeneratorDirection = this->direction;
 	}
-	else if((uint16_t)stepsPerRevolution == EIGHT)
+
+	cli();
+	pointer->stepDelay = temp;
+	sei();
+#endif
+}
+
+#if STEPENGINE == STEPENGINEVACTUAL
+void uStepperSLite::vactualService(float speed)
+{
+	float position, error;
+	int32_t steps;
+
+	if(this->state == STOP)
 	{
-		stepsPerRevolution = 1600.0;
+		this->vactualFraction = 0.0;
+		this->driver.setVelocity(0.0);
+		return;
 	}
-	else if((uint16_t)stepsPerRevolution == SIXTEEN)
+
+	if(this->state == DECEL && speed < VACTUALMINSPEED && speed > -VACTUALMINSPEED)
 	{
-		stepsPerRevolution = 3200.0;
+		speed = (this->direction == CW) ? VACTUALMINSPEED : -VACTUALMINSPEED;
 	}
 
-	this->stepConversion = (float)(stepsPerRevolution)/4096.0;	//Calculate conversion coefficient from raw encoder data, to actual moved steps
-	this->angleToStep = ((float)(stepsPerRevolution))/360.0;	//Calculate conversion coefficient from angle to corresponding number of steps
-	this->stepToAngle = 360.0/((float)(stepsPerRevolution));	//Calculate conversion coefficient from steps to corresponding angle
-	this->stepsPerSecondToRPM = 60.0/stepsPerRevolution;
-	this->RPMToStepsPerSecond = stepsPerRevolution/60.0;
-	this->RPMToStepDelay = STEPGENERATORFREQUENCY/this->RPMToStepsPerSecond;
-	this->encoder.setHome();
-
-	if(this->mode)
+	if(this->mode == NORMAL)
 	{
-		if(this->mode == DROPIN)
-		{
-			//Set Enable, Step and Dir signal pins from 3dPrinter controller as inputs
-			pinMode(2,INPUT);
-			pinMode(3,INPUT);
-			pinMode(4,INPUT);
-			//Enable internal pull-up resistors on the above pins
-			digitalWrite(2,HIGH);
-			digitalWrite(3,HIGH);
-			digitalWrite(4,HIGH);
-			EICRA = 0x06;
-			EIMSK = 0x03;
+		position = this->vactualFraction + (speed * ENCODERINTSAMPLETIME);
+		steps = (int32_t)floor(position);
+		this->vactualFraction = position - (float)steps;
 
-			Serial.begin(9600);
-
-			tempSettings.P.f = pTerm;
-			tempSettings.I.f = iTerm;
-			tempSettings.D.f = dTerm;
-			tempSettings.invert = invert;
-			tempSettings.runCurrent = runCurrent;
-			tempSettings.holdCurrent = holdCurrent;
-			tempSettings.checksum = this->dropinSettingsCalcChecksum(&tempSettings);
-
-			if(tempSettings.checksum != EEPROM.read(sizeof(dropinCliSettings_t)))
-			{
-				this->dropinSettings = tempSettings;
-				this->saveDropinSettings();
-				EEPROM.put(sizeof(dropinCliSettings_t),this->dropinSettings.checksum);
-				this->loadDropinSettings();
-			}
-			else
+		cli();
+			this->stepsSinceReset += steps;
+			if(!this->continous)
 			{
-				if(!this->loadDropinSettings())
+				//Do not run past the end of the move, the profile stops when stepsSinceReset reaches it
+				if((this->direction == CW && this->stepsSinceReset >= this->decelToStopThreshold) ||
+				   (this->direction == CCW && this->stepsSinceReset <= this->decelToStopThreshold))
 				{
-					this->dropinSettings = tempSettings;
-					this->saveDropinSettings();
-					EEPROM.put(sizeof(dropinCliSettings_t),this->dropinSettings.checksum);
-					this->loadDropinSettings();
+					this->stepsSinceReset = this->decelToStopThreshold;
+					this->vactualFraction = 0.0;
 				}
 			}
-			delay(10000);
-  			this->dropinPrintHelp();
+			position = (float)this->stepsSinceReset + this->vactualFraction;
+		sei();
+
+		error = (position - ((float)this->encoder.angleMoved * this->stepConversion)) * VACTUALPOSITIONGAIN;
+		if(error > VACTUALMAXCORRECTION)
+		{
+			error = VACTUALMAXCORRECTION;
 		}
-		else
+		else if(error < -VACTUALMAXCORRECTION)
 		{
-			//Scale supplied controller coefficents. This is done to enable the user to use easier to manage numbers for these coefficients.
-		    this->pTerm = pTerm;
-			this->iTerm = iTerm * ENCODERINTSAMPLETIME;
-		    this->dTerm = dTerm * ENCODERINTFREQ;
+			error = -VACTUALMAXCORRECTION;
 		}
+		speed += error;
 	}
 
-	this->checkConnectorOrientation(mode);
-	this->encoder.setHome();
-
-	this->pidDisabled = 0;
-	TCNT3 = 0;
-	ICR3 = 159;
-	TIFR3 = 0;
-	TIMSK3 = (1 << OCIE3A);
-	TCCR3A = (1 << WGM31);
-	TCCR3B = (1 << WGM32) | (1 << WGM33);
-	sei();
+	this->driver.setVelocity(speed * this->stepsPerSecondToRPM);
 }
+#endif
 
-void uStepperSLite::enableMotor(void)
+void uStepperSLite::disablePid(void)
 {
-	this->driver.enableDriver();				//Enable motor driver
+	this->pidDisabled = 1;
 }
 
-void uStepperSLite::disableMotor(void)
+void uStepperSLite::enablePid(void)
 {
-	this->driver.disableDriver();			//Disable motor driver
+	cli();
+		this->pidDisabled = 0;
+		this->pidTargetPosition = this->encoder.angleMoved * this->stepConversion;
+		this->targetPosition = this->pidTargetPosition;
+		this->state = STOP;
+		this->pidError = 0;
+	sei();
 }
 
-bool uStepperSLite::getCurrentDirection(void)
+float uStepperSLite::getPidError(void)
 {
-	return this->direction;
+	return this->currentPidError;
 }
 
-uint8_t uStepperSLite::getMotorState(void)
+bool uStepperSLite::getIsrProfile(uint8_t isr __attribute__((unused)), isrProfile_t *profile __attribute__((unused)))
 {
-	if(this->state != STOP)
+#if ISRPROFILING
+	if(isr >= ISRPROFILECOUNT)
 	{
-		return this->state;		//Motor running
+		return false;
 	}
 
-	return 0;			//Motor not running
-}
-
-int32_t uStepperSLite::getStepsSinceReset(void)
-{
-	return this->stepsSinceReset;
-}
+	cli();
+		*profile = isrProfile[isr];
+	sei();
 
-void uStepperSLite::setCurrent(uint8_t runCurrent, uint8_t holdCurrent)
-{
-	this->driver.setCurrent(runCurrent, holdCurrent);
-}
+	if(profile->count)
+	{
+		profile->mean = (uint16_t)(profile->sum / profile->count);
+	}
+	else
+	{
+		profile->mean = 0;
+	}
 
-void uStepperSLite::setHoldCurrent(uint8_t holdCurrent)
-{
-	this->driver.setHoldCurrent(holdCurrent);
+	return true;
+#else
+	return false;
+#endif
 }
 
-void uStepperSLite::setRunCurrent(uint8_t runCurrent)
+void uStepperSLite::resetIsrProfile(void)
 {
-	this->driver.setRunCurrent(runCurrent);
+#if ISRPROFILING
+	cli();
+		memset(isrProfile, 0, sizeof(isrProfile));
+	sei();
+#endif
 }
 
-//Skal Gennemgås !
-float uStepperSLite::moveToEnd(bool dir, float stallSensitivity)
+bool uStepperSLite::startTrace(uint8_t trigger __attribute__((unused)), uint16_t postTrigger __attribute__((unused)), uint8_t decimation __attribute__((unused)))
 {
-	uint8_t checks = 0;
-  	float pos = 0.0;
-  	float lengthMoved;
-
-  	if(this->mode == DROPIN)
-  	{
-  		return 0.0;		//Doesn't make sense in dropin mode
-  	}
-
-  	lengthMoved = this->encoder.getAngleMoved();
-
-  	this->stop(HARD);
-	_delay_ms(50);
-  	this->runContinous(dir);
-  	_delay_ms(200);
-	while(!this->isStalled(stallSensitivity));
-	this->stop(SOFT);//stop motor without brake
-
-	this->moveSteps(20, !dir, SOFT);
-	while(this->getMotorState())
+#if TRACEBUFFERLENGTH
+	if(postTrigger < 1)
 	{
-		_delay_ms(1);
+		postTrigger = 1;
 	}
-	_delay_ms(100);
-	if(dir == CW)
+	else if(postTrigger > TRACEBUFFERLENGTH)
 	{
-		lengthMoved = this->encoder.getAngleMoved() - lengthMoved;
+		postTrigger = TRACEBUFFERLENGTH;
 	}
-	else
+
+	if(decimation < 1)
 	{
-		lengthMoved -= this->encoder.getAngleMoved();
+		decimation = 1;
 	}
-  	this->encoder.setHome();//set new home position
 
-  	return lengthMoved;
+	cli();
+		traceHead = 0;
+		traceCount = 0;
+		traceSinceTrigger = 0;
+		tracePostTrigger = postTrigger;
+		traceTrigger = trigger;
+		traceDecimation = decimation;
+		traceDecimationCounter = decimation - 1;		//Record the first sample
+		tracePreviousState = this->state;
+		traceState = (trigger == TRACETRIGGERNOW) ? TRACETRIGGERED : TRACEARMED;
+	sei();
+
+	return true;
+#else
+	return false;
+#endif
 }
 
-void uStepperSLite::moveToAngle(float angle, bool holdMode)
+uint8_t uStepperSLite::getTraceState(void)
 {
-	float diff;
-	uint32_t steps;
-
-	diff = angle - this->encoder.getAngleMoved();
-	steps = (uint32_t)((abs(diff)*angleToStep) + 0.5);
-
-	if(diff < 0.0)
-	{
-		this->moveSteps(steps, CCW, holdMode);
-	}
-	else
-	{
-		this->moveSteps(steps, CW, holdMode);
-	}
+#if TRACEBUFFERLENGTH
+	return traceState;
+#else
+	return TRACEIDLE;
+#endif
 }
 
-void uStepperSLite::moveAngle(float angle, bool holdMode)
+#if TRACEBUFFERLENGTH
+/**
+ * @brief      Send bytes of a trace frame on Serial, and add them to the checksum
+ */
+static void traceWrite(const void *data, uint8_t length, uint8_t *checksum)
 {
-	int32_t steps;
+	const uint8_t *p = (const uint8_t *)data;
 
-	if(angle < 0.0)
+	while(length--)
 	{
-		steps = -(int32_t)((angle*angleToStep) - 0.5);
-		this->moveSteps(steps, CCW, holdMode);
-	}
-	else
-	{
-		steps = (int32_t)((angle*angleToStep) + 0.5);
-		this->moveSteps(steps, CW, holdMode);
+		*checksum ^= *p;
+		Serial.write(*p++);
 	}
 }
+#endif
+
+uint16_t uStepperSLite::dumpTrace(void)
+{
+#if TRACEBUFFERLENGTH
+	uint8_t checksum = 0xAA;
+	uint16_t count, first, triggerIndex, i;
+	uint16_t temp;
+	uint8_t state;
+	traceRecord_t *record;
+
+	cli();
+		state = traceState;
+		traceState = TRACEIDLE;		//Stop recording while the buffer is sent
+	sei();
+
+	count = traceCount;
+	first = (count < TRACEBUFFERLENGTH) ? 0 : traceHead;
+	triggerIndex = (state == TRACEARMED || state == TRACEIDLE) ? 0xFFFF : count - traceSinceTrigger;
+
+	Serial.write(TRACEFRAMESYNC1);
+	Serial.write(TRACEFRAMESYNC2);
+	temp = TRACEFRAMEVERSION;
+	traceWrite(&temp, 1, &checksum);
+	temp = 17;		//Size of a record, without padding
+	traceWrite(&temp, 1, &checksum);
+	traceWrite(&count, 2, &checksum);
+	traceWrite(&triggerIndex, 2, &checksum);
+	temp = ENCODERINTFREQ;
+	traceWrite(&temp, 2, &checksum);
+	traceWrite(&traceDecimation, 1, &checksum);
+
+	for(i = 0; i < count; i++)
+	{
+		record = &traceBuffer[(first + i) % TRACEBUFFERLENGTH];
+		traceWrite(&record->angleMoved, 4, &checksum);
+		traceWrite(&record->pidTargetPosition, 4, &checksum);
+		traceWrite(&record->pidError, 4, &checksum);
+		traceWrite(&record->stepDelay, 4, &checksum);
+		traceWrite(&record->state, 1, &checksum);
+	}
+
+	Serial.write(checksum);
+
+	traceCount = 0;
+	traceHead = 0;
+
+	return count;
+#else
+	return 0;
+#endif
+}
 
-void uStepperSLite::pid(float error)
+void uStepperSLite::pidDropin(float error)
 {
-	float u, uSat, temp;
+	float u;
 	float limit = abs(this->currentPidSpeed) + 6000.0;
 	static float integral;
 	static bool integralReset = 0;
 
-	if(this->pidDisabled)
-	{
-		integral = 0.0;
-		integralReset = 0;
-		this->currentPidError = 0.0;
-		if(this->state == STOP)
-		{
-			if(this->brake == BRAKEON)
-			{
-				PORTD &= ~(1 << 4);
-			}
-			else
-			{
-				PORTD |= (1 << 4);
-			}
-		}
-		
-		return;
-	}
-
-	PORTD &= ~(1 << 4);
+	DRIVERENABLE();
 
 	this->currentPidError = error;
 
@@ -1272,493 +3024,557 @@ void uStepperSLite::pid(float error)
 		integral = -10000.0;
 	}
 
+	if(error > -10 && error < 10)
+	{
+		if(!integralReset)
+		{
+			integralReset = 1;
+			integral = 0;
+		}
+	}
+	else
+	{
+		integralReset = 0;
+	}
+
 	u += integral;
+	u *= this->stepsPerSecondToRPM;
 
-	if(u > 100000 || u < -100000)
+	this->driver.setVelocity(u);
+}
+
+bool uStepperSLite::detectStall(void)
+{
+	int32_t reference;
+	int32_t encoderChange;
+	int32_t referenceChange;
+	int32_t temp;
+
+	if(this->stallAlgorithm == STALLDETECTOFF || (this->stallOnlyWhileMoving && this->state == STOP))
 	{
-		uSat = 100000;
-		uSat = ((u > 0) - (u < 0)) * uSat;
+		if(!stallRestart)
+		{
+			stallDetectionReset();
+		}
+		this->stall = 0;
+		return 0;
+	}
+
+	if(this->mode == PID)
+	{
+		reference = (int32_t)(this->pidTargetPosition - jerkFilterLag);
 	}
 	else
 	{
-		uSat = u;
+		reference = this->stepsSinceReset;
 	}
 
-	if(error < -2.0 || error > 2.0)
+	if(stallRestart)
 	{
-		if(error < 0.0)
+		stallRestart = 0;
+		stallOldReference = reference;
+		stallOldEncoder = this->encoder.angleMoved;
+		return this->stall;
+	}
+
+	encoderChange = this->encoder.angleMoved - stallOldEncoder;
+	stallOldEncoder += encoderChange;
+	referenceChange = (reference - stallOldReference) * this->countsPerStep;	//Encoder counts Q16
+	stallOldReference = reference;
+
+	if(this->stallAlgorithm == STALLDETECTIIR)
+	{
+		stallEncoderFilter += ((encoderChange * 65536) - stallEncoderFilter) >> STALLFILTERSHIFT;
+		stallReferenceFilter += (referenceChange - stallReferenceFilter) >> STALLFILTERSHIFT;
+
+		stallAccumulator -= (stallAccumulator * this->stallLimit) >> 15;
+		if(abs(stallEncoderFilter) < (abs(stallReferenceFilter) >> 1))
 		{
-			if(error < -255.0)
-			{
-				this->pidError = 255;
-			}
-			else
-			{
-				this->pidError = (uint8_t)-error;
-			}
+			stallAccumulator += this->stallLimit;
 		}
-		else
+
+		this->stall = (stallAccumulator >= 31130);		//0.95, 3 timeconstants
+	}
+	else if(this->stallAlgorithm == STALLDETECTFOLLOWINGERROR)
+	{
+		stallFollowingError += referenceChange - (encoderChange * 65536);
+		if(stallFollowingError > 0x40000000L)
 		{
-			if(error > 255.0)
-			{
-				this->pidError = 255;
-			}
-			else
-			{
-				this->pidError = (uint8_t)error;
-			}
+			stallFollowingError = 0x40000000L;
+		}
+		else if(stallFollowingError < -0x40000000L)
+		{
+			stallFollowingError = -0x40000000L;
 		}
-		TCCR3B |= (1 << CS30);
+
+		this->stall = (abs(stallFollowingError) > this->stallLimit);
 	}
 	else
 	{
+		stallWindowEncoder += encoderChange;
+		stallWindowReference += referenceChange >> 8;
 
-		if(this->state == STOP)
+		if(++stallWindowSamples >= STALLWINDOWLENGTH)
 		{
-			TCCR3B &= ~(1 << CS30);
+			temp = abs(stallWindowReference);
+			if(temp < (STALLWINDOWMINCOUNTS << 8))
+			{
+				stallWindowCount = 0;		//Too slow to tell
+			}
+			else if((abs(stallWindowEncoder) << 9) < temp)
+			{
+				if(stallWindowCount < 255)
+				{
+					stallWindowCount++;
+				}
+			}
+			else
+			{
+				stallWindowCount = 0;
+			}
+
+			stallWindowSamples = 0;
+			stallWindowEncoder = 0;
+			stallWindowReference = 0;
+			this->stall = (stallWindowCount >= this->stallLimit);
 		}
-		this->pidError = 0;
 	}
 
-	if(uSat > 5.0)
-	{
-		temp = (uint32_t)((STEPGENERATORFREQUENCY/uSat) + 0.5);
-		this->stepGeneratorDirection = CW;
+	return this->stall;
+}
 
-		cli();
-		pointer->stepDelay = temp;
-		sei();
-	}
-	else if(uSat < -5.0)
-	{
-		this->stepGeneratorDirection = CCW;
+void uStepperSLite::updateStallDetection(void)
+{
+	int32_t limit;
+	int32_t countsPerStep = this->countsPerStep;
 
-		temp = (uint32_t)((STEPGENERATORFREQUENCY/-uSat) + 0.5);
-		cli();
-		pointer->stepDelay = temp;
-		sei();
-	}
-	else if(uSat > 0.0)
+	if(this->stallAlgorithm == STALLDETECTIIR)
 	{
-		this->stepGeneratorDirection = CW;
-		cli();
-		pointer->stepDelay = 20000;
-		sei();
+		limit = (int32_t)(((1.0 - this->stallSensitivity) * 32768.0) + 0.5);
 	}
-	else if(uSat < 0.0)
+	else if(this->stallAlgorithm == STALLDETECTFOLLOWINGERROR)
 	{
-		this->stepGeneratorDirection = CCW;
-
-		cli();
-		pointer->stepDelay = 20000;
-		sei();
+		limit = (int32_t)(this->stallSensitivity * (STALLFOLLOWINGERRORMAX * (4096.0 * 65536.0 / 200.0)));
 	}
 	else
 	{
-		this->stepGeneratorDirection = this->direction;
-		cli();
-		pointer->stepDelay = 20000;
-		sei();
+		limit = 1 + (int32_t)((this->stallSensitivity * (STALLWINDOWCOUNTMAX - 1)) + 0.5);
 	}
-}
 
-void uStepperSLite::disablePid(void)
-{
-	this->pidDisabled = 1;
-}
+	if(this->stepConversion > 0.0)
+	{
+		countsPerStep = (int32_t)((65536.0 / this->stepConversion) + 0.5);
+	}
 
-void uStepperSLite::enablePid(void)
-{
 	cli();
-		this->pidDisabled = 0;
-		this->pidTargetPosition = this->encoder.angleMoved * this->stepConversion;
-		this->targetPosition = this->pidTargetPosition;
-		this->state = STOP;
-		this->pidError = 0;
+		this->stallLimit = limit;
+		this->countsPerStep = countsPerStep;
 	sei();
 }
 
-float uStepperSLite::getPidError(void)
+void uStepperSLite::setStallDetection(uint8_t algorithm, bool onlyWhileMoving)
 {
-	return this->currentPidError;
+	if(algorithm > STALLDETECTOFF)
+	{
+		algorithm = STALLDETECTIIR;
+	}
+
+	cli();
+		this->stallAlgorithm = algorithm;
+		this->stallOnlyWhileMoving = onlyWhileMoving;
+		this->stall = 0;
+		stallDetectionReset();
+	sei();
+
+	this->updateStallDetection();
 }
 
-void uStepperSLite::pidDropin(float error)
+void uStepperSLite::setSpeedObserver(uint8_t observer, float bandwidth)
 {
-	float u;
-	float limit = abs(this->currentPidSpeed) + 6000.0;
-	static float integral;
-	static bool integralReset = 0;
+	float gain[2];
+	float omega, pole, lambda, root;
+	uint16_t gainFixed[2];
+	uint8_t shiftFixed[2];
+	uint8_t sreg;
 
-	PORTD &= ~(1 << 4);
-
-	this->currentPidError = error;
+	if(observer > SPEEDOBSERVERKALMAN)
+	{
+		observer = SPEEDOBSERVERPLL;
+	}
 
-	u = error*this->pTerm;
+	if(bandwidth < SPEEDOBSERVERMINBANDWIDTH)
+	{
+		bandwidth = SPEEDOBSERVERMINBANDWIDTH;
+	}
+	else if(bandwidth > SPEEDOBSERVERMAXBANDWIDTH)
+	{
+		bandwidth = SPEEDOBSERVERMAXBANDWIDTH;
+	}
 
-	if(u > 0.0)
+	if(observer == SPEEDOBSERVERPLL)
 	{
-		if(u > limit)
-		{
-			u = limit;
-		}
+		//Scale the default gains to the bandwidth, keeping the damping
+		omega = bandwidth / SPEEDOBSERVERPLLBANDWIDTH;
+		gain[0] = PULSEFILTERKP * omega;
+		gain[1] = PULSEFILTERKI * omega * omega;
+		fixedGain(gain[0] * ENCODERINTSAMPLETIME, &gainFixed[0], &shiftFixed[0]);
+		fixedGain(gain[1] * ENCODERINTSAMPLETIME, &gainFixed[1], &shiftFixed[1]);
 	}
-	else if(u < 0.0)
+	else
 	{
-		if(u < -limit)
+		omega = 2.0 * M_PI * bandwidth * ENCODERINTSAMPLETIME;		//Natural frequency, in radians per sample
+
+		if(observer == SPEEDOBSERVERALPHABETA)
 		{
-			u = -limit;
+			//Both poles of the tracker at exp(-omega)
+			pole = exp(-omega);
+			gain[0] = 1.0 - (pole * pole);
+			gain[1] = (1.0 - pole) * (1.0 - pole);
+		}
+		else
+		{
+			//Kalata's steady state gains, for the tracking index lambda = omega^2
+			lambda = omega * omega;
+			root = sqrt((lambda * lambda) + (8.0 * lambda));
+			gain[0] = -((lambda * lambda) + (8.0 * lambda) - ((lambda + 4.0) * root)) / 8.0;
+			gain[1] = ((lambda * lambda) + (4.0 * lambda) - (lambda * root)) / 4.0;
 		}
+		fixedGain(gain[0], &gainFixed[0], &shiftFixed[0]);
+		fixedGain(gain[1], &gainFixed[1], &shiftFixed[1]);
 	}
 
-	integral += error*this->iTerm;
+	sreg = SREG;
+	cli();
+		this->speedObserver = observer;
+		this->speedObserverGain[0] = gain[0];
+		this->speedObserverGain[1] = gain[1];
+		this->speedObserverGainFixed[0] = gainFixed[0];
+		this->speedObserverGainFixed[1] = gainFixed[1];
+		this->speedObserverShiftFixed[0] = shiftFixed[0];
+		this->speedObserverShiftFixed[1] = shiftFixed[1];
+		this->speedObserverRestart = 1;
+	SREG = sreg;
+}
 
-	if(integral > 10000.0)
+bool uStepperSLite::isStalled(float stallSensitivity)
+{
+	if(stallSensitivity > 1.0)
 	{
-		integral = 10000.0;
+		stallSensitivity = 1.0;
 	}
-	else if(integral < -10000.0)
+	else if(stallSensitivity < 0.0)
 	{
-		integral = -10000.0;
+		stallSensitivity = 0.0;
 	}
 
-	if(error > -10 && error < 10)
-	{
-		if(!integralReset)
-		{
-			integralReset = 1;
-			integral = 0;
-		}
-	}
-	else
+	if(stallSensitivity != this->stallSensitivity)
 	{
-		integralReset = 0;
+		this->stallSensitivity = stallSensitivity;
+		this->updateStallDetection();
 	}
 
-	u += integral;
-	u *= this->stepsPerSecondToRPM;
+	return this->stall;
+}
 
-	this->driver.setVelocity(u);
+void uStepperSLite::setProportional(float P)
+{
+	this->pTerm = P;
 }
 
-bool uStepperSLite::detectStall(void)
+void uStepperSLite::setIntegral(float I)
+{
+	this->iTerm = I * ENCODERINTSAMPLETIME; 
+}
+
+void uStepperSLite::setDifferential(float D)
 {
-	static float oldTargetPosition;
-	static float oldEncoderPosition;
-	static float encoderPositionChange;
-	static float targetPositionChange;
-	float encoderPosition = ((float)this->encoder.angleMoved*this->stepConversion);
-	static float internalStall = 0.0;
+	this->dTerm = D * ENCODERINTFREQ;
+}
 
-	encoderPositionChange *= 0.99;
-	encoderPositionChange += 0.01*(oldEncoderPosition - encoderPosition);
-	oldEncoderPosition = encoderPosition;
+void uStepperSLite::invertDropinDir(bool invert)
+{
+	this->invertPidDropinDirection = invert;
+}
 
-	targetPositionChange *= 0.99;
-	targetPositionChange += 0.01*(oldTargetPosition - this->pidTargetPosition);
-	oldTargetPosition = this->pidTargetPosition;
+/** @name Dropin CLI commands
+ *	Identifiers of the text commands in dropinCliCommands
+ */
+///@{
+#define DROPINCLIP 0
+#define DROPINCLII 1
+#define DROPINCLID 2
+#define DROPINCLIINVERT 3
+#define DROPINCLIERROR 4
+#define DROPINCLICURRENT 5
+#define DROPINCLIPARAMETERS 6
+#define DROPINCLIPROFILE 7
+#define DROPINCLIHELP 8
+#define DROPINCLIRUNCURRENT 9
+#define DROPINCLIHOLDCURRENT 10
+/** Commands at or above this identifier take a number */
+#define DROPINCLIFIRSTVALUE DROPINCLIRUNCURRENT
+///@}
 
-	if(abs(encoderPositionChange) < abs(targetPositionChange)*0.5)
-	{
-		internalStall *= this->stallSensitivity;
-		internalStall += 1.0-this->stallSensitivity;
-	}
-	else
+/**
+ * @brief      Struct holding a text command of the dropin CLI
+ */
+typedef struct
+{
+	const char *name;			/**< Command name in PROGMEM, including the '=' of commands taking a number	*/
+	uint8_t command;			/**< DROPINCLIP ...	*/
+}dropinCliCommand_t;
+
+static const char dropinCliNameP[] PROGMEM = "P=";
+static const char dropinCliNameI[] PROGMEM = "I=";
+static const char dropinCliNameD[] PROGMEM = "D=";
+static const char dropinCliNameInvert[] PROGMEM = "invert";
+static const char dropinCliNameError[] PROGMEM = "error";
+static const char dropinCliNameCurrent[] PROGMEM = "current";
+static const char dropinCliNameParameters[] PROGMEM = "parameters";
+static const char dropinCliNameProfile[] PROGMEM = "profile";
+static const char dropinCliNameHelp[] PROGMEM = "help";
+static const char dropinCliNameRunCurrent[] PROGMEM = "runCurrent=";
+static const char dropinCliNameHoldCurrent[] PROGMEM = "holdCurrent=";
+
+/** Text commands of the dropin CLI, in the order they are matched */
+static const dropinCliCommand_t dropinCliCommands[] PROGMEM =
+{
+	{dropinCliNameP, DROPINCLIP},
+	{dropinCliNameI, DROPINCLII},
+	{dropinCliNameD, DROPINCLID},
+	{dropinCliNameInvert, DROPINCLIINVERT},
+	{dropinCliNameError, DROPINCLIERROR},
+	{dropinCliNameCurrent, DROPINCLICURRENT},
+	{dropinCliNameParameters, DROPINCLIPARAMETERS},
+	{dropinCliNameProfile, DROPINCLIPROFILE},
+	{dropinCliNameHelp, DROPINCLIHELP},
+	{dropinCliNameRunCurrent, DROPINCLIRUNCURRENT},
+	{dropinCliNameHoldCurrent, DROPINCLIHOLDCURRENT},
+};
+
+/**
+ * @brief      Check if a command starts with a name stored in PROGMEM
+ *
+ * @param      cmd     - Command received
+ * @param      name    - Name in PROGMEM
+ *
+ * @return     Length of the name if it matches, 0 otherwise
+ */
+static uint8_t dropinCliMatch(const char *cmd, const char *name)
+{
+	uint8_t i;
+	char c;
+
+	for(i = 0; (c = (char)pgm_read_byte(&name[i])) != 0; i++)
 	{
-		internalStall *= this->stallSensitivity;
+		if(cmd[i] != c)
+		{
+			return 0;
+		}
 	}
-	
-	if(internalStall >= 0.95)		//3 timeconstants
+
+	return i;
+}
+
+/**
+ * @brief      Parse a number terminating a command
+ *
+ *             Accepts digits with an optional decimal point, followed by
+ *             ';'. The digits are collected in an integer, and converted
+ *             to float once at the end.
+ *
+ * @param      text    - Text following the '=' of the command
+ * @param      value   - Receives the number
+ *
+ * @return     true if the text is a valid number
+ */
+static bool dropinCliParseNumber(const char *text, float *value)
+{
+	uint32_t mantissa = 0;
+	int8_t exponent = 0;
+	bool fraction = 0;
+	float scale;
+	uint8_t i;
+
+	for(;; text++)
 	{
-		this->stall = 1;
+		if(*text >= '0' && *text <= '9')
+		{
+			if(mantissa < 100000000UL)
+			{
+				mantissa = (mantissa * 10) + (uint8_t)(*text - '0');
+				if(fraction)
+				{
+					exponent--;
+				}
+			}
+			else if(!fraction && exponent < 30)
+			{
+				exponent++;		//Digits beyond the float precision only scale the value
+			}
+		}
+		else if(*text == '.' && !fraction)
+		{
+			fraction = 1;
+		}
+		else if(*text == ';')
+		{
+			break;
+		}
+		else
+		{
+			return 0;
+		}
 	}
-	else
+
+	for(scale = 1.0, i = (exponent < 0) ? -exponent : exponent; i > 0; i--)
 	{
-		this->stall = 0;
+		scale *= 10.0;		//Powers of ten are exact in float up to 1e10, so the value is rounded only once
 	}
-}
-
-bool uStepperSLite::isStalled(float stallSensitivity)
-{
-  	if(this->stallSensitivity > 1.0)
-  	{
-  		this->stallSensitivity = 1.0;
-  	}
-  	else if(this->stallSensitivity < 0.0)
-  	{
-  		this->stallSensitivity = 0.0;
-  	}
-  	else{
-  		this->stallSensitivity = stallSensitivity;
-  	}
-  	
-	return this->stall;
-}
-
-void uStepperSLite::setProportional(float P)
-{
-	this->pTerm = P;
-}
 
-void uStepperSLite::setIntegral(float I)
-{
-	this->iTerm = I * ENCODERINTSAMPLETIME; 
-}
+	*value = (exponent < 0) ? (float)mantissa / scale : (float)mantissa * scale;
 
-void uStepperSLite::setDifferential(float D)
-{
-	this->dTerm = D * ENCODERINTFREQ;
+	return 1;
 }
 
-void uStepperSLite::invertDropinDir(bool invert)
+void uStepperSLite::parseCommand(String *cmd)
 {
-	this->invertPidDropinDirection = invert;
+	this->parseCommand(cmd->c_str());
 }
 
-void uStepperSLite::parseCommand(String *cmd)
+void uStepperSLite::parseCommand(const char *cmd)
 {
   uint8_t i = 0;
-  String value;
-
-  if(cmd->charAt(2) == ';')
+  uint8_t command = 0xFF;
+  uint8_t length = 0;
+  float value = 0.0;
+#if ISRPROFILING
+  isrProfile_t profile;
+#endif
+
+  if(cmd[0] != 0 && cmd[1] != 0 && cmd[2] == ';')
   {
-    Serial.println("COMMAND NOT ACCEPTED");
+    Serial.println(F("COMMAND NOT ACCEPTED"));
     return;
   }
 
-  value.remove(0);
-  /****************** SET P Parameter ***************************
-  *                                                            *
-  *                                                            *
-  **************************************************************/
-  if(cmd->substring(0,2) == String("P="))
+  for(i = 0; i < sizeof(dropinCliCommands)/sizeof(dropinCliCommand_t); i++)
   {
-    for(i = 2;;i++)
+    length = dropinCliMatch(cmd, (const char *)pgm_read_ptr(&dropinCliCommands[i].name));
+    if(length)
     {
-      if(cmd->charAt(i) >= '0' && cmd->charAt(i) <= '9')
-      {
-        value.concat(cmd->charAt(i));
-      }
-      else if(cmd->charAt(i) == '.')
-      {
-        value.concat(cmd->charAt(i));
-        i++;
-        break;
-      }
-      else if(cmd->charAt(i) == ';')
-      {
-        break;
-      }
-      else
-      {
-        Serial.println("COMMAND NOT ACCEPTED");
-        return;
-      }
-    }
-    
-    for(;;i++)
-    {
-      if(cmd->charAt(i) >= '0' && cmd->charAt(i) <= '9')
-      {
-        value.concat(cmd->charAt(i));
-      }
-      else if(cmd->charAt(i) == ';')
-      {
-        Serial.print("COMMAND ACCEPTED. P = ");
-        Serial.println(value.toFloat(),4);
-        this->dropinSettings.P.f = value.toFloat();
-    	this->saveDropinSettings();
-        this->setProportional(value.toFloat());
-        return;
-      }
-      else
-      {
-        Serial.println("COMMAND NOT ACCEPTED");
-        return;
-      }
+      command = pgm_read_byte(&dropinCliCommands[i].command);
+      break;
     }
   }
 
-/****************** SET I Parameter ***************************
-  *                                                            *
-  *                                                            *
-  **************************************************************/
-  else if(cmd->substring(0,2) == String("I="))
+  if(command == 0xFF)
   {
-    for(i = 2;;i++)
-    {
-      if(cmd->charAt(i) >= '0' && cmd->charAt(i) <= '9')
-      {
-        value.concat(cmd->charAt(i));
-      }
-      else if(cmd->charAt(i) == '.')
-      {
-        value.concat(cmd->charAt(i));
-        i++;
-        break;
-      }
-      else if(cmd->charAt(i) == ';')
-      {
-        break;
-      }
-      else
-      {
-        Serial.println("COMMAND NOT ACCEPTED");
-        return;
-      }
-    }
-    
-    for(;;i++)
-    {
-      if(cmd->charAt(i) >= '0' && cmd->charAt(i) <= '9')
-      {
-        value.concat(cmd->charAt(i));
-      }
-      else if(cmd->charAt(i) == ';')
-      {
-        Serial.print("COMMAND ACCEPTED. I = ");
-        Serial.println(value.toFloat(),4);
-
-        this->dropinSettings.I.f = value.toFloat();
-    	this->saveDropinSettings();
-        this->setIntegral(value.toFloat());
-        return;
-      }
-      else
-      {
-        Serial.println("COMMAND NOT ACCEPTED");
-        return;
-      }
-    }
+    Serial.println(F("COMMAND NOT ACCEPTED"));
+    return;
   }
 
-/****************** SET D Parameter ***************************
-  *                                                            *
-  *                                                            *
-  **************************************************************/
-  else if(cmd->substring(0,2) == String("D="))
+  if(command <= DROPINCLID || command >= DROPINCLIFIRSTVALUE)
   {
-    for(i = 2;;i++)
-    {
-      if(cmd->charAt(i) >= '0' && cmd->charAt(i) <= '9')
-      {
-        value.concat(cmd->charAt(i));
-      }
-      else if(cmd->charAt(i) == '.')
-      {
-        value.concat(cmd->charAt(i));
-        i++;
-        break;
-      }
-      else if(cmd->charAt(i) == ';')
-      {
-        break;
-      }
-      else
-      {
-        Serial.println("COMMAND NOT ACCEPTED");
-        return;
-      }
-    }
-    
-    for(;;i++)
+    if(!dropinCliParseNumber(&cmd[length], &value))
     {
-      if(cmd->charAt(i) >= '0' && cmd->charAt(i) <= '9')
-      {
-        value.concat(cmd->charAt(i));
-      }
-      else if(cmd->charAt(i) == ';')
-      {
-        Serial.print("COMMAND ACCEPTED. D = ");
-        Serial.println(value.toFloat(),4);
-        this->dropinSettings.D.f = value.toFloat();
-    	this->saveDropinSettings();
-        this->setDifferential(value.toFloat());
-        return;
-      }
-      else
-      {
-        Serial.println("COMMAND NOT ACCEPTED");
-        return;
-      }
+      Serial.println(F("COMMAND NOT ACCEPTED"));
+      return;
     }
   }
+  else if(cmd[length] != ';')
+  {
+    Serial.println(F("COMMAND NOT ACCEPTED"));
+    return;
+  }
 
-/****************** invert Direction ***************************
-  *                                                            *
-  *                                                            *
-  **************************************************************/
-  else if(cmd->substring(0,6) == String("invert"))
+  switch(command)
   {
-      if(cmd->charAt(6) != ';')
-      {
-        Serial.println("COMMAND NOT ACCEPTED");
-        return;
-      }
+    /****************** SET P Parameter ***************************
+    *                                                            *
+    *                                                            *
+    **************************************************************/
+    case DROPINCLIP:
+      Serial.print(F("COMMAND ACCEPTED. P = "));
+      Serial.println(value,4);
+      this->dropinSettings.P.f = value;
+      this->saveDropinSettings();
+      this->setProportional(value);
+      break;
+
+    /****************** SET I Parameter ***************************
+    *                                                            *
+    *                                                            *
+    **************************************************************/
+    case DROPINCLII:
+      Serial.print(F("COMMAND ACCEPTED. I = "));
+      Serial.println(value,4);
+      this->dropinSettings.I.f = value;
+      this->saveDropinSettings();
+      this->setIntegral(value);
+      break;
+
+    /****************** SET D Parameter ***************************
+    *                                                            *
+    *                                                            *
+    **************************************************************/
+    case DROPINCLID:
+      Serial.print(F("COMMAND ACCEPTED. D = "));
+      Serial.println(value,4);
+      this->dropinSettings.D.f = value;
+      this->saveDropinSettings();
+      this->setDifferential(value);
+      break;
+
+    /****************** invert Direction ***************************
+    *                                                            *
+    *                                                            *
+    **************************************************************/
+    case DROPINCLIINVERT:
       if(this->invertPidDropinDirection)
       {
-      	Serial.println(F("Direction normal!"));
-      	this->dropinSettings.invert = 0;
-    	this->saveDropinSettings();
+        Serial.println(F("Direction normal!"));
+        this->dropinSettings.invert = 0;
+        this->saveDropinSettings();
         this->invertDropinDir(0);
-        return;
       }
       else
       {
-      	Serial.println(F("Direction inverted!"));
-      	this->dropinSettings.invert = 1;
-    	this->saveDropinSettings();
+        Serial.println(F("Direction inverted!"));
+        this->dropinSettings.invert = 1;
+        this->saveDropinSettings();
         this->invertDropinDir(1);
-        return;
       }
-  }
+      break;
 
-  /****************** get Current Pid Error ********************
-  *                                                            *
-  *                                                            *
-  **************************************************************/
-  else if(cmd->substring(0,5) == String("error"))
-  {
-      if(cmd->charAt(5) != ';')
-      {
-        Serial.println("COMMAND NOT ACCEPTED");
-        return;
-      }
+    /****************** get Current Pid Error ********************
+    *                                                            *
+    *                                                            *
+    **************************************************************/
+    case DROPINCLIERROR:
       Serial.print(F("Current Error: "));
       Serial.print(this->getPidError());
       Serial.println(F(" Steps"));
-  }
+      break;
 
-  /****************** Get run/hold current settings ************
-  *                                                            *
-  *                                                            *
-  **************************************************************/
-  else if(cmd->substring(0,7) == String("current"))
-  {
-      if(cmd->charAt(7) != ';')
-      {
-        Serial.println("COMMAND NOT ACCEPTED");
-        return;
-      }
+    /****************** Get run/hold current settings ************
+    *                                                            *
+    *                                                            *
+    **************************************************************/
+    case DROPINCLICURRENT:
       Serial.print(F("Run Current: "));
       Serial.print(this->driver.getRunCurrent());
       Serial.println(F(" %"));
       Serial.print(F("Hold Current: "));
       Serial.print(this->driver.getHoldCurrent());
       Serial.println(F(" %"));
-  }
+      break;
 
-  /****************** Get PID Parameters ***********************
-  *                                                            *
-  *                                                            *
-  **************************************************************/
-  else if(cmd->substring(0,10) == String("parameters"))
-  {
-      if(cmd->charAt(10) != ';')
-      {
-        Serial.println("COMMAND NOT ACCEPTED");
-        return;
-      }
+    /****************** Get PID Parameters ***********************
+    *                                                            *
+    *                                                            *
+    **************************************************************/
+    case DROPINCLIPARAMETERS:
       Serial.print(F("P: "));
       Serial.print(this->dropinSettings.P.f,4);
       Serial.print(F(", "));
@@ -1767,184 +3583,320 @@ void uStepperSLite::parseCommand(String *cmd)
       Serial.print(F(", "));
       Serial.print(F("D: "));
       Serial.println(this->dropinSettings.D.f,4);
-  }
-
-  /****************** Help menu ********************************
-  *                                                            *
-  *                                                            *
-  **************************************************************/
-  else if(cmd->substring(0,4) == String("help"))
-  {
-      if(cmd->charAt(4) != ';')
+      break;
+
+    /****************** Get ISR profiling statistics *************
+    *                                                            *
+    *                                                            *
+    **************************************************************/
+    case DROPINCLIPROFILE:
+#if ISRPROFILING
+      for(i = 0; i < ISRPROFILECOUNT; i++)
       {
-        Serial.println("COMMAND NOT ACCEPTED");
-        return;
+        this->getIsrProfile(i, &profile);
+        Serial.print(F("ISR "));
+        Serial.print(i);
+        Serial.print(F(": min "));
+        Serial.print(profile.min);
+        Serial.print(F(", mean "));
+        Serial.print(profile.mean);
+        Serial.print(F(", max "));
+        Serial.print(profile.max);
+        Serial.print(F(" cycles, count "));
+        Serial.print(profile.count);
+        Serial.print(F(", overruns "));
+        Serial.println(profile.overruns);
       }
+      this->resetIsrProfile();
+#else
+      Serial.println(F("ISR profiling not enabled"));
+#endif
+      break;
+
+    /****************** Help menu ********************************
+    *                                                            *
+    *                                                            *
+    **************************************************************/
+    case DROPINCLIHELP:
       this->dropinPrintHelp();
-  }
-  
-/****************** SET run current ***************************
-  *                                                            *
-  *                                                            *
-  **************************************************************/
-  else if(cmd->substring(0,11) == String("runCurrent="))
-  {
-    for(i = 11;;i++)
-    {
-      if(cmd->charAt(i) >= '0' && cmd->charAt(i) <= '9')
-      {
-        value.concat(cmd->charAt(i));
-      }
-      else if(cmd->charAt(i) == '.')
-      {
-        value.concat(cmd->charAt(i));
-        i++;
-        break;
-      }
-      else if(cmd->charAt(i) == ';')
-      {
-        break;
-      }
-      else
+      break;
+
+    /****************** SET run/hold current **********************
+    *                                                            *
+    *                                                            *
+    **************************************************************/
+    case DROPINCLIRUNCURRENT:
+    case DROPINCLIHOLDCURRENT:
+      if(value < 0.0 || value > 100.0)
       {
-        Serial.println("COMMAND NOT ACCEPTED");
+        Serial.println(F("COMMAND NOT ACCEPTED"));
         return;
       }
-    }
-    
-    for(;;i++)
-    {
-      if(cmd->charAt(i) >= '0' && cmd->charAt(i) <= '9')
-      {
-        value.concat(cmd->charAt(i));
-      }
-      else if(cmd->charAt(i) == ';')
+      i = (uint8_t)value;
+      if(command == DROPINCLIRUNCURRENT)
       {
-      	if(value.toFloat() >= 0.0 && value.toFloat() <= 100.0)
-      	{
-      		i = (uint8_t)value.toFloat();
-    		break;	
-      	}
-      	else
-      	{
-      		Serial.println("COMMAND NOT ACCEPTED");
-        	return;
-      	}
+        Serial.print(F("COMMAND ACCEPTED. runCurrent = "));
+        Serial.print(i);
+        Serial.println(F(" %"));
+        this->dropinSettings.runCurrent = i;
+        this->saveDropinSettings();
+        this->driver.setRunCurrent(i);
       }
       else
       {
-        Serial.println("COMMAND NOT ACCEPTED");
-        return;
+        Serial.print(F("COMMAND ACCEPTED. holdCurrent = "));
+        Serial.print(i);
+        Serial.println(F(" %"));
+        this->dropinSettings.holdCurrent = i;
+        this->saveDropinSettings();
+        this->driver.setHoldCurrent(i);
       }
-    }
-
-    Serial.print("COMMAND ACCEPTED. runCurrent = ");
-    Serial.print(i);
-    Serial.println(F(" %"));
-    this->dropinSettings.runCurrent = i;
-    this->saveDropinSettings();
-    this->driver.setRunCurrent(i);
+      break;
   }
+}
 
-  /****************** SET run current ***************************
-  *                                                            *
-  *                                                            *
-  **************************************************************/
-  else if(cmd->substring(0,12) == String("holdCurrent="))
-  {
-    for(i = 12;;i++)
-    {
-      if(cmd->charAt(i) >= '0' && cmd->charAt(i) <= '9')
-      {
-        value.concat(cmd->charAt(i));
-      }
-      else if(cmd->charAt(i) == '.')
-      {
-        value.concat(cmd->charAt(i));
-        i++;
-        break;
-      }
-      else if(cmd->charAt(i) == ';')
-      {
-        break;
-      }
-      else
-      {
-        Serial.println(F("COMMAND NOT ACCEPTED"));
-        return;
-      }
-    }
-    
-    for(;;i++)
-    {
-      if(cmd->charAt(i) >= '0' && cmd->charAt(i) <= '9')
-      {
-        value.concat(cmd->charAt(i));
-      }
-      else if(cmd->charAt(i) == ';')
-      {
-      	if(value.toFloat() >= 0.0 && value.toFloat() <= 100.0)
-      	{
-      		i = (uint8_t)value.toFloat();
-    		break;	
-      	}
-      	else
-      	{
-      		Serial.println(F("COMMAND NOT ACCEPTED"));
-        	return;
-      	}
-      }
-      else
-      {
-        Serial.println(F("COMMAND NOT ACCEPTED"));
-        return;
-      }
-    }
+/** Frame being received by dropinProtocolReceive(): opcode, length, payload and CRC */
+static uint8_t dropinFrame[DROPINFRAMEMAXPAYLOAD + 3];
+/** Bytes of the frame received so far, including the sync byte. 0 = waiting for DROPINFRAMESYNC */
+static uint8_t dropinFrameIndex = 0;
 
-    Serial.print(F("COMMAND ACCEPTED. holdCurrent = "));
-    Serial.print(i);
-    Serial.println(F(" %"));
-    this->dropinSettings.holdCurrent = i;
-    this->saveDropinSettings();
-    this->driver.setHoldCurrent(i);
-  }
+bool uStepperSLite::dropinProtocolReceive(uint8_t data)
+{
+	uint8_t length;
 
-  /****************** DEFAULT (Reject!) ************************
-  *                                                            *
-  *                                                            *
-  **************************************************************/
-  else
-  {
-    Serial.println(F("COMMAND NOT ACCEPTED"));
-    return;
-  }
-  
+	if(dropinFrameIndex == 0)
+	{
+		if(data != DROPINFRAMESYNC)
+		{
+			return 0;
+		}
+		dropinFrameIndex = 1;
+		return 1;
+	}
+
+	dropinFrame[dropinFrameIndex - 1] = data;
+	dropinFrameIndex++;
+
+	if(dropinFrameIndex < 3)
+	{
+		return 1;
+	}
+
+	length = dropinFrame[1];
+	if(length > DROPINFRAMEMAXPAYLOAD)
+	{
+		dropinFrameIndex = 0;		//Not a valid frame, wait for the next sync byte
+		return 1;
+	}
+
+	if(dropinFrameIndex == length + 4)		//Sync, opcode, length, payload and CRC received
+	{
+		dropinFrameIndex = 0;
+		if(this->driver.calcCRC(dropinFrame, length + 2) == dropinFrame[length + 2])
+		{
+			this->dropinProtocolExecute(dropinFrame[0], &dropinFrame[2], length);
+		}
+	}
+
+	return 1;
 }
 
-void uStepperSLite::dropinCli()
+/**
+ * @brief      Send a response frame of the dropin binary protocol
+ *
+ * @param      opcode  - opcode of the request
+ * @param      status  - DROPINSTATUSOK ...
+ * @param      data    - data following the status byte
+ * @param      length  - number of data bytes
+ * @param      driver  - driver object, providing the CRC calculation
+ */
+static void dropinProtocolRespond(uint8_t opcode, uint8_t status, const uint8_t *data, uint8_t length, Tmc2208 *driver)
+{
+	uint8_t frame[DROPINFRAMEMAXPAYLOAD + 3];
+	uint8_t i;
+
+	frame[0] = opcode | DROPINOPRESPONSE;
+	frame[1] = length + 1;
+	frame[2] = status;
+	for(i = 0; i < length; i++)
+	{
+		frame[i + 3] = data[i];
+	}
+	frame[length + 3] = driver->calcCRC(frame, length + 3);
+
+	Serial.write(DROPINFRAMESYNC);
+	Serial.write(frame, length + 4);
+}
+
+void uStepperSLite::dropinProtocolExecute(uint8_t opcode, uint8_t *payload, uint8_t length)
 {
-	static String stringInput;
-	static uint32_t t = millis();
+	dropinCliSettings_t settings = this->dropinSettings;
+	uint8_t response[DROPINFRAMEMAXPAYLOAD - 1];
+	uint8_t responseLength = 0;
+	uint8_t status = DROPINSTATUSOK;
+	floatBytes_t value;
+	uint8_t expectedLength;
+	bool store = 0;
+
+	switch(opcode)
+	{
+		case DROPINOPGETVERSION:
+		case DROPINOPGETPARAMETERS:
+		case DROPINOPGETERROR:
+			expectedLength = 0;
+			break;
+		case DROPINOPSETPARAMETERS:
+			expectedLength = 15;
+			break;
+		case DROPINOPSETP:
+		case DROPINOPSETI:
+		case DROPINOPSETD:
+			expectedLength = 4;
+			break;
+		case DROPINOPSETINVERT:
+		case DROPINOPSETRUNCURRENT:
+		case DROPINOPSETHOLDCURRENT:
+			expectedLength = 1;
+			break;
+		default:
+			dropinProtocolRespond(opcode, DROPINSTATUSUNKNOWN, NULL, 0, &this->driver);
+			return;
+	}
+
+	if(length != expectedLength)
+	{
+		dropinProtocolRespond(opcode, DROPINSTATUSLENGTH, NULL, 0, &this->driver);
+		return;
+	}
+
+	switch(opcode)
+	{
+		case DROPINOPGETVERSION:
+			response[0] = DROPINPROTOCOLVERSION;
+			responseLength = 1;
+			break;
+		case DROPINOPGETPARAMETERS:
+			memcpy(response, &this->dropinSettings, 15);		//P, I, D, invert, holdCurrent and runCurrent
+			responseLength = 15;
+			break;
+		case DROPINOPGETERROR:
+			value.f = this->getPidError();
+			memcpy(response, value.bytes, 4);
+			responseLength = 4;
+			break;
+		case DROPINOPSETPARAMETERS:
+			memcpy(&settings, payload, 15);
+			store = 1;
+			break;
+		case DROPINOPSETP:
+			memcpy(settings.P.bytes, payload, 4);
+			store = 1;
+			break;
+		case DROPINOPSETI:
+			memcpy(settings.I.bytes, payload, 4);
+			store = 1;
+			break;
+		case DROPINOPSETD:
+			memcpy(settings.D.bytes, payload, 4);
+			store = 1;
+			break;
+		case DROPINOPSETINVERT:
+			settings.invert = payload[0];
+			store = 1;
+			break;
+		case DROPINOPSETRUNCURRENT:
+			settings.runCurrent = payload[0];
+			store = 1;
+			break;
+		case DROPINOPSETHOLDCURRENT:
+			settings.holdCurrent = payload[0];
+			store = 1;
+			break;
+	}
+
+	if(store)
+	{
+		if(!(settings.P.f >= 0.0 && settings.I.f >= 0.0 && settings.D.f >= 0.0) ||		//Also rejects NaN
+			settings.invert > 1 || settings.runCurrent > 100 || settings.holdCurrent > 100)
+		{
+			status = DROPINSTATUSVALUE;
+		}
+		else
+		{
+			this->dropinSettings = settings;
+			this->saveDropinSettings();
+			this->applyDropinSettings();
+		}
+	}
+
+	dropinProtocolRespond(opcode, status, response, responseLength, &this->driver);
+}
+
+/** Text command being received by dropinCliService() */
+static char dropinCliInput[DROPINCLIBUFFERLENGTH + 1];
+/** Number of characters in dropinCliInput */
+static uint8_t dropinCliInputLength = 0;
+/** Set when the text command did not fit in dropinCliInput */
+static bool dropinCliInputOverflow = 0;
+/** Time of the last byte received by dropinCliService(), in ms */
+static uint32_t dropinCliLastInput = 0;
 
+void uStepperSLite::dropinCli()
+{
 	while(1)
 	{
-		while(!Serial.available())
+		this->dropinCliService();
+		delay(1);
+	}
+}
+
+void uStepperSLite::dropinCliService(void)
+{
+	uint8_t data;
+
+	if(!Serial.available())
+	{
+		if((millis() - dropinCliLastInput) >= 500)		//Drop partial commands after 500 ms of silence
 		{
-			delay(1);
-			if((millis() - t) >= 500)
-			{
-				stringInput.remove(0);
-				t = millis();
-			}
+			dropinCliInputLength = 0;
+			dropinCliInputOverflow = 0;
+			dropinFrameIndex = 0;
+			dropinCliLastInput = millis();
+		}
+		return;
+	}
+
+	while(Serial.available())
+	{
+		data = (uint8_t)Serial.read();
+		if(this->dropinProtocolReceive(data))
+		{
+			continue;
+		}
+		if(dropinCliInputLength < DROPINCLIBUFFERLENGTH)
+		{
+			dropinCliInput[dropinCliInputLength++] = (char)data;
+		}
+		else
+		{
+			dropinCliInputOverflow = 1;		//Longer than any command, reject it when it ends
 		}
-		t = millis();
-		stringInput += (char)Serial.read();
-		if(stringInput.lastIndexOf(';') > -1)
+		if(data == ';')
 		{
-		  this->parseCommand(&stringInput);
-		  stringInput.remove(0);
+			dropinCliInput[dropinCliInputLength] = 0;
+			if(dropinCliInputOverflow)
+			{
+				Serial.println(F("COMMAND NOT ACCEPTED"));
+			}
+			else
+			{
+				this->parseCommand(dropinCliInput);
+			}
+			dropinCliInputLength = 0;
+			dropinCliInputOverflow = 0;
 		}
 	}
+	dropinCliLastInput = millis();
 }
 
 void uStepperSLite::dropinPrintHelp()
@@ -1962,6 +3914,7 @@ void uStepperSLite::dropinPrintHelp()
 	Serial.println(F("Get Run/Hold Current Settings: 'current;'"));
 	Serial.println(F("Set Run Current (percent): 'runCurrent=50.0;'"));
 	Serial.println(F("Set Hold Current (percent): 'holdCurrent=50.0;'"));
+	Serial.println(F("Print and clear ISR profiling statistics: 'profile;'"));
 	Serial.println(F(""));
 	Serial.println(F(""));
 }
@@ -1978,12 +3931,17 @@ bool uStepperSLite::loadDropinSettings(void)
 	}
 
 	this->dropinSettings = tempSettings;
+	this->applyDropinSettings();
+	return 1;
+}
+
+void uStepperSLite::applyDropinSettings(void)
+{
 	this->setProportional(this->dropinSettings.P.f);
 	this->setIntegral(this->dropinSettings.I.f);
 	this->setDifferential(this->dropinSettings.D.f);
 	this->invertDropinDir((bool)this->dropinSettings.invert);
 	this->setCurrent(this->dropinSettings.runCurrent,this->dropinSettings.holdCurrent);	
-	return 1;
 }
 
 void uStepperSLite::saveDropinSettings(void)
@@ -124,7 +124,7 @@
 #ifndef _USTEPPER_S_LITE_H_
 #define _USTEPPER_S_LITE_H_
 
-#ifndef __AVR_ATmega328PB__
+#if !defined(__AVR_ATmega328PB__) && !defined(USTEPPER_HOST)
 #error !!This library only supports the ATmega328pb MCU!!
 #endif
 
@@ -159,6 +159,81 @@ typedef struct
 	uint8_t checksum;			/**< Checksum	*/
 }dropinCliSettings_t;
 
+/**
+ * @brief      	Struct holding execution time statistics of an interrupt routine
+ *
+ *				Filled by the ISR profiling build (ISRPROFILING set to 1). All times
+ *				are in CPU cycles, measured with timer four running freely at F_CPU.
+ * 
+ */
+typedef struct
+{
+	uint16_t min;				/**< Shortest execution time measured	*/
+	uint16_t max;				/**< Longest execution time measured	*/
+	uint16_t mean;				/**< Mean execution time. Only calculated by uStepperSLite::getIsrProfile()	*/
+	uint32_t sum;				/**< Sum of all execution times measured	*/
+	uint32_t count;				/**< Number of executions measured	*/
+	uint16_t overruns;			/**< Number of executions not finished before the routine was due again	*/
+}isrProfile_t;
+
+/**
+ * @brief      	Struct holding a move waiting in the motion queue
+ *
+ *				@see uStepperSLite::queueMoveSteps()
+ * 
+ */
+typedef struct
+{
+	int32_t steps;				/**< Number of steps to move	*/
+	uint8_t dir;				/**< Direction of the move. CW or CCW	*/
+	uint8_t holdMode;			/**< Brake mode to use if the motor stops after this move. HARD or SOFT	*/
+}moveQueueEntry_t;
+
+/**
+ * @brief      	Function called when homing is done
+ *
+ *				Called in interrupt context: from encoderSampleReady(), the completion of
+ *				the encoder read in the I2C interrupt, while the control loop waits for it.
+ *				It must be short and must not block: no Serial output, delay(), waiting
+ *				for a move, or driver register reads (these disable interrupts for about
+ *				0.25 ms). To do such work, poll getHomingState() for HOMINGDONE in the
+ *				main loop instead.
+ *
+ * @param[in]	lengthMoved - Degrees turned from the start of the homing, till the end was reached
+ */
+typedef void (*homingCallback_t)(float lengthMoved);
+
+/**
+ * @brief      	Struct holding one encoder sample recorded by the trace
+ *
+ *				@see uStepperSLite::startTrace()
+ * 
+ */
+typedef struct
+{
+	int32_t angleMoved;			/**< Encoder position, in encoder counts (4096 per revolution)	*/
+	float pidTargetPosition;	/**< Position of the motion profile, in steps	*/
+	float pidError;				/**< Error of the PID controller, in steps	*/
+	uint32_t stepDelay;			/**< Delay between steps, in step generator ticks Q24.8	*/
+	uint8_t state;				/**< State of the motion profile (STOP, ACCEL, CRUISE, DECEL or INITDECEL)	*/
+}traceRecord_t;
+
+/**
+ * @brief      	Struct holding the state of the motion controller at one encoder sample
+ *
+ *				@see uStepperSLite::getSnapshot()
+ * 
+ */
+typedef struct
+{
+	uint32_t sequence;			/**< Number of the encoder sample, counting from 1. 0 if no sample has been taken yet	*/
+	int32_t angleMoved;			/**< Encoder position, in encoder counts (4096 per revolution)	*/
+	int32_t stepsSinceReset;	/**< Steps applied since reset, as returned by uStepperSLite::getStepsSinceReset()	*/
+	float pidError;				/**< Error of the PID controller, in steps	*/
+	float speed;				/**< Speed measured by the encoder, in steps per second	*/
+	uint8_t state;				/**< State of the motion profile (STOP, ACCEL, CRUISE, DECEL or INITDECEL)	*/
+}motionSnapshot_t;
+
 /** @name I2C0 defines
  *  Defines necessary to use I2C0 
  */
@@ -180,8 +255,7 @@ typedef struct
 ///@}
 
 #include <inttypes.h>
-#include <avr/io.h>
-#include <util/delay.h>
+#include "uStepperHal.h"
 #include <Arduino.h>
 #include <uStepperServo.h>
 #include "TMC2208.h"
@@ -226,17 +300,154 @@ typedef struct
 /** Value to put in hold variable in order for the motor to \b not block when it is not running */
 #define SOFT 0							
 /** Value to convert angle moved between samples to RPM. */
-#define DELTAANGLETORPM ENCODERINTFREQ*(60.0/4095.0)
+#define DELTAANGLETORPM (ENCODERINTFREQ*(60.0/4095.0))
 /** Value to convert angle moved between samples to steps per second. */
-#define DELTAANGLETOSTEPSPERSECOND ENCODERINTFREQ*(3200.0/4095.0)
+#define DELTAANGLETOSTEPSPERSECOND (ENCODERINTFREQ*(3200.0/4095.0))
+/** @name Homing states
+ *	Values returned by uStepperSLite::getHomingState()
+ */
+///@{
+/** No homing has been started */
+#define HOMINGIDLE 0
+/** The motor is stopped, and waits before seeking the end */
+#define HOMINGSETTLE 1
+/** The motor runs towards the end, at the fast homing speed */
+#define HOMINGSEEK 2
+/** The motor moves away from the end */
+#define HOMINGBACKOFF 3
+/** The motor runs towards the end again, at the slow homing speed */
+#define HOMINGAPPROACH 4
+/** The motor has backed off for the last time, and waits before setting the home position */
+#define HOMINGFINISH 5
+/** The home position is set */
+#define HOMINGDONE 6
+///@}
+/** Time to let the motor come to rest before running towards the end, in ms */
+#define HOMINGSETTLETIME 50
+/** Time after starting to run towards the end, in which stalls are ignored, in ms */
+#define HOMINGBLANKINGTIME 200
+/** Time to let the motor come to rest after backing off, before setting the home position, in ms */
+#define HOMINGFINISHTIME 100
+/** Converts a homing time in ms to a number of encoder samples */
+#define HOMINGSAMPLES(ms) ((uint16_t)(((uint32_t)(ms) * ENCODERINTFREQ) / 1000))
+/** @name Stall detection algorithms
+ *	Values used by uStepperSLite::setStallDetection()
+ */
+///@{
+/** Low pass filtered speed of the encoder compared to the speed of the motion profile (default) */
+#define STALLDETECTIIR 0
+/** Distance between the encoder and the motion profile, compared to a threshold */
+#define STALLDETECTFOLLOWINGERROR 1
+/** Distance moved by the encoder in a window of samples, compared to the motion profile */
+#define STALLDETECTVELOCITYRATIO 2
+/** No stall detection */
+#define STALLDETECTOFF 3
+///@}
+/** @name Trace states
+ *	Values returned by uStepperSLite::getTraceState()
+ */
+///@{
+/** Nothing recorded since startup or the last dump */
+#define TRACEIDLE 0
+/** Recording, waiting for the trigger */
+#define TRACEARMED 1
+/** Recording the samples following the trigger */
+#define TRACETRIGGERED 2
+/** Recording finished, ready to be dumped */
+#define TRACEDONE 3
+///@}
+/** @name Trace triggers
+ *	Events starting a trace. @see uStepperSLite::startTrace()
+ */
+///@{
+/** Trigger at once */
+#define TRACETRIGGERNOW 0
+/** Trigger when the motor starts moving */
+#define TRACETRIGGERMOVE 1
+/** Trigger when a stall is detected */
+#define TRACETRIGGERSTALL 2
+///@}
+/** First byte of a trace frame, followed by TRACEFRAMESYNC2 */
+#define TRACEFRAMESYNC1 0xA5
+/** Second byte of a trace frame */
+#define TRACEFRAMESYNC2 0x5A
+/** Format version of the trace frame */
+#define TRACEFRAMEVERSION 1
+/** @name Dropin binary protocol
+ *	Frames accepted by dropinCli() next to the text commands. A frame is DROPINFRAMESYNC,
+ *	the opcode, the payload length, the payload and a CRC8 of the opcode, length and
+ *	payload (polynomial 0x07, as used by the TMC2208 UART). Every request is answered
+ *	with a frame carrying the opcode OR'ed with DROPINOPRESPONSE, and a payload
+ *	starting with a status byte. Values are little endian, floats are IEEE 754.
+ *	extras/uStepperProtocol.py implements the host side.
+ */
+///@{
+/** First byte of a binary frame. Not an ASCII character, so it never starts a text command */
+#define DROPINFRAMESYNC 0xC5
+/** Largest payload of a binary frame */
+#define DROPINFRAMEMAXPAYLOAD 16
+/** Version of the binary protocol, returned by DROPINOPGETVERSION */
+#define DROPINPROTOCOLVERSION 1
+/** Get the protocol version. Response: version (uint8_t) */
+#define DROPINOPGETVERSION 0x00
+/** Get the dropin settings. Response: P, I, D (float), invert, holdCurrent, runCurrent (uint8_t) */
+#define DROPINOPGETPARAMETERS 0x01
+/** Set and store all dropin settings. Payload: as the response of DROPINOPGETPARAMETERS */
+#define DROPINOPSETPARAMETERS 0x02
+/** Set and store the proportional gain. Payload: P (float) */
+#define DROPINOPSETP 0x03
+/** Set and store the integral gain. Payload: I (float) */
+#define DROPINOPSETI 0x04
+/** Set and store the differential gain. Payload: D (float) */
+#define DROPINOPSETD 0x05
+/** Set and store the direction inversion. Payload: 0 = normal, 1 = inverted (uint8_t) */
+#define DROPINOPSETINVERT 0x06
+/** Set and store the run current. Payload: 0 - 100 % (uint8_t) */
+#define DROPINOPSETRUNCURRENT 0x07
+/** Set and store the hold current. Payload: 0 - 100 % (uint8_t) */
+#define DROPINOPSETHOLDCURRENT 0x08
+/** Get the PID error. Response: error in steps (float) */
+#define DROPINOPGETERROR 0x09
+/** Set in the opcode of a response */
+#define DROPINOPRESPONSE 0x80
+/** Status: request executed */
+#define DROPINSTATUSOK 0
+/** Status: opcode not known */
+#define DROPINSTATUSUNKNOWN 1
+/** Status: payload length not valid for the opcode */
+#define DROPINSTATUSLENGTH 2
+/** Status: value out of range */
+#define DROPINSTATUSVALUE 3
+///@}
 /** Value to put in hold variable in order for the motor to block when it is not running */
 #define BRAKEON 1
 /** Value to put in hold variable in order for the motor to \b not block when it is not running */
 #define BRAKEOFF 0
-/** Frequency at which the encoder is sampled, for keeping track of angle moved and current speed */
-#define ENCODERINTFREQ 500.0	
+/** Frequency in Hz at which the encoder is sampled, for keeping track of angle moved and current speed.
+ *	Can be overridden from the compiler command line (e.g. -DENCODERINTFREQ=1000). Must be an integer,
+ *	as it is range checked by the preprocessor. All gains and timer settings depending on the sample
+ *	rate are derived from this value */
+#ifndef ENCODERINTFREQ
+#define ENCODERINTFREQ 500
+#endif
 /** Encoder Sample period, for keeping track of angle moved and current speed */	
-#define ENCODERINTSAMPLETIME 1.0/ENCODERINTFREQ	
+#define ENCODERINTSAMPLETIME (1.0/ENCODERINTFREQ)
+/** Value loaded into ICR1, to make timer one overflow at ENCODERINTFREQ (no prescaler) */
+#define ENCODERTIMERTOP ((F_CPU/ENCODERINTFREQ) - 1)
+
+#if ENCODERTIMERTOP > 65535
+	#error "ENCODERINTFREQ too low. Timer one can not run slower than F_CPU/65536"
+#endif
+/* The AS5600 samples the angle every 150 us (datasheet), so at 4000 Hz (250 us) every encoder
+ * sample still sees a new conversion. Of the 250 us, the angle read takes about 33 us on the
+ * bus (29 bit times at TWBR = 1, about 889 kHz, simulated). The time left for the control loop
+ * has not been measured on hardware: check encoderIntOverBudget when raising ENCODERINTFREQ */
+#if ENCODERINTFREQ > 4000
+	#error "ENCODERINTFREQ too high. The encoder can not be sampled faster than 4000 Hz"
+#endif
+#if (F_CPU % ENCODERINTFREQ) != 0
+	#warning "F_CPU is not a multiple of ENCODERINTFREQ. The actual sample rate will differ slightly"
+#endif
 /** I2C address of the encoder chip */
 #define ENCODERADDR 0x36				
 /** Address of the register, in the encoder chip, containing the 8 least significant bits of the stepper shaft angle */
@@ -250,26 +461,248 @@ typedef struct
 /**	P term in the PI filter estimating the step rate of incomming pulsetrain in DROPIN mode*/
 #define PULSEFILTERKP 60.0
 /**	I term in the PI filter estimating the step rate of incomming pulsetrain in DROPIN mode*/
-#define PULSEFILTERKI 500.0*ENCODERINTSAMPLETIME
+#define PULSEFILTERKI (500.0*ENCODERINTSAMPLETIME)
+/** @name Speed observers
+ *	Values used by uStepperSLite::setSpeedObserver()
+ */
+///@{
+/** PI tracking loop (PLL), with the gains PULSEFILTERKP and PULSEFILTERKI at SPEEDOBSERVERPLLBANDWIDTH (default).
+ *	Floating point, or fixed point with CONTROLFIXEDPOINT */
+#define SPEEDOBSERVERPLL 0
+/** Critically damped alpha-beta tracker. Fixed point */
+#define SPEEDOBSERVERALPHABETA 1
+/** Steady state Kalman filter of a constant velocity model, i.e. an alpha-beta tracker with the
+ *	Kalata gains (damping around 0.7). Fixed point */
+#define SPEEDOBSERVERKALMAN 2
+///@}
+/** Natural frequency, in Hz, of the PLL speed observer with the gains PULSEFILTERKP and PULSEFILTERKI (3.6 Hz) */
+#define SPEEDOBSERVERPLLBANDWIDTH (sqrt(PULSEFILTERKI*ENCODERINTFREQ)/(2.0*M_PI))
+/** Speed observer used from startup */
+#ifndef SPEEDOBSERVER
+#define SPEEDOBSERVER SPEEDOBSERVERPLL
+#endif
+/** Bandwidth (natural frequency in Hz) of the speed observer used from startup */
+#ifndef SPEEDOBSERVERBANDWIDTH
+#define SPEEDOBSERVERBANDWIDTH SPEEDOBSERVERPLLBANDWIDTH
+#endif
+/** Lowest speed observer bandwidth accepted by setSpeedObserver(), in Hz */
+#define SPEEDOBSERVERMINBANDWIDTH 0.1
+/** Highest speed observer bandwidth accepted by setSpeedObserver(), in Hz */
+#define SPEEDOBSERVERMAXBANDWIDTH (ENCODERINTFREQ/20.0)
+/** Encoder samples in the time constant aimed at by the STALLDETECTIIR low pass filters (0.2 s) */
+#define STALLFILTERSAMPLES (ENCODERINTFREQ/5)
+/** The low pass filters of the STALLDETECTIIR stall detection have a time constant of 2^STALLFILTERSHIFT encoder samples,
+ *  the power of two nearest to STALLFILTERSAMPLES (7, 256 ms, at 500 Hz) */
+#ifndef STALLFILTERSHIFT
+	#if STALLFILTERSAMPLES*STALLFILTERSAMPLES >= (1L << 21)
+		#error "ENCODERINTFREQ out of range of the STALLDETECTIIR filters, define STALLFILTERSHIFT"
+	#elif STALLFILTERSAMPLES*STALLFILTERSAMPLES >= (1L << 19)
+		#define STALLFILTERSHIFT 10
+	#elif STALLFILTERSAMPLES*STALLFILTERSAMPLES >= (1L << 17)
+		#define STALLFILTERSHIFT 9
+	#elif STALLFILTERSAMPLES*STALLFILTERSAMPLES >= (1L << 15)
+		#define STALLFILTERSHIFT 8
+	#elif STALLFILTERSAMPLES*STALLFILTERSAMPLES >= (1L << 13)
+		#define STALLFILTERSHIFT 7
+	#elif STALLFILTERSAMPLES*STALLFILTERSAMPLES >= (1L << 11)
+		#define STALLFILTERSHIFT 6
+	#else
+		#error "ENCODERINTFREQ out of range of the STALLDETECTIIR filters, define STALLFILTERSHIFT"
+	#endif
+#endif
+/** Following error, in full steps, reported as a stall by STALLDETECTFOLLOWINGERROR at a stall sensitivity of 1.0 */
+#ifndef STALLFOLLOWINGERRORMAX
+#define STALLFOLLOWINGERRORMAX 8
+#endif
+/** Number of encoder samples in a window of the STALLDETECTVELOCITYRATIO stall detection */
+#ifndef STALLWINDOWLENGTH
+#define STALLWINDOWLENGTH 32
+#endif
+/** Largest number of stalled windows in a row needed by STALLDETECTVELOCITYRATIO, reached at a stall sensitivity of 1.0 */
+#define STALLWINDOWCOUNTMAX 8
+/** Encoder counts the motor should turn in a window, before STALLDETECTVELOCITYRATIO judges the window */
+#define STALLWINDOWMINCOUNTS 8
+/** Largest number of encoder samples averaged by the S-curve filter (see setMaxJerk()). Bounds the lowest jerk, and uses 4 bytes of RAM per sample */
+#ifndef JERKFILTERMAXLENGTH
+#define JERKFILTERMAXLENGTH 32
+#endif
+/** Number of moves the motion queue can hold. Uses 6 bytes of RAM per move */
+#ifndef MOVEQUEUELENGTH
+#define MOVEQUEUELENGTH 8
+#endif
+/** Set to 1 to run the PLL speed observer in fixed point arithmetic, instead of software float */
+#ifndef CONTROLFIXEDPOINT
+#define CONTROLFIXEDPOINT 0
+#endif
+/** Maximum number of CPU cycles the encoder interrupt may use, before it is counted as over budget. Defaults to half the sample period */
+#ifndef ENCODERINTCYCLEBUDGET
+#define ENCODERINTCYCLEBUDGET ((uint16_t)((ENCODERTIMERTOP + 1)/2))
+#endif
+/** Set to 1 to read the encoder with the interrupt driven I2C transaction, or 0 to use the blocking read inside the encoder interrupt */
+#ifndef ENCODERASYNCREAD
+#define ENCODERASYNCREAD 1
+#endif
+/** Number of encoder samples between reads of the encoder diagnostics into the cache returned by detectMagnet(),
+ *	getAgc() and getStrength(). One register is read at a time, so every register is refreshed every
+ *	ENCODERDIAGCOUNT*ENCODERDIAGINTERVAL samples (96 ms at 500 Hz) */
+#ifndef ENCODERDIAGINTERVAL
+#define ENCODERDIAGINTERVAL 16
+#endif
+/** @name Encoder diagnostics
+ *	Registers read into the diagnostics cache by TIMER1_COMPB_vect, in this order
+ */
+///@{
+/** STATUS register, returned by detectMagnet() */
+#define ENCODERDIAGSTATUS 0
+/** AGC register, returned by getAgc() */
+#define ENCODERDIAGAGC 1
+/** MAGNITUDE register, returned by getStrength() */
+#define ENCODERDIAGMAGNITUDE 2
+/** Number of registers in the diagnostics cache */
+#define ENCODERDIAGCOUNT 3
+///@}
+/** @name Step engines
+ *	Step pulse generators selectable with STEPENGINE
+ */
+///@{
+/** Timer three interrupt at STEPGENERATORFREQUENCY, counting ticks between steps (stepGenerator.S) */
+#define STEPENGINETICK 0
+/** Timer three running freely, with the compare register programmed to the time of the next step */
+#define STEPENGINECOMPARE 1
+/** No step pulses. The TMC2208 runs from VACTUAL, set by the encoder interrupt, with the encoder closing the position loop */
+#define STEPENGINEVACTUAL 2
+///@}
+/** Step engine to use. STEPENGINECOMPARE uses one interrupt per step instead of one per tick, which
+ *	frees most of the CPU at low and medium speeds. At high step rates the per-step interrupt is longer
+ *	than a tick, so STEPENGINETICK stays the default. STEPENGINEVACTUAL has no step interrupt at all, at
+ *	the cost of a UART write to the driver in most encoder samples while moving */
+#ifndef STEPENGINE
+#define STEPENGINE STEPENGINETICK
+#endif
+#if STEPENGINE == STEPENGINECOMPARE
+	/** Timer three clock select, prescaler 8 (2 MHz) */
+	#define STEPTIMERCLOCKSELECT (1 << CS31)
+	/** Timer three counts per step generator tick */
+	#define STEPENGINECOUNTSPERTICK 20
+	/** Maximum time between two compare interrupts, in timer counts (2 ms), so new speeds are picked up within an encoder sample */
+	#define STEPENGINEMAXCHUNK 4000
+	/** Minimum time from the end of the interrupt to the next compare match, in timer counts */
+	#define STEPENGINEMINLEAD 8
+	/** Attributes of the step generator interrupt routine */
+	#define STEPGENERATORISR HALISR
+#elif STEPENGINE == STEPENGINEVACTUAL
+	/** Timer three is not used */
+	#define STEPTIMERCLOCKSELECT 0
+	/** Attributes of the step generator interrupt routine (never enabled) */
+	#define STEPGENERATORISR HALNAKEDISR
+	/** Gain of the position loop in NORMAL mode, steps per second of speed correction per step of position error */
+	#ifndef VACTUALPOSITIONGAIN
+	#define VACTUALPOSITIONGAIN 20.0
+	#endif
+	/** Largest speed correction of the position loop, in steps per second */
+	#ifndef VACTUALMAXCORRECTION
+	#define VACTUALMAXCORRECTION 2000.0
+	#endif
+	/** Lowest speed while decelerating, in steps per second, as the 5 steps/s floor of the other step engines */
+	#define VACTUALMINSPEED 5.0
+#else
+	/** Timer three clock select, no prescaler */
+	#define STEPTIMERCLOCKSELECT (1 << CS30)
+	/** Attributes of the step generator interrupt routine */
+	#define STEPGENERATORISR HALNAKEDISR
+#endif
+/** Baud rate of Serial in dropin mode, used by the text and binary command interfaces */
+#ifndef DROPINBAUDRATE
+#define DROPINBAUDRATE 9600
+#endif
+/** Size of the buffer holding a text command of the dropin CLI. Longer commands are rejected */
+#ifndef DROPINCLIBUFFERLENGTH
+#define DROPINCLIBUFFERLENGTH 32
+#endif
+/** Number of records in the trace buffer filled by the encoder interrupt (see uStepperSLite::startTrace()).
+ *	0 = no tracing. Uses 17 bytes of RAM per record */
+#ifndef TRACEBUFFERLENGTH
+#define TRACEBUFFERLENGTH 0
+#endif
+/** Set to 1 to build the library with execution time profiling of the interrupt routines and the
+ *	PID controller. Should be given on the compiler command line (-DISRPROFILING=1), as the assembler
+ *	step generator is only instrumented when it sees the define. Uses timer four */
+#ifndef ISRPROFILING
+#define ISRPROFILING 0
+#endif
+/** @name ISR profiling identifiers
+ *	Routines measured by the ISR profiling build. @see uStepperSLite::getIsrProfile()
+ */
+///@{
+/** Encoder sampling interrupt (TIMER1_COMPA_vect) */
+#define ISRPROFILEENCODER 0
+/** Processing of an encoder sample, speed filter and motion profile (encoderSampleReady()) */
+#define ISRPROFILESAMPLE 1
+/** Step generator interrupt (TIMER3_COMPA_vect and _stepGenerator) */
+#define ISRPROFILESTEPGENERATOR 2
+/** Dropin step input interrupt (INT0_vect) */
+#define ISRPROFILEDROPIN 3
+/** PID controller, in PID and DROPIN mode (pid() and pidDropin()) */
+#define ISRPROFILEPID 4
+/** Stall detection (detectStall()) */
+#define ISRPROFILESTALL 5
+/** Latency of the encoder sampling interrupt, from the timer compare match until TIMER1_COMPA_vect
+ *	is entered (including the entry of the routine). Grows with the time interrupts are disabled elsewhere */
+#define ISRPROFILEENCODERLATENCY 6
+/** Number of profiled routines */
+#define ISRPROFILECOUNT 7
+///@}
 /** Value defining return of speed in Steps Per Second */
 #define SPS 0
 /** Value defining return of speed in Revolutions Per Minute */
 #define RPM 1
 
+/**
+ * @brief      Samples the encoder.
+ *
+ *             This interrupt routine is in charge of sampling the encoder. With
+ *             ENCODERASYNCREAD set, it only starts the read of the angle, and
+ *             the sample is processed by encoderSampleReady() from the TWI
+ *             interrupt, once the angle has been received.
+ */
+extern "C" void TIMER1_COMPA_vect(void) HALISR;
+
 /**
  * @brief      Measures angle and speed of motor.
  *
- *             This interrupt routine is in charge of sampling the encoder and
- *             measure the current speed of the motor. 
+ *             Called with the angle read by TIMER1_COMPA_vect. This function is
+ *             in charge of measuring the current speed of the motor, and runs
+ *             the motion profile and control loops.
+ *
+ * @param      success  - true if the angle was read from the encoder, false
+ *                      if the read failed and the sample should be skipped
+ */
+void encoderSampleReady(bool success);
+
+/**
+ * @brief      Reads the encoder diagnostics.
+ *
+ *             Runs half a sample period after TIMER1_COMPA_vect, when the
+ *             angle has been read. Every ENCODERDIAGINTERVAL samples, it
+ *             starts an interrupt driven read of the next register of the
+ *             diagnostics cache (STATUS, AGC or MAGNITUDE), so the diagnostic
+ *             functions of uStepperEncoder do not use the bus.
+ */
+extern "C" void TIMER1_COMPB_vect(void) HALISR;
+
+/**
+ * @brief      Stores a diagnostics register read by TIMER1_COMPB_vect in the cache.
+ *
+ * @param      success  - true if the register was read from the encoder
  */
-extern "C" void TIMER1_COMPA_vect(void) __attribute__ ((signal,used));
+void encoderDiagReady(bool success);
 
 /**
  * @brief      Handles accelerations.
  *
  *             This interrupt routine is in charge of acceleration and deceleration.
  */
-extern "C" void TIMER3_COMPA_vect(void) __attribute__ ((signal,used,naked));
+extern "C" void TIMER3_COMPA_vect(void) STEPGENERATORISR;
 
 /**
  * @brief      Used by dropin feature to take in step pulses
@@ -277,7 +710,7 @@ extern "C" void TIMER3_COMPA_vect(void) __attribute__ ((signal,used,naked));
  *             This interrupt routine is used by the dropin feature to keep
  *             track of step and direction pulses from main controller
  */
-extern "C" void INT0_vect(void) __attribute__ ((signal,used));
+extern "C" void INT0_vect(void) HALISR;
 
 /**
  * @brief      Used by dropin feature to take in enable signal
@@ -285,7 +718,7 @@ extern "C" void INT0_vect(void) __attribute__ ((signal,used));
  *             This interrupt routine is used by the dropin feature to keep
  *             track of enable signal from main controller
  */
-extern "C" void INT1_vect(void) __attribute__ ((signal,used));
+extern "C" void INT1_vect(void) HALISR;
 
 /**
  * @brief      Prototype of class for the AS5600 encoder
@@ -319,6 +752,9 @@ public:
 	/** Variable used to store the current rotational speed of
 	* the motor shaft */
 	volatile float curSpeed;			 	
+
+	/** Speed of the motor shaft in Q16.16 encoder counts per sample, set together with curSpeed */
+	volatile int32_t speedCountsPerTick;
 	/**
 	 * @brief      Constructor
 	 *
@@ -356,7 +792,10 @@ public:
 	/**
 	 * @brief      Measure the strength of the magnet
 	 *
-	 *             This function returns the strength of the magnet.
+	 *             This function returns the strength of the magnet, as last
+	 *             read by the encoder interrupt (see ENCODERDIAGINTERVAL). The
+	 *             encoder chip is only read if the interrupt has not read it
+	 *             yet.
 	 *
 	 * @return     Strength of magnet
 	 */
@@ -368,6 +807,7 @@ public:
 	 *             This function returns the current value of the AGC register
 	 *             in the encoder chip (AS5600). This value ranges between 0 and
 	 *             255, and should preferably be as close to 128 as possible.
+	 *             The value is cached like the one of getStrength().
 	 *
 	 * @return     current AGC value
 	 */
@@ -377,7 +817,8 @@ public:
 	 * @brief      Detect if magnet is present and within range
 	 *
 	 *             This function detects whether the magnet is present, too
-	 *             strong or too weak.
+	 *             strong or too weak. The status is cached like the strength
+	 *             returned by getStrength().
 	 *
 	 * @return     0 - Magnet detected and within limits
 	 * @return     1 - Magnet too strong
@@ -402,6 +843,29 @@ public:
 	 * @return     The angle moved.
 	 */
 	float getAngleMoved(void);
+
+	/**
+	 * @brief      Get the angle moved from reference position, in encoder counts
+	 *
+	 *             Integer version of getAngleMoved(), with 4096 counts per
+	 *             revolution. No floating point arithmetic is used, and the
+	 *             position stays exact for any number of revolutions, until
+	 *             the 32 bit counter overflows.
+	 *
+	 * @return     Encoder counts moved since the reference position
+	 */
+	int32_t getCountsMoved(void);
+
+	/**
+	 * @brief      Get the speed measured by the encoder, in encoder counts per sample
+	 *
+	 *             Integer version of getSpeed(). The speed is in Q16.16 fixed
+	 *             point encoder counts per encoder sample (ENCODERINTFREQ
+	 *             samples per second), i.e. 65536 is one count per sample.
+	 *
+	 * @return     Speed, in Q16.16 counts per encoder sample
+	 */
+	int32_t getSpeedCountsPerTick(void);
 	
 	/**
 	 * @brief      Setup the encoder
@@ -420,7 +884,48 @@ public:
 
 private:
 
-	friend void TIMER1_COMPA_vect(void) __attribute__ ((signal,used));
+	/**
+	 * @brief      Define the reference(home) position from an angle already read
+	 *
+	 * @param      rawAngle  - Angle of the shaft, as read from the encoder chip
+	 */
+	void setHomeAngle(uint16_t rawAngle);
+
+	/** Cached STATUS register of the encoder chip */
+	volatile uint8_t magnetStatus;
+
+	/** Cached AGC register of the encoder chip */
+	volatile uint8_t agc;
+
+	/** Cached MAGNITUDE register of the encoder chip */
+	volatile uint16_t strength;
+
+	/** Bit n is set when diagnostics register n (ENCODERDIAGSTATUS ...) has been read into the cache */
+	volatile uint8_t diagValid;
+
+	/**
+	 * @brief      Make sure a diagnostics register is in the cache
+	 *
+	 *             Reads the register from the encoder chip, if the encoder
+	 *             interrupt has not read it yet.
+	 *
+	 * @param      index  - Diagnostics register (ENCODERDIAGSTATUS ...)
+	 */
+	void updateDiagnostic(uint8_t index);
+
+	/**
+	 * @brief      Store a diagnostics register in the cache
+	 *
+	 * @param      index  - Diagnostics register (ENCODERDIAGSTATUS ...)
+	 * @param      data   - Bytes read from the register
+	 */
+	void storeDiagnostic(uint8_t index, uint8_t *data);
+
+	friend class uStepperSLite;
+
+	friend void TIMER1_COMPA_vect(void) HALISR;
+	friend void encoderSampleReady(bool success);
+	friend void encoderDiagReady(bool success);
 };
 
 /**
@@ -442,11 +947,12 @@ public:
 	 * direction. */
 	volatile int32_t stepsSinceReset;		//offset 0
 	/**	Counter used by the stepgeneration algorithm to check how many
-	*	interrupt ticks has passed since last step was issued
+	*	interrupt ticks has passed since last step was issued (24 bits used)
 	*/
 	volatile uint32_t cntSinceLastStep;		//offset 4
 	/**	This variable holds the delay needed between each step pulse,
-	*	in interrupt ticks.	*/
+	*	in interrupt ticks. Q24.8 format, the lower 8 bits are the fractional
+	*	part of the delay, which is accumulated in stepDelayFraction	*/
 	volatile uint32_t stepDelay;			//offset 8
 	/** This variable tells the algorithm the direction of rotation for
 	 * the commanded move. */
@@ -467,11 +973,16 @@ public:
 	/** This variable is used by the stepper algorithm to keep track of
 	 * which part of the acceleration profile the motor is currently
 	 * operating at. */
-	volatile uint8_t state;	
+	volatile uint8_t state;					//offset 19
 
 	/** This variable is used to indicate which mode the uStepper S-lite is
 	* running in (Normal, Drop-in or PID)*/
-	uint8_t mode;
+	uint8_t mode;							//offset 20
+
+	/** Accumulator for the fractional part of stepDelay. Every time it
+	 * overflows, a step interval is extended by one interrupt tick, so
+	 * the average step rate matches the fractional delay. */
+	volatile uint8_t stepDelayFraction = 0;	//offset 21
 
 	/** This variable contains the number of steps commanded by
 	* external controller, in case of dropin feature */
@@ -492,6 +1003,17 @@ public:
 	 * curve, the acceleration applied will always be either +/- this
 	 * value (acceleration/deceleration)or zero (cruise). */
 	float acceleration;				
+
+	/** This variable contains the maximum jerk in steps/s^3, set by
+	 * setMaxJerk(). Zero selects the trapezoidal profile */
+	float jerk;
+
+	/** Number of encoder samples averaged by the S-curve filter. The
+	 * filter is bypassed when this is 1 */
+	volatile uint8_t jerkFilterLength;
+
+	/** Reciprocal of jerkFilterLength */
+	volatile float jerkFilterGain;
 	
 	/** This variable contains the conversion coefficient from raw
 	* encoder data to number of steps */					
@@ -507,6 +1029,11 @@ public:
 	/** This variable contains the value for converting RPM to steps per second */	
 	float RPMToStepsPerSecond;
 
+#if STEPENGINE == STEPENGINEVACTUAL
+	/** Fraction of a step of the commanded position in NORMAL mode, beyond stepsSinceReset */
+	float vactualFraction;
+#endif
+
 	/** This variable contains the integral coefficient used by the PID */
 	float iTerm;	
 
@@ -516,6 +1043,36 @@ public:
 	/** This variable contains the sensitivity of the stall function, and is set to a value between 0.0 and 1.0*/
 	float stallSensitivity = 0.992;
 
+	/** Stall detection algorithm. @see setStallDetection() */
+	uint8_t stallAlgorithm;
+
+	/** Set to run the stall detection only while the motor is moving */
+	bool stallOnlyWhileMoving;
+
+	/** Stall detection parameter derived from stallSensitivity: the filter weight
+	 *	(STALLDETECTIIR, Q15), the following error limit (STALLDETECTFOLLOWINGERROR,
+	 *	encoder counts Q16) or the number of windows (STALLDETECTVELOCITYRATIO) */
+	int32_t stallLimit;
+
+	/** Encoder counts per step, Q16 */
+	int32_t countsPerStep;
+
+	/** Speed observer. @see setSpeedObserver() */
+	uint8_t speedObserver;
+
+	/** Set to restart the speed observer at the current position, keeping the estimated speed */
+	volatile bool speedObserverRestart;
+
+	/** P and I term of the floating point PLL speed observer, in the units of PULSEFILTERKP and PULSEFILTERKI */
+	float speedObserverGain[2];
+
+	/** Gains of the fixed point speed observers, as mantissas for fixedMul(). Position gain
+	 *	(PLL P term or alpha) first, then velocity gain (PLL I term or beta), per encoder sample */
+	uint16_t speedObserverGainFixed[2];
+
+	/** Shifts of the gains in speedObserverGainFixed */
+	uint8_t speedObserverShiftFixed[2];
+
 	/** This variable converts an angle in degrees into a corresponding
 	 * number of steps*/
 	float angleToStep;	
@@ -560,9 +1117,58 @@ public:
 	/** This variable holds the bool telling if the motor should brake or not*/	
 	bool brake;
 
-	friend void TIMER1_COMPA_vect(void) __attribute__ ((signal,used));
-	friend void TIMER3_COMPA_vect(void) __attribute__ ((signal,used,naked));
-	friend void INT0_vect(void) __attribute__ ((signal,used));
+	/** Moves waiting to be executed. @see queueMoveSteps() */
+	moveQueueEntry_t moveQueue[MOVEQUEUELENGTH];
+
+	/** Index of the oldest move in moveQueue */
+	volatile uint8_t moveQueueHead;
+
+	/** Number of moves in moveQueue */
+	volatile uint8_t moveQueueCount;
+
+	/** Progress of the homing. @see getHomingState() */
+	volatile uint8_t homingState;
+
+	/** Direction to the end searched by the homing */
+	bool homingDir;
+
+	/** Encoder samples left before the homing moves on */
+	uint16_t homingTimer;
+
+	/** Set when the homing has done its approach at the slow speed */
+	bool homingSlowDone;
+
+	/** Steps to move away from the end. @see setHomingParameters() */
+	int32_t homingBackOff;
+
+	/** Speed used to seek the end, 0.0 = maximum velocity */
+	float homingFastVelocity;
+
+	/** Speed used to approach the end again, 0.0 = single approach */
+	float homingSlowVelocity;
+
+	/** Parameters of the homing being run (back off, fast and slow speed) */
+	int32_t homingRunBackOff;
+	float homingRunFastVelocity;
+	float homingRunSlowVelocity;
+
+	/** Maximum velocity to restore when the homing is done */
+	float homingSavedVelocity;
+
+	/** Angle moved when the homing was started, and the result when done */
+	float homingLength;
+
+	/** Function to call when the homing is done */
+	homingCallback_t homingCallback;
+
+	/** This variable counts the encoder interrupts which used more than
+	*	ENCODERINTCYCLEBUDGET CPU cycles */
+	volatile uint16_t encoderIntOverBudget;
+
+	friend void TIMER1_COMPA_vect(void) HALISR;
+	friend void encoderSampleReady(bool success);
+	friend void TIMER3_COMPA_vect(void) STEPGENERATORISR;
+	friend void INT0_vect(void) HALISR;
 	friend void uStepperEncoder::setHome(void);	
 
 
@@ -611,6 +1217,66 @@ public:
 	 */	
 	float getPidError(void);
 
+	/**
+	 * @brief      	Get execution time statistics of an interrupt routine
+	 *
+	 *				Only available when the library is built with ISRPROFILING set to 1.
+	 *
+	 * @param		isr 		- 	Routine to get statistics for (ISRPROFILEENCODER,
+	 *								ISRPROFILESAMPLE, ISRPROFILESTEPGENERATOR, ISRPROFILEDROPIN,
+	 *								ISRPROFILEPID, ISRPROFILESTALL or ISRPROFILEENCODERLATENCY)
+	 * @param		profile 	- 	Pointer to the struct receiving the statistics. The mean
+	 *								value is calculated by this method
+	 *
+	 * @return     	true if the statistics were copied, false if profiling is not enabled
+	 *				or "isr" is not valid
+	 */
+	bool getIsrProfile(uint8_t isr, isrProfile_t *profile);
+
+	/**
+	 * @brief      	Clear the execution time statistics of all interrupt routines
+	 */
+	void resetIsrProfile(void);
+
+	/**
+	 * @brief      	Start recording encoder samples into the trace buffer
+	 *
+	 *				Only available when the library is built with TRACEBUFFERLENGTH above 0.
+	 *				The encoder interrupt records the samples into a ring buffer, until
+	 *				"postTrigger" records have been taken after the trigger. The records
+	 *				before the trigger are kept, up to the size of the buffer. The
+	 *				result is sent with dumpTrace().
+	 *
+	 * @param		trigger 	- 	TRACETRIGGERNOW, TRACETRIGGERMOVE or TRACETRIGGERSTALL
+	 * @param		postTrigger - 	Number of records to take from the trigger on (1 - TRACEBUFFERLENGTH)
+	 * @param		decimation 	- 	Record every "decimation" encoder sample (1 - 255)
+	 *
+	 * @return     	true if the recording was started, false if tracing is not enabled
+	 */
+	bool startTrace(uint8_t trigger = TRACETRIGGERNOW, uint16_t postTrigger = TRACEBUFFERLENGTH, uint8_t decimation = 1);
+
+	/**
+	 * @brief      	Get the state of the trace recording
+	 *
+	 * @return     	TRACEIDLE, TRACEARMED, TRACETRIGGERED or TRACEDONE
+	 */
+	uint8_t getTraceState(void);
+
+	/**
+	 * @brief      	Stop the trace recording, and send the records as a binary frame on Serial
+	 *
+	 *				The frame consists of TRACEFRAMESYNC1, TRACEFRAMESYNC2, the version
+	 *				(TRACEFRAMEVERSION), the record size in bytes, the number of records
+	 *				(uint16_t), the index of the trigger record (uint16_t, 0xFFFF if not
+	 *				triggered), ENCODERINTFREQ (uint16_t), the decimation (uint8_t), the
+	 *				records oldest first (traceRecord_t, little endian), and a checksum:
+	 *				0xAA XOR'ed with every byte from the version on. extras/traceDecoder.py
+	 *				turns the frame into CSV.
+	 *
+	 * @return     	Number of records sent
+	 */
+	uint16_t dumpTrace(void);
+
 	/** This variable contains the current PID errror.
 	*
 	*/	
@@ -662,6 +1328,26 @@ public:
 	 */
 	void setMaxAcceleration(float accel);
 
+	/**
+	 * @brief      Set the maximum jerk of the stepper motor.
+	 *
+	 *             This function selects between the trapezoidal and the
+	 *             S-curve (jerk limited) acceleration profile. With a jerk
+	 *             of zero (default), the acceleration jumps between -a, 0
+	 *             and a. With a jerk larger than zero, the speed of the
+	 *             trapezoidal profile is averaged over a/jerk seconds
+	 *             before it reaches the step generator, so the acceleration
+	 *             ramps linearly between these values instead. The profile
+	 *             keeps its states and the number of steps, and every ramp
+	 *             takes a/jerk seconds longer.
+	 *
+	 *             The ramp time is rounded to a whole number of encoder
+	 *             samples, between 1 and JERKFILTERMAXLENGTH.
+	 *
+	 * @param      jerk  - Maximum jerk in steps/s^3, or 0.0 for a trapezoidal profile
+	 */
+	void setMaxJerk(float jerk);
+
 	/**
 	 * @brief      Sets the maximum rotational velocity of the motor
 	 *
@@ -699,7 +1385,10 @@ public:
 	 *             by setMaximumVelocity() function. The direction of rotation
 	 *             is set by the argument "dir". The argument "holdMode",
 	 *             defines whether the motor should brake or let the motor
-	 *             freewheel after the steps has been performed.
+	 *             freewheel after the steps has been performed. While the motor
+	 *             runs in the direction "dir", the steps are added to the end of
+	 *             the running move. In the other direction, they are counted from
+	 *             where the motor stops.
 	 *
 	 * @param      steps     -	Number of steps to be performed.
 	 * @param      dir       -	Can be set to "CCW" or "CW" (without the quotes).
@@ -852,6 +1541,20 @@ public:
 	 */
 	int32_t getStepsSinceReset(void);
 
+	/**
+	 * @brief      Get a consistent snapshot of the motion controller
+	 *
+	 *             The encoder interrupt publishes the encoder position, the
+	 *             steps applied, the PID error, the measured speed and the
+	 *             state of the motion profile at the end of every sample. This
+	 *             function copies the last published set, so all values come
+	 *             from the same sample, without disabling interrupts. Two
+	 *             snapshots with the same sequence number hold the same sample.
+	 *
+	 * @param[out] snapshot - Struct receiving the snapshot
+	 */
+	void getSnapshot(motionSnapshot_t *snapshot);
+
 	/**
 	 * @brief      Set motor run and hold current
 	 *
@@ -899,6 +1602,60 @@ public:
 	 */
 	float moveToEnd(bool dir, float stallSensitivity = 0.992);
 
+	/**
+	 * @brief      	Sets the back off distance and speeds used by startHoming()
+	 *
+	 *				With a slow velocity of zero (default), the motor runs towards the end
+	 *				once, like moveToEnd(). Otherwise it runs towards the end at the fast
+	 *				velocity, backs off, and approaches the end again at the slow velocity,
+	 *				which makes the home position more repeatable.
+	 *
+	 * @param[in]  	backOffSteps - Number of steps to move away from the end, after it is reached (default 20)
+	 * @param[in]  	fastVelocity - Speed in steps/s used to seek the end, or 0.0 to use the maximum velocity (default)
+	 * @param[in]  	slowVelocity - Speed in steps/s used to approach the end again, or 0.0 to skip the second approach (default)
+	 */
+	void setHomingParameters(int32_t backOffSteps, float fastVelocity = 0.0, float slowVelocity = 0.0);
+
+	/**
+	 * @brief      	Starts moving the motor to its physical limit, without blocking
+	 *
+	 *				Does the same as moveToEnd(), driven by the encoder interrupt, so the
+	 *				caller can do other work meanwhile. Progress is read with getHomingState(),
+	 *				and the callback, if any, is called when the home position has been set.
+	 *				The callback runs in interrupt context, so it must be short and must not
+	 *				block (see homingCallback_t).
+	 *				The maximum velocity set by setMaxVelocity() is restored when done.
+	 *
+	 * @param[in]  	dir - Direction to turn. CW or CCW
+	 * @param[in]  	stallSensitivity - Sensitivity of stall detection (0.0 - 1.0), low is more sensitive
+	 * @param[in]  	callback - Function to call when done, or NULL
+	 *
+	 * @return 		1 = homing started, 0 = drop-in mode active, or homing already running
+	 */
+	bool startHoming(bool dir, float stallSensitivity = 0.992, homingCallback_t callback = NULL);
+
+	/**
+	 * @brief      	Returns the progress of the homing started by startHoming()
+	 *
+	 * @return 		HOMINGIDLE, HOMINGSETTLE, HOMINGSEEK, HOMINGBACKOFF, HOMINGAPPROACH, HOMINGFINISH or HOMINGDONE
+	 */
+	uint8_t getHomingState(void);
+
+	/**
+	 * @brief      	Returns the result of the last homing
+	 *
+	 * @return 		Degrees turned from the start of the homing, till the end was reached
+	 */
+	float getHomingLength(void);
+
+	/**
+	 * @brief      	Stops a running homing
+	 *
+	 *				The motor is stopped, the home position is not changed and the
+	 *				callback is not called.
+	 */
+	void abortHoming(void);
+
 	/**
 	 * @brief      	Moves the motor to an absolute angle
 	 *
@@ -922,6 +1679,85 @@ public:
 	 */
 	void moveAngle(float angle, bool holdMode = BRAKEON);
 
+	/**
+	 * @brief      	Moves the motor to an absolute position in steps
+	 *
+	 *				Integer version of moveToAngle(). The position is given in the
+	 *				same steps as returned by getStepsSinceReset(), so repeated
+	 *				moves to absolute positions do not accumulate rounding errors.
+	 *				If the motor is moving, the position replaces the target of the
+	 *				running move.
+	 *
+	 * @param[in]  	steps  Absolute position in steps. The motor turns clockwise
+	 *				if the position is above the current one, and counterclockwise
+	 *				if it is below.
+	 *
+	 * @param[in]  	holdMode can be set to "HARD" for brake mode or "SOFT" for
+	 *              freewheel mode (without the quotes).
+	 */
+	void moveTo(int32_t steps, bool holdMode = BRAKEON);
+
+	/**
+	 * @brief      	Adds a move to the motion queue
+	 *
+	 *				The move starts when the moves before it are done, without
+	 *				waiting for the caller. Moves in the same direction run as one
+	 *				move, so the motor only slows down where it has to stop: before a
+	 *				change of direction, or at the end of the queue. The speed at the
+	 *				junction between two moves is the highest speed the motor can still
+	 *				stop from, within the remaining steps in that direction. A move queued
+	 *				in the direction of the one currently running extends it the same way.
+	 *
+	 *				The queue is emptied by stop().
+	 *
+	 * @param[in]  	steps - Number of steps to move
+	 * @param[in]  	dir - Direction to move. CW or CCW
+	 * @param[in]  	holdMode can be set to "HARD" for brake mode or "SOFT" for
+	 *              freewheel mode (without the quotes), used if the motor stops after this move.
+	 *
+	 * @return 		1 = move queued, 0 = queue full, or drop-in mode active
+	 */
+	bool queueMoveSteps(int32_t steps, bool dir, bool holdMode = BRAKEON);
+
+	/**
+	 * @brief      	Adds a relative move to the motion queue
+	 *
+	 * @param[in]  	angle  Angle relative to the end of the previous move. A positive angle makes
+	 *				the motor turn clockwise, and a negative angle, counterclockwise.
+	 * @param[in]  	holdMode can be set to "HARD" for brake mode or "SOFT" for
+	 *              freewheel mode (without the quotes).
+	 *
+	 * @return 		1 = move queued, 0 = queue full, or drop-in mode active
+	 */
+	bool queueMoveAngle(float angle, bool holdMode = BRAKEON);
+
+	/**
+	 * @brief      	Adds a move to an absolute angle to the motion queue
+	 *
+	 * @param[in]  	angle  Absolute angle to reach, after the moves already queued.
+	 * @param[in]  	holdMode can be set to "HARD" for brake mode or "SOFT" for
+	 *              freewheel mode (without the quotes).
+	 *
+	 * @return 		1 = move queued, 0 = queue full, or drop-in mode active
+	 */
+	bool queueMoveToAngle(float angle, bool holdMode = BRAKEON);
+
+	/**
+	 * @brief      	Returns the number of moves waiting in the motion queue
+	 *
+	 *				The move being executed is not counted.
+	 *
+	 * @return 		Number of queued moves (0 - MOVEQUEUELENGTH)
+	 */
+	uint8_t getQueueLength(void);
+
+	/**
+	 * @brief      	Removes all moves waiting in the motion queue
+	 *
+	 *				The move being executed is finished normally.
+	 */
+	void clearQueue(void);
+
 	/**
 	 * @brief      	This method returns a bool variable indicating wether the motor
 	 *				is stalled or not
@@ -932,6 +1768,46 @@ public:
 	 */
 	bool isStalled(float stallSensitivity = 0.992);
 
+	/**
+	 * @brief      	Selects how stalls are detected
+	 *
+	 *				The stall detection compares the encoder with the motion profile every
+	 *				encoder sample, using the sensitivity given to isStalled():
+	 *				- STALLDETECTIIR (default): the filtered encoder speed is below half the
+	 *				  profile speed for a time set by the sensitivity (around 0.75 s at 0.992).
+	 *				- STALLDETECTFOLLOWINGERROR: the encoder is more than sensitivity times
+	 *				  STALLFOLLOWINGERRORMAX full steps behind or ahead of the profile.
+	 *				  Fast, but needs a correct number of microsteps in setup().
+	 *				- STALLDETECTVELOCITYRATIO: the encoder turned less than half of the profile,
+	 *				  in up to STALLWINDOWCOUNTMAX windows of STALLWINDOWLENGTH samples in a row.
+	 *				- STALLDETECTOFF: no detection, isStalled() always returns 0.
+	 *
+	 * @param[in]  	algorithm - STALLDETECTIIR, STALLDETECTFOLLOWINGERROR, STALLDETECTVELOCITYRATIO or STALLDETECTOFF
+	 * @param[in]  	onlyWhileMoving - true = skip the detection while the motor is stopped, saving CPU time
+	 */
+	void setStallDetection(uint8_t algorithm, bool onlyWhileMoving = false);
+
+	/**
+	 * @brief      	Selects how the speed of the motor is estimated from the encoder
+	 *
+	 *				The observer tracks the encoder position (or the step input in DROPIN
+	 *				mode), and gives the speed returned by uStepperEncoder::getSpeed():
+	 *				- SPEEDOBSERVERPLL (default): PI tracking loop, damping 1.34.
+	 *				- SPEEDOBSERVERALPHABETA: alpha-beta tracker, critically damped.
+	 *				- SPEEDOBSERVERKALMAN: steady state Kalman filter, damping around 0.7.
+	 *
+	 *				A higher bandwidth reduces the lag of the estimate on accelerations, at
+	 *				the cost of more encoder noise in the estimate. At the same bandwidth,
+	 *				SPEEDOBSERVERKALMAN lags least and SPEEDOBSERVERPLL most. The lag during
+	 *				constant acceleration approaches 2*damping/(2*pi*bandwidth) seconds. The
+	 *				observer restarts from the current position and speed.
+	 *
+	 * @param[in]  	observer - SPEEDOBSERVERPLL, SPEEDOBSERVERALPHABETA or SPEEDOBSERVERKALMAN
+	 * @param[in]  	bandwidth - Natural frequency of the observer in Hz, between
+	 *				SPEEDOBSERVERMINBANDWIDTH and SPEEDOBSERVERMAXBANDWIDTH
+	 */
+	void setSpeedObserver(uint8_t observer, float bandwidth = SPEEDOBSERVERBANDWIDTH);
+
 	/**
 	 * @brief      	This method disables the PID until calling enablePid.
 	 *
@@ -990,9 +1866,34 @@ public:
 	 *				Set Run Current (percent): 'runCurrent=50.0;'
 	 *				Set Hold Current (percent): 'holdCurrent=50.0;'	
 	 *
+	 *				This method never returns. Use dropinCliService() to run other
+	 *				code next to the command interface.
+	 *
 	 */	
 	void dropinCli();
 
+	/**
+	 * @brief      	This method handles the Drop-in command interface without blocking.
+	 *
+	 *				Processes the bytes received on Serial since the last call, executing
+	 *				complete text commands and binary frames, and returns at once. Call it
+	 *				from loop(), next to any other code of the sketch. The commands are
+	 *				the same as for dropinCli().
+	 *
+	 */
+	void dropinCliService(void);
+
+	/**
+	 * @brief      	This method is used for the dropinCli to take in user commands.
+	 *
+	 *				The command is matched against a table of command names stored in
+	 *				flash, and numbers are parsed without temporary String objects.
+	 *
+	 * @param[in]  	cmd - input from terminal for dropinCli, terminated by ';' and a zero
+	 *			
+	 */
+	void parseCommand(const char *cmd);
+
 	/**
 	 * @brief      	This method is used for the dropinCli to take in user commands.
 	 *
@@ -1001,6 +1902,19 @@ public:
 	 */
 	void parseCommand(String *cmd);
 
+	/**
+	 * @brief      	This method is used for the dropinCli to take in binary frames.
+	 *
+	 *				Complete frames with a valid CRC are executed and answered on Serial.
+	 *				Frames with a wrong CRC or length are dropped. @see DROPINFRAMESYNC
+	 *
+	 * @param[in]  	data - byte received from the terminal
+	 *
+	 * @return     	true if the byte belongs to a binary frame, false if it should be
+	 *				handled by the text interface
+	 */
+	bool dropinProtocolReceive(uint8_t data);
+
 	/**
 	 * @brief      	This method is used to print the dropinCli menu explainer:
 	 *				
@@ -1015,6 +1929,7 @@ public:
 	 *				Get Run/Hold Current Settings: 'current;'
 	 *				Set Run Current (percent): 'runCurrent=50.0;'
 	 *				Set Hold Current (percent): 'holdCurrent=50.0;'	
+	 *				Print and clear ISR profiling statistics: 'profile;'
 	 *
 	 */	
 	void dropinPrintHelp();
@@ -1029,6 +1944,77 @@ private:
 	 */
 	bool detectStall(void);
 
+	/**
+	 * @brief      	This method calculates the stall detection parameters from the sensitivity and algorithm.
+	 *			
+	 */
+	void updateStallDetection(void);
+
+	/**
+	 * @brief      	This method sets the length of the S-curve filter from the maximum acceleration and jerk.
+	 *			
+	 */
+	void updateJerkFilter(void);
+
+	/**
+	 * @brief      	This method starts the moves at the head of the motion queue.
+	 *
+	 *				Called by the acceleration profile generator when the motor has stopped.
+	 *				Every queued move in the same direction as the first one is taken out
+	 *				of the queue and executed as a single move.
+	 *			
+	 */
+	void startQueuedMoves(void);
+
+	/**
+	 * @brief      	This method plans a move of "steps" steps, starting at the step position "start".
+	 *
+	 *				The thresholds of the new move are published to the encoder interrupt in
+	 *				a single critical section. Callers read "start" and the steps to move in
+	 *				one critical section, so the move ends exactly at start +/- steps, even if
+	 *				the profile moves on while the move is planned.
+	 *			
+	 */
+	void moveStepsFrom(int32_t start, int32_t steps, bool dir, bool holdMode);
+
+	/**
+	 * @brief      	This method starts a homing run.
+	 *
+	 * @param[in]	dir - Direction to the end
+	 * @param[in]	stallSensitivity - Sensitivity of stall detection (0.0 - 1.0)
+	 * @param[in]	backOff - Steps to move away from the end
+	 * @param[in]	fastVelocity - Speed used to seek the end, 0.0 = maximum velocity
+	 * @param[in]	slowVelocity - Speed used to approach the end again, 0.0 = single approach
+	 * @param[in]	callback - Function to call when done, or NULL. Called in interrupt
+	 *				context, so it must be short and must not block (see homingCallback_t)
+	 *
+	 * @return     	1 = started, 0 = not started
+	 *			
+	 */
+	bool beginHoming(bool dir, float stallSensitivity, int32_t backOff, float fastVelocity, float slowVelocity, homingCallback_t callback);
+
+	/**
+	 * @brief      	This method runs the homing state machine.
+	 *
+	 *				Called by the encoder interrupt, after the stall detection.
+	 *			
+	 */
+	void homingService(void);
+
+#if STEPENGINE == STEPENGINEVACTUAL
+	/**
+	 * @brief      	This method sets VACTUAL of the driver from the motion profile (STEPENGINEVACTUAL).
+	 *
+	 *				Called by the encoder interrupt in NORMAL mode, and in PID mode with the PID
+	 *				disabled. In NORMAL mode the speed is integrated into stepsSinceReset, in place
+	 *				of the steps counted by a step generator, and the difference to the encoder
+	 *				position is added as a speed correction (VACTUALPOSITIONGAIN).
+	 *
+	 * @param		speed 	- 	Speed of the motion profile, in steps per second
+	 */
+	void vactualService(float speed);
+#endif
+
 	/**	This variable holds the dropin settings.
 	*	@see dropinCliSettings_t*/
 	dropinCliSettings_t dropinSettings;
@@ -1045,6 +2031,22 @@ private:
 	 */
 	bool loadDropinSettings(void);
 
+	/**
+	 * @brief      	This method applies the dropin settings to the PID controller and the driver
+	 *			
+	 */
+	void applyDropinSettings(void);
+
+	/**
+	 * @brief      	This method executes a binary frame, and sends the response
+	 *
+	 * @param[in]	opcode - opcode of the frame
+	 * @param[in]	payload - payload of the frame
+	 * @param[in]	length - length of the payload
+	 *			
+	 */
+	void dropinProtocolExecute(uint8_t opcode, uint8_t *payload, uint8_t length);
+
 	/**
 	 * @brief      	This method stores the current dropin settings in EEPROM
 	 *			